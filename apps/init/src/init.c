@@ -21,7 +21,8 @@ void main(void* args){
     FILE* fp = fopen("/initrd/init.cfg", "r");
     if(fp == NULL){
         _km_write("init", "error loading config file (/initrd/init.cfg)");
-        while(1);
+        while(1)
+            _task_sleep(1000000);
     }
     //Read data by lines
     char line[512];
@@ -79,5 +80,7 @@ void main(void* args){
     //At this point, init's job is done.
     fclose(fp);
 
-    while(1);
+    //Stay around without using the CPU
+    while(1)
+        _task_sleep(1000000);
 }
\ No newline at end of file
@@ -327,6 +327,7 @@ void main(void* args){
 
     create_prompt_window();
 
+    uint64_t next_frame = rdtsc();
     while(1){
         //Update the PS/2 state
         ps2_check();
@@ -338,5 +339,10 @@ void main(void* args){
             (uint8_t*)cur_cur->image.data, cur_cur->image.size);
         //Update the framebuffer
         gfx_flip();
+        //Give the CPU away until it's time for the next frame
+        next_frame += cpu_fq * 1000 / NGUI_FPS;
+        if(next_frame < rdtsc())
+            next_frame = rdtsc();
+        _task_sleep_until(next_frame);
     }
 }
\ No newline at end of file
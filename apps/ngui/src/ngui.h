@@ -4,6 +4,11 @@
 #include "gfx.h"
 #include "ps2.h"
 
+//Settings
+
+//Frames drawn per second at most
+#define NGUI_FPS 60
+
 //Structure definitions
 
 //Cursor
@@ -80,6 +80,27 @@ inline sc_state_t _task_pfree(void* start){
     return _syscall(1, 4, (uint64_t)start, 0, 0, 0, 0);
 }
 
+/*
+ * System call: Task management: Give the rest of the time slice to other tasks
+ */
+inline sc_state_t _task_yield(void){
+    return _syscall(1, 5, 0, 0, 0, 0, 0);
+}
+
+/*
+ * System call: Task management: Sleep until the TSC reaches a value
+ */
+inline sc_state_t _task_sleep_until(uint64_t tsc){
+    return _syscall(1, 6, tsc, 0, 0, 0, 0);
+}
+
+/*
+ * System call: Task management: Sleep for some microseconds
+ */
+inline sc_state_t _task_sleep(uint64_t us){
+    return _syscall(1, 7, us, 0, 0, 0, 0);
+}
+
 
 // -----===== SYSTEM CALLS: FILESYSTEM =====-----
 
@@ -119,6 +140,13 @@ inline sc_state_t _fs_close(FILE* file){
     return _syscall(2, 4, (uint64_t)file, 0, 0, 0, 0);
 }
 
+/*
+ * System call: Filesystem: Set the time blocking reads wait for in microseconds (0 = forever)
+ */
+inline sc_state_t _fs_set_timeout(FILE* file, uint64_t us){
+    return _syscall(2, 5, (uint64_t)file, us, 0, 0, 0);
+}
+
 
 // -----===== SYSTEM CALLS: KERNEL MESSAGES =====-----
 
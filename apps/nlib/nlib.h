@@ -107,14 +107,19 @@ typedef ll_t dict_t;
 uint64_t _syscall(uint32_t func, uint32_t subfunc,
                   uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4);
 //Syscalls: Task management
-uint64_t   _task_get_pid   (void);
-sc_state_t _task_terminate (uint64_t pid);
-uint64_t   _task_load      (char* path, uint64_t privl);
-void*      _task_palloc    (uint64_t num);
-sc_state_t _task_pfree     (void* start);
+uint64_t   _task_get_pid     (void);
+sc_state_t _task_terminate   (uint64_t pid);
+uint64_t   _task_load        (char* path, uint64_t privl);
+void*      _task_palloc      (uint64_t num);
+sc_state_t _task_pfree       (void* start);
+sc_state_t _task_yield       (void);
+sc_state_t _task_sleep_until (uint64_t tsc);
+sc_state_t _task_sleep       (uint64_t us);
 #define    ELF_STATUS_OK                    0
 #define    ELF_STATUS_FILE_INACCESSIBLE     1
 #define    ELF_STATUS_INCOMPATIBLE          2
+#define    ELF_STATUS_ESCALATION_ERROR      3
+#define    ELF_STATUS_OUT_OF_MEMORY         4
 #define    TASK_PRIVL_EVERYTHING            (0xFFFFFFFFFFFFFFFFULL & ~TASK_PRIVL_INHERIT & ~TASK_PRIVL_SUDO_MODE)
 #define    TASK_PRIVL_INHERIT               (1ULL << 63)
 #define    TASK_PRIVL_KMESG                 (1ULL << 0)
@@ -123,10 +128,12 @@ sc_state_t _task_pfree     (void* start);
 #define    TASK_PRIVL_DEVFILES              (1ULL << 3)
 //Syscalls: Filesystem
 sc_state_t _fs_open       (char* path, uint64_t mode);
-sc_state_t _fs_read_bytes (FILE* file, void* buf, size_t len);
+sc_state_t _fs_read_bytes  (FILE* file, void* buf, size_t len);
+sc_state_t _fs_set_timeout (FILE* file, uint64_t us);
 #define    FS_MODE_READ                     1
 #define    FS_MODE_WRITE                    2
 #define    FS_MODE_APPEND                   4
+#define    FS_MODE_BLOCKING                 8
 #define    FS_STATUS_OK                     0
 #define    FS_STATUS_FILE_DOESNT_EXIST      1
 #define    FS_STATUS_MODE_NOT_APPLICABLE    2
@@ -134,6 +141,11 @@ sc_state_t _fs_read_bytes (FILE* file, void* buf, size_t len);
 #define    FS_RD_STATUS_INVL_PTR            4
 #define    FS_RD_STATUS_ERROR               5
 #define    FS_RD_STATUS_EOF                 6
+//Extended state components the tasks may use, as read from /sys/xfeat
+#define    XFEAT_X87                        (1ULL << 0)
+#define    XFEAT_SSE                        (1ULL << 1)
+#define    XFEAT_AVX                        (1ULL << 2)
+#define    XFEAT_AVX512                     (7ULL << 5)
 //Syscalls: Kernel messages
 sc_state_t _km_write (char* file, char* msg);
 //File I/O
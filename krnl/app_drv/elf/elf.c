@@ -8,47 +8,67 @@
 #include "../../drivers/gfx.h"
 #include "../../vmem/vmem.h"
 #include "../../mtask/mtask.h"
+#include "../../vmem/pmem.h"
+
+//The list of images that are in use
+elf_image_t* elf_images = NULL;
 
 /*
- * Loads and executes an ELF file
+ * Frees an image along with everything it holds
  */
-uint8_t elf_load(char* path, uint64_t privl, uint8_t prio){
-    //Check requested privileges
-    if(mtask_get_pid() > 0)
-        if(popcnt(privl ^ mtask_get_by_pid(mtask_get_pid())->privl) > 0)
-            return ELF_STATUS_ESCALATION_ERROR;
+static void elf_free_image(elf_image_t* image){
+    for(uint32_t i = 0; i < image->seg_cnt; i++){
+        elf_segment_t* seg = &image->segs[i];
+        for(uint64_t p = 0; p < seg->num; p++)
+            pmem_free(seg->frames[p], 0);
+        free(seg->frames);
+    }
+    if(image->symtab != NULL)
+        free(image->symtab);
+    if(image->strtab != NULL)
+        free(image->strtab);
+    diskio_close(image->file);
+    diskio_free_handle(image->file);
+    free(image);
+}
+
+/*
+ * Reads the headers of an ELF file and prepares an image that can be shared by tasks
+ * Returns NULL and sets the status if it can't be loaded
+ */
+static elf_image_t* elf_read_image(char* path, uint8_t* status){
     //Open the file
-    file_handle_t file;
-    if(diskio_open(path, &file, DISKIO_FILE_ACCESS_READ) != DISKIO_STATUS_OK)
-        return ELF_STATUS_FILE_INACCESSIBLE;
+    //  (the handle stays open as long as the image is used)
+    file_handle_t* file = diskio_alloc_handle();
+    if(diskio_open(path, file, DISKIO_FILE_ACCESS_READ) != DISKIO_STATUS_OK){
+        diskio_free_handle(file);
+        *status = ELF_STATUS_FILE_INACCESSIBLE;
+        return NULL;
+    }
+    //The handle belongs to the image, not to the task that happened to load it,
+    //  so it's read with diskio_read_krnl() from here on
+    mtask_remove_open_file(file);
+    file->pid = DISKIO_KRNL_PID;
+    elf_image_t* image = (elf_image_t*)calloc(1, sizeof(elf_image_t));
+    strcpy(image->path, path);
+    image->file = file;
     //Read the ELF header
     union {
         uint8_t raw[sizeof(elf_hdr_t)];
         elf_hdr_t hdr;
     } elf_hdr;
-    diskio_read(&file, elf_hdr.raw, sizeof(elf_hdr_t));
-    //Check the format (ELF32/ELF64)
-    if(elf_hdr.hdr.bits != 2)
-        return ELF_STATUS_INCOMPATIBLE;
-    //Check the architecture (should be x86-64)
-    if(elf_hdr.hdr.instruction_set != 0x3E)
-        return ELF_STATUS_INCOMPATIBLE;
-    //Check the type (should be EXECUTABLE)
-    if(elf_hdr.hdr.type != 2)
-        return ELF_STATUS_INCOMPATIBLE;
-    //Create a virtual memory space
-    uint64_t cr3 = vmem_create_pml4(vmem_create_pcid());
-    vmem_map_defaults(cr3);
-    //Get the .shrtrtab section offset
-    file.position = elf_hdr.hdr.sec_hdr_table_pos + (elf_hdr.hdr.sect_names_idx * elf_hdr.hdr.sect_hdr_entry_sz) + 24;
-    uint64_t shrtrtab_offs = 0;
-    diskio_read(&file, (void*)&shrtrtab_offs, 8);
+    diskio_read_krnl(file, elf_hdr.raw, sizeof(elf_hdr_t));
+    //Check the format (ELF32/ELF64), the architecture (should be x86-64)
+    //  and the type (should be EXECUTABLE)
+    if(elf_hdr.hdr.bits != 2 || elf_hdr.hdr.instruction_set != 0x3E || elf_hdr.hdr.type != 2){
+        elf_free_image(image);
+        *status = ELF_STATUS_INCOMPATIBLE;
+        return NULL;
+    }
+    image->entry = elf_hdr.hdr.entry_pos;
     //Some variables to help with loading
-    uint64_t next_addr = 0;
-    uint8_t* symtab = NULL;
-    uint8_t* strtab = NULL;
     uint32_t symtab_link = 0;
-    //Go through the sections
+    //Go through the sections to load the symbol table
     for(uint32_t i = 0; i < elf_hdr.hdr.sect_hdr_entry_cnt; i++){
         uint32_t offs = elf_hdr.hdr.sec_hdr_table_pos + (i * elf_hdr.hdr.sect_hdr_entry_sz);
         //Read the data
@@ -64,65 +84,135 @@ uint8_t elf_load(char* path, uint64_t privl, uint8_t prio){
                 uint64_t link;
              } __attribute__((packed)) hdr;
         } sect_hdr;
-        file.position = offs;
-        diskio_read(&file, sect_hdr.raw, elf_hdr.hdr.sect_hdr_entry_sz);
-        //Read section name
-        char s_name[32];
-        file.position = shrtrtab_offs + sect_hdr.hdr.name_offs;
-        diskio_read(&file, s_name, 32);
-        //Load the section if needed
-        if(sect_hdr.hdr.type == 1 //SHT_PROGBITS
-            && sect_hdr.hdr.size > 0){
-            //Allocate memory
-            uint8_t* addr = (uint8_t*)amalloc(sect_hdr.hdr.size, 4096);
-            //Copy the data
-            file.position = sect_hdr.hdr.offs;
-            diskio_read(&file, addr, sect_hdr.hdr.size);
-            //Map the section
-            uint64_t target_addr = 0;
-            if(sect_hdr.hdr.addr == 0)
-                target_addr = next_addr;
-            else
-                target_addr = sect_hdr.hdr.addr;
-            //If this page is already mapped, don't do anything
-            //Otherwise, map
-            if(!vmem_present_page(cr3, (virt_addr_t)target_addr)){
-                vmem_map_user(cr3, (phys_addr_t)vmem_virt_to_phys(vmem_get_cr3(), addr),
-                                   (phys_addr_t)((uint64_t)vmem_virt_to_phys(vmem_get_cr3(), addr) + sect_hdr.hdr.size),
-                                   (virt_addr_t)target_addr);
-            }
-            //Advance next address
-            if(sect_hdr.hdr.addr == 0) {
-                next_addr += sect_hdr.hdr.size;
-                next_addr += 4096 - (next_addr % 4096);
-            }
-        }
+        file->position = offs;
+        diskio_read_krnl(file, sect_hdr.raw, elf_hdr.hdr.sect_hdr_entry_sz);
         //Load the symbol table
         if(sect_hdr.hdr.type == 2 //SHT_SYMTAB
             && sect_hdr.hdr.size > 0){
             //Copy the data
-            symtab = (uint8_t*)malloc(sect_hdr.hdr.size + sizeof(uint32_t));
-            file.position = sect_hdr.hdr.offs;
-            diskio_read(&file, symtab + sizeof(uint32_t), sect_hdr.hdr.size);
+            image->symtab = (uint8_t*)malloc(sect_hdr.hdr.size + sizeof(uint32_t));
+            file->position = sect_hdr.hdr.offs;
+            diskio_read_krnl(file, image->symtab + sizeof(uint32_t), sect_hdr.hdr.size);
             //Write the section size
-            *(uint32_t*)symtab = sect_hdr.hdr.size / sizeof(elf_sym_t);
+            *(uint32_t*)image->symtab = sect_hdr.hdr.size / sizeof(elf_sym_t);
             //Set the linked section
             symtab_link = sect_hdr.hdr.link;
         }
         //Load the symbol string table
         if(i == symtab_link){
-            strtab = (uint8_t*)malloc(sect_hdr.hdr.size);
-            file.position = sect_hdr.hdr.offs;
-            diskio_read(&file, strtab, sect_hdr.hdr.size);
+            image->strtab = (uint8_t*)malloc(sect_hdr.hdr.size);
+            file->position = sect_hdr.hdr.offs;
+            diskio_read_krnl(file, image->strtab, sect_hdr.hdr.size);
+        }
+    }
+    //Go through the loadable segments
+    for(uint32_t i = 0; i < elf_hdr.hdr.pgm_hdr_entry_cnt; i++){
+        elf_phdr_t phdr;
+        file->position = elf_hdr.hdr.pgm_hdr_table_pos + (i * elf_hdr.hdr.pgm_hdr_entry_sz);
+        diskio_read_krnl(file, &phdr, sizeof(elf_phdr_t));
+        if(phdr.type != ELF_PT_LOAD || phdr.mem_size == 0)
+            continue;
+        if(image->seg_cnt == ELF_MAX_SEGMENTS){
+            elf_free_image(image);
+            *status = ELF_STATUS_INCOMPATIBLE;
+            return NULL;
+        }
+        //Segments start at a page boundary, so is the file data in them
+        uint64_t lead = phdr.vaddr & 4095;
+        uint64_t end = (phdr.vaddr + phdr.mem_size + 4095) & ~4095ULL;
+        //A segment can share a page with the previous one, but it can't lie in it entirely
+        if(image->seg_cnt > 0){
+            elf_segment_t* last = &image->segs[image->seg_cnt - 1];
+            if(last->vaddr + (4096 * last->num) >= end){
+                elf_free_image(image);
+                *status = ELF_STATUS_INCOMPATIBLE;
+                return NULL;
+            }
+        }
+        elf_segment_t* seg = &image->segs[image->seg_cnt++];
+        seg->vaddr = phdr.vaddr - lead;
+        seg->num = (lead + phdr.mem_size + 4095) / 4096;
+        seg->file_offs = phdr.offs - lead;
+        seg->file_size = phdr.file_size + lead;
+        seg->writable = (phdr.flags & ELF_PF_W) > 0;
+        seg->frames = (phys_addr_t*)calloc(seg->num, sizeof(phys_addr_t));
+    }
+    return image;
+}
+
+/*
+ * Drops a reference to an image, freeing it if it's not used anymore
+ */
+void elf_release(elf_image_t* image){
+    if(--image->refs > 0)
+        return;
+    //Unlink it
+    for(elf_image_t** link = &elf_images; *link != NULL; link = &(*link)->next){
+        if(*link == image){
+            *link = image->next;
+            break;
         }
     }
-    //Allocate some memory for the stack and map it
-    void* stack = vmem_virt_to_phys(vmem_get_cr3(), calloc(131072, 1));
-    vmem_map_user(cr3, stack, (void*)((uint8_t*)stack + 131072), (void*)(1ULL << 46));
+    elf_free_image(image);
+}
 
+/*
+ * Loads and executes an ELF file
+ * The segments aren't read right away, they're paged in from the file on first access.
+ *   Tasks running the same file share the frames of its segments, writable ones are copied on write
+ */
+uint8_t elf_load(char* path, uint64_t privl, uint8_t prio){
+    //Check requested privileges
+    if(mtask_get_pid() > 0)
+        if(popcnt(privl ^ mtask_get_by_pid(mtask_get_pid())->privl) > 0)
+            return ELF_STATUS_ESCALATION_ERROR;
+    //Find the image if it's already in use, load it otherwise
+    elf_image_t* image = elf_images;
+    while(image != NULL && strcmp(image->path, path) != 0)
+        image = image->next;
+    if(image == NULL){
+        uint8_t status;
+        image = elf_read_image(path, &status);
+        if(image == NULL)
+            return status;
+        image->next = elf_images;
+        elf_images = image;
+    }
+    image->refs++;
+    //Create a virtual memory space
+    uint64_t cr3 = vmem_create_pml4();
+    if(cr3 == 0){
+        elf_release(image);
+        return ELF_STATUS_OUT_OF_MEMORY;
+    }
+    vmem_map_defaults(cr3);
     //Create a new task
-    mtask_create_task(131072, path, prio, 0, cr3,
-        (void*)(1ULL << 46), 1, (void(*)(void*))elf_hdr.hdr.entry_pos, NULL, privl, symtab, strtab);
+    uint64_t pid = mtask_create_task(ELF_STACK_SIZE, path, prio, 0, cr3,
+        (void*)(1ULL << 46), 0, (void(*)(void*))image->entry, NULL, privl, image->symtab, image->strtab);
+    task_t* task = mtask_get_by_pid(pid);
+    task->info->image = image;
+    //Register the stack
+    uint8_t ok = mtask_add_region(task, (virt_addr_t)(1ULL << 46), ELF_STACK_SIZE / 4096, NULL, 0, 0) != NULL;
+    //Register the loadable segments
+    for(uint32_t i = 0; ok && i < image->seg_cnt; i++){
+        elf_segment_t* seg = &image->segs[i];
+        vma_t* region = mtask_add_region(task, (virt_addr_t)seg->vaddr, seg->num,
+                                         image->file, seg->file_offs, seg->file_size);
+        if(region == NULL){
+            ok = 0;
+            break;
+        }
+        region->writable = seg->writable;
+        region->frames = seg->frames;
+    }
+    //Don't run a task that's missing some of its memory
+    //  (stopping it releases the image too)
+    if(!ok){
+        mtask_stop_task(pid);
+        return ELF_STATUS_OUT_OF_MEMORY;
+    }
+    //Run it
+    mtask_start_task(task);
     return ELF_STATUS_OK;
 }
 
@@ -131,14 +221,15 @@ uint8_t elf_load(char* path, uint64_t privl, uint8_t prio){
  */
 void elf_get_sym(task_t* task, uint64_t addr, char* result){
     //Check if that task has a symbol and string table in the first place
-    if(task->symtab == NULL || task->strtab == NULL){
+    task_info_t* info = task->info;
+    if(info->symtab == NULL || info->strtab == NULL){
         strcpy(result, "unknown");
         return;
     }
     //Find the closest symbol
     char symbol_name[256] = "\0";
-    uint32_t sym_cnt = *(uint32_t*)task->symtab;
-    elf_sym_t* sym_arr = (elf_sym_t*)(task->symtab + sizeof(uint32_t));
+    uint32_t sym_cnt = *(uint32_t*)info->symtab;
+    elf_sym_t* sym_arr = (elf_sym_t*)(info->symtab + sizeof(uint32_t));
     uint64_t closest_diff = 0xFFFFFFFFFFFFFFFF;
     for(int i = 0; i < sym_cnt; i++){
         elf_sym_t* sym = &sym_arr[i];
@@ -146,7 +237,7 @@ void elf_get_sym(task_t* task, uint64_t addr, char* result){
             uint64_t diff = addr - sym->val;
             if(diff < closest_diff){
                 closest_diff = diff;
-                strcpy(symbol_name, (char*)(task->strtab + sym->name));
+                strcpy(symbol_name, (char*)(info->strtab + sym->name));
             }
         }
     }
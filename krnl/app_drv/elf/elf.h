@@ -1,5 +1,6 @@
 #include "../../stdlib.h"
 #include "../../mtask/mtask.h"
+#include "../../drivers/disk/diskio.h"
 
 //Definitions
 
@@ -7,6 +8,16 @@
 #define ELF_STATUS_FILE_INACCESSIBLE        1
 #define ELF_STATUS_INCOMPATIBLE             2
 #define ELF_STATUS_ESCALATION_ERROR         3
+#define ELF_STATUS_OUT_OF_MEMORY            4
+
+#define ELF_PT_LOAD                         1
+#define ELF_PF_W                            2
+
+//Maximal number of loadable segments in an image
+#define ELF_MAX_SEGMENTS                    16
+
+//Size of the stack of a new task
+#define ELF_STACK_SIZE                      131072
 
 //Structures
 
@@ -32,6 +43,45 @@ typedef struct {
     uint16_t sect_names_idx;
 } __attribute__((packed)) elf_hdr_t;
 
+typedef struct {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offs;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t file_size;
+    uint64_t mem_size;
+    uint64_t align;
+} __attribute__((packed)) elf_phdr_t;
+
+/*
+ * A loadable segment of an image, aligned to page boundaries
+ * `frames` holds the frames that back its pages in all tasks running the image
+ */
+typedef struct {
+    uint64_t vaddr;
+    uint64_t num;
+    uint64_t file_offs;
+    uint64_t file_size;
+    uint8_t writable;
+    phys_addr_t* frames;
+} elf_segment_t;
+
+/*
+ * An executable image that is shared by all tasks running it
+ */
+typedef struct _elf_image_s {
+    char path[DISKIO_MAX_PATH_LEN];
+    uint64_t refs;
+    file_handle_t* file;
+    uint64_t entry;
+    uint8_t* symtab;
+    uint8_t* strtab;
+    uint32_t seg_cnt;
+    elf_segment_t segs[ELF_MAX_SEGMENTS];
+    struct _elf_image_s* next;
+} elf_image_t;
+
 typedef struct {
     uint32_t name;
     uint8_t  info;
@@ -44,4 +94,5 @@ typedef struct {
 //Function prototypes
 
 uint8_t elf_load(char* path, uint64_t privl, uint8_t prio);
+void elf_release(elf_image_t* image);
 void elf_get_sym(task_t* task, uint64_t addr, char* result);
\ No newline at end of file
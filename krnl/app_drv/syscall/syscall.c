@@ -9,37 +9,28 @@
 #include "../../drivers/gfx.h"
 #include "../../drivers/disk/diskio.h"
 #include "../../krnl.h"
+#include "../../klog.h"
+#include "../../smp.h"
 #include "../elf/elf.h"
 
-//Kernel mode RSP
-uint64_t krnl_rsp = 0;
-
+/*
+ * Sets up system calls on the current processor
+ */
 void syscall_init(void){
-    //Create a kernel mode stack
-    krnl_rsp = (uint64_t)malloc(8192) + 8192;
-    krnl_write_msgf(__FILE__, __LINE__, "system call RSP: 0x%x", krnl_rsp);
-    //Self-modify the syscall wrapper offset
-    krnl_write_msgf(__FILE__, __LINE__, "mov rsp modify address: 0x%x", &syscall_wrapper + 5);
-    *(uint64_t volatile*)(&syscall_wrapper + 5) = krnl_rsp;
+    //Create a kernel mode stack, the wrapper finds it through GS
+    cpu_t* cpu = smp_cur_cpu();
+    cpu->syscall_rsp = (uint64_t)malloc(8192) + 8192;
+    krnl_write_msgf(__FILE__, __LINE__, "system call RSP of CPU %i: 0x%x", cpu->id, cpu->syscall_rsp);
 }
 
 uint64_t syscall_get_krnl_rsp(void){
-    return krnl_rsp;
+    return smp_cur_cpu()->syscall_rsp;
 }
 
 /*
- * Handles a system call
+ * Performs a system call
  */
-uint64_t syscall_handle(void){
-    //Get syscall function/subfunction numbers and arguments
-    uint64_t num, p0, p1, p2, p3, p4;
-    asm volatile("mov %%rdi, %0;"
-                 "mov %%rsi, %1;"
-                 "mov %%rdx, %2;"
-                 "mov %%r8,  %3;"
-                 "mov %%r9,  %4;"
-                 "mov %%r10, %5;" :
-                 "=m"(num), "=m"(p0), "=m"(p1), "=m"(p2), "=m"(p3), "=m"(p4));
+static uint64_t syscall_dispatch(uint64_t num, uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4){
     //Function number is in higher 32 bits
     uint32_t func = num >> 32;
     //Subfunction number is in lower 32 bits
@@ -65,6 +56,15 @@ uint64_t syscall_handle(void){
                 case 4: //free pages
                     mtask_pfree(mtask_get_pid(), (virt_addr_t)p0);
                     return 0;
+                case 5: //yield
+                    mtask_yield();
+                    return 0;
+                case 6: //sleep until the TSC reaches a value
+                    mtask_dly_until(p0);
+                    return 0;
+                case 7: //sleep for some microseconds
+                    mtask_dly_us(p0);
+                    return 0;
                 default: //invalid subfunction number
                     return 0xFFFFFFFFFFFFFFFF;
             }
@@ -75,17 +75,19 @@ uint64_t syscall_handle(void){
                     if(p0 + strlen((char*)p0) >= 0x800000000000ULL)
                         return 0xFFFFFFFFFFFFFFFF;
                     //Try to open the file
-                    file_handle_t* handle = (file_handle_t*)malloc(sizeof(file_handle_t));
+                    file_handle_t* handle = diskio_alloc_handle();
                     uint64_t status = diskio_open((char*)p0, handle, p1);
+                    //Return the handle to the cache if the file couldn't be opened
+                    if(status != DISKIO_STATUS_OK)
+                        diskio_free_handle(handle);
                     //Parse status
                     switch(status){
                         case DISKIO_STATUS_OK: {
                             //Find the handle in the process's handle list
                             uint64_t i = 0;
                             task_t* task = mtask_get_by_pid(mtask_get_pid());
-                            for(i = 0; i < MTASK_MAX_OPEN_FILES; i++)
-                                if(task->open_files[i] == handle)
-                                    break;
+                            while(mtask_get_open_file(task, i) != handle)
+                                i++;
                             //Return the number
                             return i + 0xFF;
                         }
@@ -93,6 +95,8 @@ uint64_t syscall_handle(void){
                             return 2;
                         case DISKIO_STATUS_FILE_NOT_FOUND:
                             return 1;
+                        default:
+                            return status;
                     }
                 }
                 case 1: { //read bytes
@@ -100,7 +104,7 @@ uint64_t syscall_handle(void){
                     if(p1 + p2 >= 0x800000000000ULL)
                         return 0xFFFFFFFFFFFFFFFF;
                     //try to read the data
-                    uint64_t status = diskio_read(mtask_get_by_pid(mtask_get_pid())->open_files[p0 - 0xFF], (void*)p1, p2);
+                    uint64_t status = diskio_read(mtask_get_open_file(mtask_get_by_pid(mtask_get_pid()), p0 - 0xFF), (void*)p1, p2);
                     //Parse status
                     switch(status & 0xFF){
                         case DISKIO_STATUS_NOT_ALLOWED:
@@ -116,7 +120,7 @@ uint64_t syscall_handle(void){
                     if(p1 + p2 >= 0x800000000000ULL)
                         return 0xFFFFFFFFFFFFFFFF;
                     //try to write the data
-                    uint64_t status = diskio_write(mtask_get_by_pid(mtask_get_pid())->open_files[p0 - 0xFF], (void*)p1, p2);
+                    uint64_t status = diskio_write(mtask_get_open_file(mtask_get_by_pid(mtask_get_pid()), p0 - 0xFF), (void*)p1, p2);
                     //Parse status
                     switch(status & 0xFF){
                         case DISKIO_STATUS_NOT_ALLOWED:
@@ -128,13 +132,16 @@ uint64_t syscall_handle(void){
                     }
                 }
                 case 3: { //seek
-                    return diskio_seek(mtask_get_by_pid(mtask_get_pid())->open_files[p0 - 0xFF], p1);
+                    return diskio_seek(mtask_get_open_file(mtask_get_by_pid(mtask_get_pid()), p0 - 0xFF), p1);
                     return DISKIO_STATUS_OK;
                 }
                 case 4: { //close file
-                    diskio_close(mtask_get_by_pid(mtask_get_pid())->open_files[p0 - 0xFF]);
+                    diskio_release(mtask_get_open_file(mtask_get_by_pid(mtask_get_pid()), p0 - 0xFF));
                     return DISKIO_STATUS_OK;
                 }
+                case 5: { //set read timeout
+                    return diskio_set_timeout(mtask_get_open_file(mtask_get_by_pid(mtask_get_pid()), p0 - 0xFF), p1);
+                }
                 default: //invalid subfunction number
                     return 0xFFFFFFFFFFFFFFFF;
             }
@@ -149,8 +156,8 @@ uint64_t syscall_handle(void){
                         return 0xFFFFFFFFFFFFFFFF;
                     if(p1 + strlen((char*)p1) >= 0x800000000000ULL)
                         return 0xFFFFFFFFFFFFFFFF;
-                    //write the message
-                    krnl_write_msg((char*)p0, 0, (char*)p1);
+                    //write the message (userland strings have to be copied)
+                    klog_write((char*)p0, 1, 0, (char*)p1, NULL);
                     return 0;
                 default: //invalid subfunction number
                     return 0xFFFFFFFFFFFFFFFF;
@@ -158,4 +165,21 @@ uint64_t syscall_handle(void){
         default: //invalid function number
             return 0xFFFFFFFFFFFFFFFF;
     }
+}
+
+/*
+ * Handles a system call
+ */
+uint64_t syscall_handle(syscall_frame_t* frame){
+    //Get syscall function/subfunction numbers and arguments
+    uint64_t num = frame->rdi, p0 = frame->rsi, p1 = frame->rdx, p2 = frame->r8, p3 = frame->r9, p4 = frame->r10;
+    smp_lock_krnl();
+    uint64_t ret = syscall_dispatch(num, p0, p1, p2, p3, p4);
+    //If the task has been blocked, make it execute the SYSCALL instruction again once it's woken up
+    if(mtask_wait_restart())
+        frame->rip -= 2;
+    //Don't let a task that has been blocked run any further
+    frame->switch_away = mtask_cur_blocked();
+    smp_unlock_krnl();
+    return ret;
 }
\ No newline at end of file
@@ -4,10 +4,23 @@
 #include "../../krnl.h"
 #include "../../stdlib.h"
 
+//Structure definitions
+
+/*
+ * Registers the system call entry saves, in the order they are on the stack
+ */
+typedef struct {
+    uint64_t switch_away; //set to make the entry code switch tasks instead of returning
+    uint64_t r9, r8, rdx, rsi, rdi;
+    uint64_t rbp, r15, r14, r13, r12, r11, r10;
+    uint64_t rip; //saved RCX
+    uint64_t rsp;
+} __attribute__((packed)) syscall_frame_t;
+
 void syscall_init(void);
 uint64_t syscall_get_krnl_rsp(void);
 
-uint64_t syscall_handle(void);
+uint64_t syscall_handle(syscall_frame_t* frame);
 void syscall_wrapper(void);
 
 #endif
\ No newline at end of file
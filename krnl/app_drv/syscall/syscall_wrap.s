@@ -2,11 +2,11 @@
 .globl   syscall_wrapper
 
 syscall_wrapper:
-    ;//Save all necessary registers
+    ;//Switch to the kernel GS and the stack of this processor
+    swapgs
     mov rbx, rsp
-    ;//This instruction will be self-modified: movq rsp, <something>
-    .byte 0x48, 0xbc
-    .byte 0, 0, 0, 0, 0, 0, 0, 0
+    mov rsp, qword ptr gs:[0]
+    ;//Save all necessary registers, along with the arguments in case the call has to be started over
     push rbx
     push rcx
     push r10
@@ -16,9 +16,24 @@ syscall_wrapper:
     push r14
     push r15
     push rbp
-    ;//Handle syscall (obvious huh)
+    push rdi
+    push rsi
+    push rdx
+    push r8
+    push r9
+    push 0 ;//set by the handler if the task has to be switched away from
+    ;//Handle syscall (obvious huh), it gets the saved registers
+    mov rcx, rsp
+    sub rsp, 40
     call syscall_handle
+    add rsp, 40
     ;//Restore saved registers
+    pop rbx
+    pop r9
+    pop r8
+    pop rdx
+    pop rsi
+    pop rdi
     pop rbp
     pop r15
     pop r14
@@ -27,8 +42,25 @@ syscall_wrapper:
     pop r11
     pop r10
     pop rcx
+    test rbx, rbx
+    jnz syscall_switch
     pop rsp
+    swapgs
     ;//Enable interrupts
     or r11, 1 << 9
     ;//System call return
     sysretq
+
+syscall_switch:
+    ;//The task can't keep running: switch away from it right here instead of returning,
+    ;//  leaving the frame the timer interrupt would have (the selectors are the userland
+    ;//  ones tasks are created with)
+    pop rbx
+    push 0x8B ;//SS
+    push rbx  ;//RSP
+    push r11  ;//RFLAGS
+    push 0x93 ;//CS
+    push rcx  ;//RIP
+    call mtask_save_state
+    call mtask_schedule
+    jmp mtask_restore_state
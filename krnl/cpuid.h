@@ -73,6 +73,29 @@
 #define CPUID_FEAT_ECX_F16C                 (1 << 29)
 #define CPUID_FEAT_ECX_RDRND                (1 << 30)
 #define CPUID_FEAT_ECX_HYPERVISOR           (1 << 31)
+//CPUID structured extended features (leaf 7): EBX
+#define CPUID_FEAT7_EBX_AVX2                (1 <<  5)
+#define CPUID_FEAT7_EBX_ERMS                (1 <<  9)
+#define CPUID_FEAT7_EBX_INVPCID             (1 << 10)
+//CPUID structured extended features (leaf 7): EDX
+#define CPUID_FEAT7_EDX_FSRM                (1 <<  4)
+//CPUID MONITOR/MWAIT features (leaf 5): ECX
+#define CPUID_MWAIT_ECX_EMX                 (1 <<  0)
+#define CPUID_MWAIT_ECX_IBE                 (1 <<  1)
+//CPUID XSAVE features (leaf 0xD, subleaf 1): EAX
+#define CPUID_XSAVE_EAX_XSAVEOPT            (1 <<  0)
+#define CPUID_XSAVE_EAX_XSAVEC              (1 <<  1)
+#define CPUID_XSAVE_EAX_XGETBV1             (1 <<  2)
+//Extended state components (XCR0 bits, leaf 0xD subleaf 0 EAX:EDX)
+#define CPUID_XCR0_X87                      (1 <<  0)
+#define CPUID_XCR0_SSE                      (1 <<  1)
+#define CPUID_XCR0_AVX                      (1 <<  2)
+#define CPUID_XCR0_OPMASK                   (1 <<  5)
+#define CPUID_XCR0_ZMM_HI256                (1 <<  6)
+#define CPUID_XCR0_HI16_ZMM                 (1 <<  7)
+#define CPUID_XCR0_AVX512                   (CPUID_XCR0_OPMASK | CPUID_XCR0_ZMM_HI256 | CPUID_XCR0_HI16_ZMM)
+//CPUID extended features (leaf 0x80000001): EDX
+#define CPUID_EXT_FEAT_EDX_PAGE1GB          (1 << 26)
 
 void cpuid_get_leaf   (uint32_t leaf, uint32_t subleaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx);
 void cpuid_get_vendor (char str[13], uint32_t* max);
@@ -15,18 +15,14 @@ ioapic_t ioapics[IO_APIC_MAX_CNT];
 uint8_t next_ioapic = 0;
 //IRQ to GSI map
 uint32_t gsi_map[256];
+//Local APIC IDs of the processors that can be used
+uint8_t lapic_ids[LAPIC_MAX_CNT];
+uint32_t lapic_cnt = 0;
 
 /*
- * Initializes the Advanced Programmable Interrupt Controller
+ * Initializes the local APIC of the current processor
  */
-void apic_init(void){
-    //LAPIC
-
-    //Disable interrupts
-    __asm__ volatile("cli");
-    //Set LAPIC base
-    lapic_base = 0xFFFFFFFFFFFFE000ULL;
-    krnl_write_msgf(__FILE__, __LINE__, "LAPIC base: 0x%x", lapic_base);
+void lapic_init(void){
     //Set task and processor priority to 0
     lapic_reg_wr(LAPIC_REG_TPR, 0);
     lapic_reg_wr(LAPIC_REG_PPR, 0);
@@ -35,7 +31,11 @@ void apic_init(void){
     lapic_reg_wr(LAPIC_REG_LVT_TIM, 0x10021);
     lapic_reg_wr(LAPIC_REG_LVT_CMCI, 0x10021);
     lapic_reg_wr(LAPIC_REG_LVT_THERM, 0x10021);
-    lapic_reg_wr(LAPIC_REG_LVT_LINT0, 0x8721);
+    //Only the bootstrap processor gets legacy PIC interrupts
+    if(rdmsr(IA32_APIC_BASE_MSR) & IA32_APIC_BASE_BSP)
+        lapic_reg_wr(LAPIC_REG_LVT_LINT0, 0x8721);
+    else
+        lapic_reg_wr(LAPIC_REG_LVT_LINT0, 0x18721);
     lapic_reg_wr(LAPIC_REG_LVT_LINT1, 0x421);
     lapic_reg_wr(LAPIC_REG_LVT_PERFMON, 0x10021);
     //Write the spurious interrupt register bit 8 to receive interrupts AND spurious interrupt ID 0xFF
@@ -47,7 +47,21 @@ void apic_init(void){
     lapic_eoi();
     //Clear error
     lapic_reg_wr(LAPIC_REG_ERR_ST, 0);
-    krnl_write_msgf(__FILE__, __LINE__, "initialized LAPIC");
+    krnl_write_msgf(__FILE__, __LINE__, "initialized LAPIC %i", lapic_get_id() >> 24);
+}
+
+/*
+ * Initializes the Advanced Programmable Interrupt Controller
+ */
+void apic_init(void){
+    //LAPIC
+
+    //Disable interrupts
+    __asm__ volatile("cli");
+    //Set LAPIC base
+    lapic_base = 0xFFFFFFFFFFFFE000ULL;
+    krnl_write_msgf(__FILE__, __LINE__, "LAPIC base: 0x%x", lapic_base);
+    lapic_init();
 
     //I/O APIC
 
@@ -67,7 +81,14 @@ void apic_init(void){
         madt_record_t* record = (madt_record_t*)(madt_ptr + cur_offs);
         cur_offs += record->len;
         //Parse the record
-        if(record->type == 1){
+        if(record->type == 0){
+            //Processors that are neither enabled nor can be brought online are skipped
+            uint32_t flags = *(uint32_t*)&record->data[2];
+            if((flags & 3) && lapic_cnt < LAPIC_MAX_CNT){
+                lapic_ids[lapic_cnt++] = record->data[1];
+                krnl_write_msgf(__FILE__, __LINE__, "found processor with LAPIC %i", record->data[1]);
+            }
+        } else if(record->type == 1){
             ioapic_t* ioapic = &ioapics[next_ioapic++];
             ioapic->valid     = 1;
             ioapic->id        = record->data[0];
@@ -116,6 +137,31 @@ void lapic_eoi(void){
     lapic_reg_wr(LAPIC_REG_EOI, 0);
 }
 
+/*
+ * Sends an inter-processor interrupt to the processor with the specified LAPIC ID
+ */
+void lapic_send_ipi(uint8_t dest, uint32_t icr){
+    lapic_reg_wr(LAPIC_REG_ICR1, (uint32_t)dest << 24);
+    lapic_reg_wr(LAPIC_REG_ICR0, icr);
+    //Wait for it to be accepted
+    while(lapic_reg_rd(LAPIC_REG_ICR0) & LAPIC_ICR_PENDING)
+        __asm__ volatile("pause");
+}
+
+/*
+ * Returns the number of processors listed in the MADT
+ */
+uint32_t apic_cpu_count(void){
+    return lapic_cnt;
+}
+
+/*
+ * Returns the local APIC ID of a processor listed in the MADT
+ */
+uint8_t apic_cpu_lapic_id(uint32_t idx){
+    return lapic_ids[idx];
+}
+
 /*
  * Reads I/O APIC register
  */
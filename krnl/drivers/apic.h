@@ -5,6 +5,8 @@
 
 //How many I/O APICs can Neutron handle
 #define IO_APIC_MAX_CNT                 16
+//How many processor local APICs can Neutron handle
+#define LAPIC_MAX_CNT                   256
 
 //ACPI MADT table structures
 typedef struct {
@@ -23,6 +25,14 @@ typedef struct {
 
 //APIC base Model-Specific Register
 #define IA32_APIC_BASE_MSR              0x1B
+#define IA32_APIC_BASE_BSP              (1 << 8)
+
+//Interrupt command register fields
+#define LAPIC_ICR_FIXED                 (0 << 8)
+#define LAPIC_ICR_INIT                  (5 << 8)
+#define LAPIC_ICR_STARTUP               (6 << 8)
+#define LAPIC_ICR_PENDING               (1 << 12)
+#define LAPIC_ICR_ASSERT                (1 << 14)
 
 //Local APIC registers
 
@@ -81,12 +91,16 @@ typedef struct {
 //Function prototypes
 
 //Common
-void apic_init (void);
+void     apic_init          (void);
+uint32_t apic_cpu_count     (void);
+uint8_t  apic_cpu_lapic_id  (uint32_t idx);
 //LAPIC operations
+void     lapic_init   (void);
 uint32_t lapic_reg_rd (uint32_t reg);
 void     lapic_reg_wr (uint32_t reg, uint32_t val);
 uint32_t lapic_get_id (void);
 void     lapic_eoi    (void);
+void     lapic_send_ipi (uint8_t dest, uint32_t icr);
 //I/O APIC operations
 uint32_t ioapic_reg_rd  (uint32_t id, uint32_t reg);
 void     ioapic_reg_wr  (uint32_t id, uint32_t reg, uint32_t val);
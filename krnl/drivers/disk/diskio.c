@@ -3,8 +3,10 @@
 
 #include "./diskio.h"
 #include "../../stdlib.h"
+#include "../../slab.h"
 #include "../../mtask/mtask.h"
 #include "../../krnl.h"
+#include "../../klog.h"
 #include "./../timr.h"
 #include "./../gfx.h"
 #include "./../ps2.h"
@@ -15,12 +17,31 @@
 #include "./ahci.h"
 
 diskio_map_t* mappings;
+//Caches for file handles and bridge buffers
+slab_cache_t diskio_handle_cache;
+slab_cache_t diskio_bridge_buf_cache;
 
 /*
  * Initializes DISKIO stuff
  */
 void diskio_init(void){
     mappings = calloc(DISKIO_MAX_MAPPINGS, sizeof(diskio_map_t));
+    slab_init_cache(&diskio_handle_cache, "file_handle", sizeof(file_handle_t), 8, NULL);
+    slab_init_cache(&diskio_bridge_buf_cache, "bridge_buf", DISKIO_BRIDGE_BUF_SZ, 64, NULL);
+}
+
+/*
+ * Allocates a cleared file handle
+ */
+file_handle_t* diskio_alloc_handle(void){
+    return (file_handle_t*)slab_zalloc(&diskio_handle_cache);
+}
+
+/*
+ * Frees a file handle allocated by diskio_alloc_handle()
+ */
+void diskio_free_handle(file_handle_t* handle){
+    slab_free(&diskio_handle_cache, handle);
 }
 
 /*
@@ -43,16 +64,44 @@ void diskio_mount(diskio_dev_t device, char* path){
     }
 }
 
+/*
+ * Makes a read that has found no data wait for it if the handle is blocking
+ * Returns 1 if the task has been blocked, the read is started over when it's woken up
+ */
+static uint8_t diskio_wait(file_handle_t* handle, mtask_wq_t* wq){
+    if(!handle->blocking)
+        return 0;
+    return mtask_wait(wq, handle->timeout);
+}
+
+/*
+ * Sets the time blocking reads of a file wait for data for, in microseconds (0 = forever)
+ */
+uint64_t diskio_set_timeout(file_handle_t* handle, uint64_t timeout){
+    //Check the PID of the owner
+    if(handle->pid != mtask_get_pid())
+        return DISKIO_STATUS_NOT_ALLOWED;
+    handle->timeout = timeout;
+    return DISKIO_STATUS_OK;
+}
+
 /*
  * Opens a file on the disk
  */
 uint8_t diskio_open(char* path, file_handle_t* handle, uint8_t mode){
     task_t* cur_task = mtask_get_by_pid(mtask_get_pid());
+    //Only the access bits matter from here on
+    handle->blocking = (mode & DISKIO_FILE_BLOCKING) != 0;
+    handle->timeout = 0;
+    mode &= DISKIO_FILE_ACCESS_READ_WRITE;
     //Return an error if that process has already opened this file
-    if(cur_task != NULL)
-        for(int i = 0; i < MTASK_MAX_OPEN_FILES; i++)
-            if(strcmp(cur_task->open_files[i]->info.name, path) == 0)
+    if(cur_task != NULL){
+        for(uint32_t i = 0; i < cur_task->info->files_cap; i++){
+            file_handle_t* opened = mtask_get_open_file(cur_task, i);
+            if(opened != NULL && strcmp(opened->info.name, path) == 0)
                 return DISKIO_STATUS_ALREADY_OPENED;
+        }
+    }
     //Check if it's a bridge
     if(memcmp(path, "/bridge/", 8) == 0){
         char* pid_str = path + 8;
@@ -77,8 +126,11 @@ uint8_t diskio_open(char* path, file_handle_t* handle, uint8_t mode){
         uint64_t pid = atoi(pid_str);
         task_t* task = mtask_get_by_pid(pid);
         //Check if that PID has already opened a bridge to this one
-        for(int i = 0; i < MTASK_MAX_OPEN_FILES; i++){
-            bridge_t* bridge = &task->open_files[i]->info.device.bridge;
+        for(uint32_t i = 0; task != NULL && i < task->info->files_cap; i++){
+            file_handle_t* opened = mtask_get_open_file(task, i);
+            if(opened == NULL)
+                continue;
+            bridge_t* bridge = &opened->info.device.bridge;
             if(bridge->is_bridge && bridge->to_pid == cur_task->pid){
                 //Setup the handle
                 handle->pid = cur_task->pid;
@@ -110,9 +162,9 @@ uint8_t diskio_open(char* path, file_handle_t* handle, uint8_t mode){
             .bridge = (bridge_t){
                 .is_bridge = 1,
                 .to_pid = pid,
-                .send_buf = (uint8_t*)malloc(DISKIO_BRIDGE_BUF_SZ),
+                .send_buf = (uint8_t*)slab_alloc(&diskio_bridge_buf_cache),
                 .send_pos = 0,
-                .read_buf = (uint8_t*)malloc(DISKIO_BRIDGE_BUF_SZ),
+                .read_buf = (uint8_t*)slab_alloc(&diskio_bridge_buf_cache),
                 .read_pos = 0
             }
         };
@@ -159,6 +211,18 @@ uint8_t diskio_open(char* path, file_handle_t* handle, uint8_t mode){
                 handle->info.device.device_no = SYS_FILE_TIME;
             else
                 return DISKIO_STATUS_WRITE_PROTECTED;
+        } else if(strcmp(name, "xfeat") == 0){
+            if(mode == DISKIO_FILE_ACCESS_READ)
+                handle->info.device.device_no = SYS_FILE_XFEAT;
+            else
+                return DISKIO_STATUS_WRITE_PROTECTED;
+        } else if(strcmp(name, "kmsg") == 0){
+            //The position is the sequence number of the next message to be read
+            if(mode == DISKIO_FILE_ACCESS_READ)
+                handle->info.device.device_no = SYS_FILE_KMSG;
+            else
+                return DISKIO_STATUS_WRITE_PROTECTED;
+            handle->info.size = 0xFFFFFFFFFFFFFFFFULL;
         }
         mtask_add_open_file(handle);
         return DISKIO_STATUS_OK;
@@ -276,6 +340,14 @@ uint64_t diskio_read(file_handle_t* handle, void* buf, uint64_t len){
     //Check the PID of the owner
     if(handle->pid != mtask_get_pid())
         return DISKIO_STATUS_NOT_ALLOWED;
+    return diskio_read_krnl(handle, buf, len);
+}
+
+/*
+ * Reads file contents into buffer on behalf of the kernel,
+ *   regardless of which task the handle belongs to
+ */
+uint64_t diskio_read_krnl(file_handle_t* handle, void* buf, uint64_t len){
     //Check if read access is allowed
     if((handle->mode & DISKIO_FILE_ACCESS_READ) == 0)
         return DISKIO_STATUS_READ_PROTECTED;
@@ -300,6 +372,10 @@ uint64_t diskio_read(file_handle_t* handle, void* buf, uint64_t len){
             //Limit the length to the amount of bytes written
             uint64_t max_len = handle->info.device.bridge.other->send_pos - 
                                handle->info.device.bridge.read_pos;
+            //Wait for them if there are none, unless the other end is gone
+            if(max_len == 0 && !handle->info.device.bridge.other->closed &&
+               diskio_wait(handle, &handle->info.device.bridge.readers))
+                return DISKIO_STATUS_EOF;
             act_len = len;
             if(len > max_len)
                 act_len = max_len;
@@ -319,10 +395,12 @@ uint64_t diskio_read(file_handle_t* handle, void* buf, uint64_t len){
         case DISKIO_BUS_BRIDGE_LIST: {
             //Count the number of bridges
             uint32_t br_cnt = 0;
-            for(int i = 0; i < MTASK_TASK_COUNT; i++){
-                for(int j = 0; j < MTASK_MAX_OPEN_FILES; j++) {
-                    bridge_t* bridge = &mtask_get_task_list()[i].open_files[j]->info.device.bridge;
-                    if(bridge->is_bridge && bridge->to_pid == handle->pid)
+            for(uint32_t i = 0; i < mtask_task_count(); i++){
+                task_t* task = mtask_get_task(i);
+                for(uint32_t j = 0; j < task->info->files_cap; j++){
+                    file_handle_t* opened = mtask_get_open_file(task, j);
+                    if(opened != NULL && opened->info.device.bridge.is_bridge &&
+                       opened->info.device.bridge.to_pid == handle->pid)
                         br_cnt++;
                 }
             }
@@ -331,19 +409,23 @@ uint64_t diskio_read(file_handle_t* handle, void* buf, uint64_t len){
             *(uint32_t*)&br_list[0] = br_cnt;
             int entry = 0;
             //Go through each task
-            for(int i = 0; i < MTASK_TASK_COUNT; i++){
-                task_t* task = &mtask_get_task_list()[i];
+            for(uint32_t i = 0; i < mtask_task_count(); i++){
+                task_t* task = mtask_get_task(i);
                 //And each file that task might've opened
-                for(int j = 0; j < MTASK_MAX_OPEN_FILES; j++){
-                    bridge_t* bridge = &task->open_files[j]->info.device.bridge;
-                    if(bridge->is_bridge){
+                for(uint32_t j = 0; j < task->info->files_cap; j++){
+                    file_handle_t* opened = mtask_get_open_file(task, j);
+                    if(opened == NULL)
+                        continue;
+                    bridge_t* bridge = &opened->info.device.bridge;
+                    if(bridge->is_bridge && bridge->to_pid == handle->pid){
                         //Try to find this task's handle
                         file_handle_t* this_handle = NULL;
                         task_t* this_task = mtask_get_by_pid(handle->pid);
-                        for(int k = 0; k < MTASK_MAX_OPEN_FILES; k++){
-                            if(this_task->open_files[k]->info.device.bridge.is_bridge &&
-                               this_task->open_files[k]->info.device.bridge.to_pid == task->pid){
-                                this_handle = this_task->open_files[k];
+                        for(uint32_t k = 0; k < this_task->info->files_cap; k++){
+                            file_handle_t* mine = mtask_get_open_file(this_task, k);
+                            if(mine != NULL && mine->info.device.bridge.is_bridge &&
+                               mine->info.device.bridge.to_pid == task->pid){
+                                this_handle = mine;
                                 break;
                             }
                         }
@@ -367,6 +449,14 @@ uint64_t diskio_read(file_handle_t* handle, void* buf, uint64_t len){
                 return DISKIO_STATUS_OK;
         } break;
         case DISKIO_BUS_SYSTEM: {
+            //Kernel messages are read line by line
+            if(handle->info.device.device_no == SYS_FILE_KMSG){
+                act_len = klog_read(&handle->position, buf, len);
+                if(act_len != len)
+                    return DISKIO_STATUS_EOF | (act_len << 32);
+                else
+                    return DISKIO_STATUS_OK;
+            }
             char fbuf[64];
             //Constents depend on the specfic file
             switch(handle->info.device.device_no){
@@ -385,6 +475,9 @@ uint64_t diskio_read(file_handle_t* handle, void* buf, uint64_t len){
                 case SYS_FILE_TIME:
                     sprintf(fbuf, "%i", time_get());
                     break;
+                case SYS_FILE_XFEAT:
+                    sprintf(fbuf, "%i", mtask_get_xfeat());
+                    break;
             }
             //Copy the data and advance the position
             act_len = len;
@@ -405,6 +498,8 @@ uint64_t diskio_read(file_handle_t* handle, void* buf, uint64_t len){
                     int data = 0;
                     while(cnt < len && (data = ps21_read()) != -1)
                         ((uint8_t*)buf)[cnt++] = (uint8_t)data;
+                    if(cnt == 0 && diskio_wait(handle, ps21_wq()))
+                        return DISKIO_STATUS_EOF;
                     if(cnt != len)
                         return DISKIO_STATUS_EOF | ((uint64_t)cnt << 32);
                     else
@@ -415,6 +510,8 @@ uint64_t diskio_read(file_handle_t* handle, void* buf, uint64_t len){
                     int data = 0;
                     while(cnt < len && (data = ps22_read()) != -1)
                         ((uint8_t*)buf)[cnt++] = (uint8_t)data;
+                    if(cnt == 0 && diskio_wait(handle, ps22_wq()))
+                        return DISKIO_STATUS_EOF;
                     if(cnt != len)
                         return DISKIO_STATUS_EOF | ((uint64_t)cnt << 32);
                     else
@@ -429,7 +526,7 @@ uint64_t diskio_read(file_handle_t* handle, void* buf, uint64_t len){
             part_t* part = part_get(handle->info.device.device_no);
             file_handle_t* drive = part->drive_file;
             diskio_seek(drive, (part->lba_start + (handle->position / 512)) * 512);
-            return diskio_read(drive, buf, len);
+            return diskio_read_krnl(drive, buf, len);
         } break;
         default: return 0;
     }
@@ -457,8 +554,10 @@ uint64_t diskio_write(file_handle_t* handle, void* buf, uint64_t len){
             //Copy the data
             memcpy(handle->info.device.bridge.send_buf +
                    handle->info.device.bridge.send_pos, buf, act_len);
-            //Advance the write head
+            //Advance the write head and let the other end know
             handle->info.device.bridge.send_pos += act_len;
+            if(act_len != 0 && handle->info.device.bridge.other != NULL)
+                mtask_wake_all(&handle->info.device.bridge.other->readers);
             //Return status: OK if wrote everything, EOF if the remaining buffer space is smaller than the requested data length
             if(act_len != len)
                 return DISKIO_STATUS_EOF | (act_len << 32);
@@ -537,4 +636,31 @@ uint64_t diskio_seek(file_handle_t* handle, uint64_t pos){
  */
 void diskio_close(file_handle_t* handle){
     mtask_remove_open_file(handle);
+}
+
+/*
+ * Closes a file and frees its handle
+ * Both ends of a bridge use the same buffers, so the handle of the end that is closed
+ *   first is kept until the other end is closed too
+ */
+void diskio_release(file_handle_t* handle){
+    diskio_close(handle);
+    bridge_t* bridge = &handle->info.device.bridge;
+    if(!bridge->is_bridge){
+        diskio_free_handle(handle);
+        return;
+    }
+    bridge_t* other = bridge->other;
+    if(other != NULL && !other->closed){
+        //The other end isn't going to get any more data
+        bridge->closed = 1;
+        mtask_wake_all(&other->readers);
+        return;
+    }
+    //Nobody uses the buffers anymore
+    slab_free(&diskio_bridge_buf_cache, bridge->send_buf);
+    slab_free(&diskio_bridge_buf_cache, bridge->read_buf);
+    if(other != NULL)
+        diskio_free_handle((file_handle_t*)((uint8_t*)other - __builtin_offsetof(file_handle_t, info.device.bridge)));
+    diskio_free_handle(handle);
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define DISKIO_H
 
 #include "../../stdlib.h"
+#include "../../mtask/waitq.h"
 
 //Definitions
 
@@ -9,6 +10,8 @@
 #define DISKIO_FILE_ACCESS_READ                     1
 #define DISKIO_FILE_ACCESS_WRITE                    2
 #define DISKIO_FILE_ACCESS_READ_WRITE               (DISKIO_FILE_ACCESS_READ | DISKIO_FILE_ACCESS_WRITE)
+//Reads of bridges and PS/2 devices wait for data instead of returning nothing
+#define DISKIO_FILE_BLOCKING                        8
 
 //Operation statuses
 #define DISKIO_STATUS_OK                            0
@@ -20,6 +23,9 @@
 #define DISKIO_STATUS_ALREADY_OPENED                7
 #define DISKIO_STATUS_SEEKING_ERR                   8
 
+//Owner PID of the handles the kernel keeps for itself
+#define DISKIO_KRNL_PID                             0xFFFFFFFFFFFFFFFFULL
+
 //Devices/filesytems (buses)
 #define DISKIO_BUS_INITRD                           0
 #define DISKIO_BUS_BRIDGE                           1
@@ -36,6 +42,8 @@
 #define SYS_FILE_KVERS                              2
 #define SYS_FILE_DRES                               3
 #define SYS_FILE_TIME                               4
+#define SYS_FILE_XFEAT                              5
+#define SYS_FILE_KMSG                               6
 
 //Virtual files in the /dev/ directory
 #define DEV_FILE_PS21                               0
@@ -61,6 +69,10 @@ typedef struct _bridge_s{
     uint64_t read_pos;
 
     struct _bridge_s* other;
+    //Set when this end is closed while the other one is still using the buffers
+    uint8_t closed;
+    //Tasks waiting for the other end to send data
+    mtask_wq_t readers;
 } bridge_t;
 
 typedef struct {
@@ -90,6 +102,9 @@ typedef struct {
     uint64_t    pid;
     uint8_t     mode;
     uint64_t    position;
+    //Blocking reads give up after this many microseconds (0 = never)
+    uint8_t     blocking;
+    uint64_t    timeout;
 } file_handle_t;
 
 typedef struct {
@@ -104,12 +119,17 @@ typedef struct {
 
 //Function prototypes
 
-void     diskio_init  (void);
-void     diskio_mount (diskio_dev_t device, char* path);
-uint8_t  diskio_open  (char* path, file_handle_t* handle, uint8_t mode);
-uint64_t diskio_read  (file_handle_t* handle, void* buf, uint64_t len);
-uint64_t diskio_write (file_handle_t* handle, void* buf, uint64_t len);
-uint64_t diskio_seek  (file_handle_t* handle, uint64_t pos);
-void     diskio_close (file_handle_t* handle);
+void           diskio_init         (void);
+void           diskio_mount        (diskio_dev_t device, char* path);
+file_handle_t* diskio_alloc_handle (void);
+void           diskio_free_handle  (file_handle_t* handle);
+uint8_t        diskio_open         (char* path, file_handle_t* handle, uint8_t mode);
+uint64_t       diskio_read         (file_handle_t* handle, void* buf, uint64_t len);
+uint64_t       diskio_read_krnl    (file_handle_t* handle, void* buf, uint64_t len);
+uint64_t       diskio_write        (file_handle_t* handle, void* buf, uint64_t len);
+uint64_t       diskio_seek         (file_handle_t* handle, uint64_t pos);
+uint64_t       diskio_set_timeout  (file_handle_t* handle, uint64_t timeout);
+void           diskio_close        (file_handle_t* handle);
+void           diskio_release      (file_handle_t* handle);
 
 #endif
\ No newline at end of file
@@ -17,7 +17,7 @@ uint32_t part_cnt;
 void parts_load(char* path){
     krnl_write_msgf(__FILE__, __LINE__, "loading partitions on %s", path);
     //Open the disk file
-    file_handle_t* disk = (file_handle_t*)malloc(sizeof(file_handle_t));
+    file_handle_t* disk = diskio_alloc_handle();
     diskio_open(path, disk, DISKIO_FILE_ACCESS_READ);
     //Read the boot sector
     uint8_t bootsect[512];
@@ -133,8 +133,8 @@ part_t* part_get(uint32_t num){
  */
 void part_load(uint32_t no){
     //Open the partition file
-    free(parts[no].fs_file);
-    parts[no].fs_file = (file_handle_t*)malloc(sizeof(file_handle_t));
+    diskio_free_handle(parts[no].fs_file);
+    parts[no].fs_file = diskio_alloc_handle();
     char part_path[32];
     sprintf(part_path, "/part/%i", no);
     diskio_open(part_path, parts[no].fs_file, DISKIO_FILE_ACCESS_READ_WRITE);
@@ -6,6 +6,7 @@
 #include "../stdlib.h"
 #include "./acpi.h"
 #include "./apic.h"
+#include "../mtask/mtask.h"
 
 //Buffers for received data
 uint8_t ps21_buf[PS2_BUF_SIZE];
@@ -14,6 +15,9 @@ uint64_t ps21_buf_rd = 0;
 uint8_t ps22_buf[PS2_BUF_SIZE];
 uint64_t ps22_buf_wr = 0;
 uint64_t ps22_buf_rd = 0;
+//Tasks waiting for data
+mtask_wq_t ps21_waiting = {NULL, NULL};
+mtask_wq_t ps22_waiting = {NULL, NULL};
 
 /*
  * Initializes the PS/2 controller
@@ -107,6 +111,8 @@ void ps21_intr(void){
     //Check for overflows
     if(ps21_buf_wr == ps21_buf_rd)
         krnl_write_msgf(__FILE__, __LINE__, "device 1 buffer overflow");
+    //Wake up the readers
+    mtask_wake_all(&ps21_waiting);
 }
 
 /*
@@ -121,6 +127,8 @@ void ps22_intr(void){
     //Check for overflows
     if(ps22_buf_wr == ps22_buf_rd)
         krnl_write_msgf(__FILE__, __LINE__, "device 2 buffer overflow");
+    //Wake up the readers
+    mtask_wake_all(&ps22_waiting);
 }
 
 /*
@@ -174,4 +182,18 @@ void ps21_flush(void){
  */
 void ps22_flush(void){
     ps22_buf_rd = ps22_buf_wr = 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Returns the queue of tasks waiting for data from the first PS/2 device
+ */
+mtask_wq_t* ps21_wq(void){
+    return &ps21_waiting;
+}
+
+/*
+ * Returns the queue of tasks waiting for data from the second PS/2 device
+ */
+mtask_wq_t* ps22_wq(void){
+    return &ps22_waiting;
+}
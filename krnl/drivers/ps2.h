@@ -2,6 +2,7 @@
 #define PS2_H
 
 #include "../stdlib.h"
+#include "../mtask/waitq.h"
 
 //Settings
 
@@ -30,5 +31,8 @@ void ps21_write (uint8_t val);
 void ps22_write (uint8_t val);
 void ps21_flush (void);
 void ps22_flush (void);
+//Tasks waiting for data
+mtask_wq_t* ps21_wq (void);
+mtask_wq_t* ps22_wq (void);
 
 #endif
\ No newline at end of file
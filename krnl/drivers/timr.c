@@ -5,9 +5,18 @@
 #include "./apic.h"
 #include "../stdlib.h"
 #include "../krnl.h"
+#include "../cpuid.h"
+
+//The timer is one-shot and is armed for the next moment something has to be done,
+//  so a task that has the CPU to itself isn't interrupted at all. If the CPU supports it,
+//  the timer is given a TSC value directly instead of a count that is derived from it.
 
 //CPU clock frequency in Hz
 uint64_t cpu_fq_hz;
+//LAPIC timer ticks in a millisecond (with the 16x divider)
+uint64_t timr_ticks_per_ms;
+//Is the timer in the TSC-deadline mode?
+uint8_t timr_tsc_deadline;
 
 /*
  * Returns CPU frequency in Hz
@@ -46,7 +55,8 @@ void timr_measure_cpu_fq(void){
 }
 
 /*
- * Initializes the timer
+ * Measures the timer frequency and initializes the timer of the bootstrap processor
+ * It's one-shot: nothing happens until timr_arm() is called
  */
 void timr_init(void){
     lapic_reg_wr(LAPIC_REG_TPR, 0);
@@ -62,19 +72,65 @@ void timr_init(void){
     lapic_reg_wr(LAPIC_REG_LVT_TIM, 0x10000);
     //Get the counter value
     uint32_t cnt_val = lapic_reg_rd(LAPIC_REG_TIMR_CURCNT);
-    uint32_t ticks_in_cycles = 0xFFFFFFFF - cnt_val;
-    krnl_write_msgf(__FILE__, __LINE__, "LAPIC timer ticks in 1 ms (%i CPU cycles): %i", cpu_fq_hz / 1000, ticks_in_cycles);
-    lapic_reg_wr(LAPIC_REG_TIMR_DIVCONF, 0); //Set the divider to 2
-    lapic_reg_wr(LAPIC_REG_TIMR_INITCNT, ticks_in_cycles); //Set the initial counter value
-    lapic_reg_wr(LAPIC_REG_LVT_TIM, 0x20000 | 32); //Enable the timer with interrupt vector #32
-    krnl_write_msgf(__FILE__, __LINE__, "LAPIC timer initialized");
+    lapic_reg_wr(LAPIC_REG_TIMR_INITCNT, 0);
+    timr_ticks_per_ms = 0xFFFFFFFF - cnt_val;
+    krnl_write_msgf(__FILE__, __LINE__, "LAPIC timer ticks in 1 ms (%i CPU cycles): %i", cpu_fq_hz / 1000, timr_ticks_per_ms);
+    //Let the timer fire at a TSC value if it can, count down with the divider
+    //  it has been measured with otherwise
+    uint32_t ecx, edx;
+    cpuid_get_feat(&edx, &ecx);
+    timr_tsc_deadline = (ecx & CPUID_FEAT_ECX_TSC_DEADLINE) > 0;
+    timr_init_cpu();
+    krnl_write_msgf(__FILE__, __LINE__, "LAPIC timer initialized (%s mode)", timr_tsc_deadline ? "TSC-deadline" : "one-shot");
 }
 
 /*
- * Stops the timer
+ * Initializes the timer of the current processor the same way the bootstrap one's is
  */
-void timr_stop(void){
-    lapic_reg_wr(LAPIC_REG_LVT_TIM, lapic_reg_rd(LAPIC_REG_LVT_TIM) & ~0x20000);
+void timr_init_cpu(void){
+    lapic_reg_wr(LAPIC_REG_TPR, 0);
+    lapic_reg_wr(LAPIC_REG_TIMR_DIVCONF, 0x3);
+    if(timr_tsc_deadline){
+        lapic_reg_wr(LAPIC_REG_LVT_TIM, TIMR_LVT_TSC_DEADLINE | 32);
+        //Order the LVT write before the MSR writes
+        __asm__ volatile("mfence" : : : "memory");
+        wrmsr(MSR_IA32_TSC_DEADLINE, 0);
+    } else {
+        lapic_reg_wr(LAPIC_REG_LVT_TIM, TIMR_LVT_ONE_SHOT | 32);
+    }
 }
 
+/*
+ * Makes the timer fire once the TSC reaches a value, or right away if it already has
+ * Cancels the pending interrupt if the value is 0
+ */
+void timr_arm(uint64_t tsc){
+    if(timr_tsc_deadline){
+        wrmsr(MSR_IA32_TSC_DEADLINE, tsc);
+        return;
+    }
+    if(tsc == 0){
+        lapic_reg_wr(LAPIC_REG_TIMR_INITCNT, 0);
+        return;
+    }
+    //Convert the cycles to timer ticks, rounding up so that it doesn't fire early
+    uint64_t now = rdtsc();
+    uint64_t cycles = (tsc > now) ? (tsc - now) : 0;
+    uint64_t cycles_per_ms = cpu_fq_hz / 1000;
+    uint64_t ticks = 0xFFFFFFFF; //if it's too far away, it'll just fire early and be armed again
+    if(cycles_per_ms != 0 && cycles / cycles_per_ms < 0xFFFFFFFF / (timr_ticks_per_ms + 1))
+        ticks = ((cycles / cycles_per_ms) * timr_ticks_per_ms) +
+                (((cycles % cycles_per_ms) * timr_ticks_per_ms + cycles_per_ms - 1) / cycles_per_ms);
+    if(ticks == 0)
+        ticks = 1;
+    if(ticks > 0xFFFFFFFF)
+        ticks = 0xFFFFFFFF;
+    lapic_reg_wr(LAPIC_REG_TIMR_INITCNT, (uint32_t)ticks);
+}
 
+/*
+ * Stops the timer
+ */
+void timr_stop(void){
+    timr_arm(0);
+}
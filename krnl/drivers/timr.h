@@ -3,13 +3,23 @@
 
 #include "../stdlib.h"
 
+//TSC-deadline register
+#define MSR_IA32_TSC_DEADLINE               0x6E0
+
+//LAPIC timer modes (LVT bits 18:17)
+#define TIMR_LVT_ONE_SHOT                   (0 << 17)
+#define TIMR_LVT_PERIODIC                   (1 << 17)
+#define TIMR_LVT_TSC_DEADLINE               (2 << 17)
+
 //Function prototypes
 
 //CPU frequency
 uint64_t timr_get_cpu_fq     (void);
 void     timr_measure_cpu_fq (void);
 //LAPIC timer control
-void timr_init (void);
-void timr_stop (void);
+void timr_init     (void);
+void timr_init_cpu (void);
+void timr_arm      (uint64_t tsc);
+void timr_stop     (void);
 
 #endif
\ No newline at end of file
@@ -51,9 +51,68 @@ exc_13:
     movb [rsp-128], 13
     jmp exc_wrapper
 exc_14:
+    cli
+    ;//Switch to the kernel GS if we've come from userland
+    test byte ptr [rsp+16], 3
+    jz exc_14_krnl_gs
+    swapgs
+    exc_14_krnl_gs:
+    ;//Save the registers the handler may clobber
+    push rax
+    push rcx
+    push rdx
+    push r8
+    push r9
+    push r10
+    push r11
+    push rbx
+    sub rsp, 32
+    ;//The handler may use vector instructions, so the vector state of the interrupted
+    ;//  code goes to the scratch area of this processor (the XSAVE area of the task may
+    ;//  be holding its saved user state already, and interrupts are off until we're done)
+    mov rbx, qword ptr gs:[24]
+    test rbx, rbx
+    jz exc_14_resolve
+    mov edx, 0xFFFFFFFF
+    mov eax, 0xFFFFFFFF
+    xsaveq [rbx]
+    exc_14_resolve:
+    ;//Try to resolve the fault by mapping the page in
+    mov rcx, cr2
+    mov rdx, [rsp+96] ;//Error code
+    call mtask_handle_pf
+    mov ecx, eax
+    ;//Restore the vector state (RBX is preserved by the handler)
+    test rbx, rbx
+    jz exc_14_restored
+    mov edx, 0xFFFFFFFF
+    mov eax, 0xFFFFFFFF
+    xrstorq [rbx]
+    exc_14_restored:
+    add rsp, 32
+    test cl, cl
+    ;//Restore the registers
+    pop rbx
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdx
+    pop rcx
+    pop rax
+    ;//Treat it as a regular exception if it couldn't be resolved
+    jz exc_14_unresolved
+    ;//Restart the faulting instruction otherwise
+    add rsp, 8
+    test byte ptr [rsp+8], 3
+    jz exc_14_iret
+    swapgs
+    exc_14_iret:
+    iretq
+    exc_14_unresolved:
     add rsp, 8
     movb [rsp-128], 14
-    jmp exc_wrapper
+    jmp exc_wrapper_save
 exc_16:
     movb [rsp-128], 16
     jmp exc_wrapper
@@ -78,6 +137,11 @@ exc_30:
 exc_wrapper:
     ;//Disable interrupts
     cli
+    ;//Switch to the kernel GS if we've come from userland
+    test byte ptr [rsp+8], 3
+    jz exc_wrapper_save
+    swapgs
+    exc_wrapper_save:
     ;//Save task state
     call mtask_save_state
     ;//Clear direction flag
@@ -89,6 +153,11 @@ exc_wrapper:
 apic_timer_isr_wrap:
     ;//Disable interrupts
     cli
+    ;//Switch to the kernel GS if we've come from userland
+    test byte ptr [rsp+8], 3
+    jz apic_timer_isr_wrap_gs
+    swapgs
+    apic_timer_isr_wrap_gs:
     ;//Save RAX
     push rax
     ;//Check if multitasking is enabled
@@ -103,6 +172,10 @@ apic_timer_isr_wrap:
     mov r15, 0xFFFFFFFFFFFFE0B0
     mov dword ptr [r15], 0
     pop r15
+    test byte ptr [rsp+8], 3
+    jz apic_timer_isr_wrap_ret
+    swapgs
+    apic_timer_isr_wrap_ret:
     sti
     iretq
     apic_timer_isr_wrap_cont:
@@ -112,18 +185,39 @@ apic_timer_isr_wrap:
 
 ps21_isr_wrap:
     cli
+    test byte ptr [rsp+8], 3
+    jz ps21_isr_wrap_gs
+    swapgs
+    ps21_isr_wrap_gs:
     call mtask_save_state
+    ;//Device drivers are protected by the kernel lock
+    call smp_lock_krnl
     call ps21_intr
+    call smp_unlock_krnl
     jmp mtask_restore_state
 
 ps22_isr_wrap:
     cli
+    test byte ptr [rsp+8], 3
+    jz ps22_isr_wrap_gs
+    swapgs
+    ps22_isr_wrap_gs:
     call mtask_save_state
+    ;//Device drivers are protected by the kernel lock
+    call smp_lock_krnl
     call ps22_intr
+    call smp_unlock_krnl
     jmp mtask_restore_state
 
 rtc_isr_wrap:
     cli
+    test byte ptr [rsp+8], 3
+    jz rtc_isr_wrap_gs
+    swapgs
+    rtc_isr_wrap_gs:
     call mtask_save_state
+    ;//Device drivers are protected by the kernel lock
+    call smp_lock_krnl
     call rtc_intr
+    call smp_unlock_krnl
     jmp mtask_restore_state
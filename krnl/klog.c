@@ -0,0 +1,182 @@
+//Neutron Project
+//KLog - Kernel log ring
+
+#include "./klog.h"
+#include "./stdlib.h"
+#include "./drivers/timr.h"
+
+//A writer reserves a record by atomically incrementing the head counter, fills
+//  the slot the record maps to and publishes it by storing its sequence number.
+//  A reader copies a record and checks that its sequence number was the same
+//  before and after the copy, so a record that got overwritten in the meantime is
+//  skipped instead of being shown half-updated. Nothing here blocks or allocates,
+//  which makes logging safe in interrupt handlers and cheap enough for hot paths.
+//Records are formatted only when they're read.
+
+klog_rec_t klog_ring[KLOG_RECORDS];
+uint64_t klog_next_seq = 0;
+uint64_t klog_start_tsc = 0;
+
+/*
+ * Returns the sequence number the next record will get
+ */
+uint64_t klog_head(void){
+    return __atomic_load_n(&klog_next_seq, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns the sequence number of the oldest record that hasn't been overwritten yet
+ */
+uint64_t klog_tail(void){
+    uint64_t head = klog_head();
+    return (head > KLOG_RECORDS) ? (head - KLOG_RECORDS) : 0;
+}
+
+/*
+ * Copies a string to the text area of a record, truncating it if there's not enough space
+ * Returns its offset
+ */
+static uint8_t klog_copy_str(klog_rec_t* rec, const char* str){
+    uint8_t offs = rec->text_used;
+    if(str == NULL)
+        str = "(null)";
+    while(*str != 0 && rec->text_used < KLOG_TEXT_SZ - 1)
+        rec->text[rec->text_used++] = *str++;
+    rec->text[rec->text_used] = 0;
+    if(rec->text_used < KLOG_TEXT_SZ - 1)
+        rec->text_used++;
+    return offs;
+}
+
+/*
+ * Checks if a character may appear between the percent sign and the conversion specifier
+ */
+static inline uint8_t klog_is_modifier(char c){
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == ' ' || c == '#' || c == '.' || c == '*' ||
+           c == 'h' || c == 'l' || c == 'z' || c == 'j' || c == 't' || c == 'L';
+}
+
+/*
+ * Writes a record
+ * If `args` is NULL, `fmt` is a plain message and it's copied. So is `file` if `copy_file` is set
+ */
+void klog_write(const char* file, uint8_t copy_file, uint32_t line, const char* fmt, va_list* args){
+    //Reserve a record and invalidate its slot before changing it
+    uint64_t seq = __atomic_fetch_add(&klog_next_seq, 1, __ATOMIC_RELAXED);
+    klog_rec_t* rec = &klog_ring[seq % KLOG_RECORDS];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    //Fill it
+    rec->tsc = rdtsc();
+    rec->line = line;
+    rec->flags = 0;
+    rec->argc = 0;
+    rec->str_args = 0;
+    rec->text_used = 0;
+    rec->file = file;
+    if(copy_file){
+        rec->flags |= KLOG_FILE_COPIED;
+        rec->file = (const char*)(uint64_t)klog_copy_str(rec, file);
+    }
+    if(args == NULL){
+        rec->flags |= KLOG_FMT_COPIED;
+        rec->fmt = (const char*)(uint64_t)klog_copy_str(rec, fmt);
+    } else {
+        //Fetch the arguments the format refers to
+        rec->fmt = fmt;
+        for(const char* c = fmt; *c != 0; c++){
+            if(*c != '%')
+                continue;
+            c++;
+            while(*c != 0 && klog_is_modifier(*c)){
+                if(*c == '*' && rec->argc < KLOG_MAX_ARGS)
+                    rec->args[rec->argc++] = va_arg(*args, uint64_t);
+                c++;
+            }
+            if(*c == 0 || rec->argc >= KLOG_MAX_ARGS)
+                break;
+            if(*c == '%' || *c == 'n')
+                continue;
+            if(*c == 's'){
+                rec->str_args |= 1 << rec->argc;
+                rec->args[rec->argc++] = klog_copy_str(rec, va_arg(*args, const char*));
+            } else {
+                rec->args[rec->argc++] = va_arg(*args, uint64_t);
+            }
+        }
+    }
+    if(seq == 0)
+        klog_start_tsc = rec->tsc;
+    //Publish it
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Formats a record into a line (without the line break) and writes it to a sink
+ * Returns its length or -1 if the record isn't there (not written yet or overwritten already)
+ */
+int klog_format(uint64_t seq, sink_t* sink){
+    //Take a consistent copy of the record
+    klog_rec_t* slot = &klog_ring[seq % KLOG_RECORDS];
+    klog_rec_t rec;
+    if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+        return -1;
+    memcpy(&rec, (void*)slot, sizeof(klog_rec_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1)
+        return -1;
+    //Write the time and the source
+    rec.text[KLOG_TEXT_SZ - 1] = 0;
+    const char* file = (rec.flags & KLOG_FILE_COPIED) ? (rec.text + (uint64_t)rec.file) : rec.file;
+    uint64_t fq = timr_get_cpu_fq();
+    uint64_t ms = (fq == 0) ? 0 : (1000 * (rec.tsc - klog_start_tsc) / fq);
+    size_t start = sink->count;
+    sink_printf(sink, "[%i ms] %s:%i: ", ms, file, (uint64_t)rec.line);
+    //Write the message
+    if(rec.flags & KLOG_FMT_COPIED){
+        sink_printf(sink, "%s", rec.text + (uint64_t)rec.fmt);
+    } else {
+        uint64_t a[KLOG_MAX_ARGS] = {0};
+        for(int i = 0; i < rec.argc; i++)
+            a[i] = ((rec.str_args >> i) & 1) ? (uint64_t)(rec.text + rec.args[i]) : rec.args[i];
+        sink_printf(sink, rec.fmt, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+    }
+    return sink->count - start;
+}
+
+/*
+ * Reads formatted records, one per line, starting at the record `seq` points to
+ *   (or at the oldest one if that has been overwritten already) and advances it
+ * Lines are formatted right into the buffer. Only whole lines are read, unless the first one
+ *   doesn't fit
+ * Returns the number of bytes read
+ */
+uint64_t klog_read(uint64_t* seq, char* buf, uint64_t len){
+    uint64_t done = 0;
+    if(*seq < klog_tail())
+        *seq = klog_tail();
+    while(*seq < klog_head() && done < len){
+        sink_t sink = sink_to_buf(buf + done, len - done);
+        int line_len = klog_format(*seq, &sink);
+        if(line_len < 0){
+            //Skip the record if it has been overwritten, stop if it's still being written
+            if(*seq < klog_tail()){
+                *seq = klog_tail();
+                continue;
+            }
+            break;
+        }
+        if(done + line_len + 1 > len){
+            //Keep a truncated line only if it's the first one
+            if(done == 0){
+                done = len;
+                (*seq)++;
+            }
+            break;
+        }
+        buf[done + line_len] = '\n';
+        done += line_len + 1;
+        (*seq)++;
+    }
+    return done;
+}
@@ -0,0 +1,51 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+#include "./stdlib.h"
+
+//Settings
+
+//Number of records the log holds before the oldest ones are overwritten
+#define KLOG_RECORDS                        2048
+//Maximal number of arguments a formatted record can carry
+#define KLOG_MAX_ARGS                       8
+//Space for the copied strings of a record
+#define KLOG_TEXT_SZ                        200
+//Length of the buffer verbose mode formats lines into
+#define KLOG_LINE_SZ                        512
+
+//Record flags
+#define KLOG_FILE_COPIED                    (1 << 0) //`file` is an offset into `text`
+#define KLOG_FMT_COPIED                     (1 << 1) //`fmt` is an offset of a plain message into `text`
+
+//Structure definitions
+
+/*
+ * A binary log record
+ * Nothing is formatted when it's written: the format string and the raw arguments are stored instead.
+ *   Strings that might not live long enough (%s arguments, preformatted and userland messages)
+ *   are copied to `text`
+ */
+typedef struct {
+    volatile uint64_t seq; //sequence number plus one once the record is complete, zero while it's written
+    uint64_t tsc;
+    const char* file;
+    const char* fmt;
+    uint32_t line;
+    uint8_t flags;
+    uint8_t argc;
+    uint8_t str_args; //bit N is set if argument N is an offset into `text`
+    uint8_t text_used;
+    uint64_t args[KLOG_MAX_ARGS];
+    char text[KLOG_TEXT_SZ];
+} klog_rec_t;
+
+//Function prototypes
+
+void     klog_write   (const char* file, uint8_t copy_file, uint32_t line, const char* fmt, va_list* args);
+uint64_t klog_head    (void);
+uint64_t klog_tail    (void);
+int      klog_format  (uint64_t seq, sink_t* sink);
+uint64_t klog_read    (uint64_t* seq, char* buf, uint64_t len);
+
+#endif
@@ -4,7 +4,10 @@
 #include "./krnl.h"
 
 #include "./stdlib.h"
+#include "./slab.h"
 #include "./cpuid.h"
+#include "./klog.h"
+#include "./smp.h"
 
 #include <efi.h>
 #include <efilib.h>
@@ -65,9 +68,8 @@ extern void exc_30(void);
 krnl_pos_t krnl_pos;
 uint16_t krnl_cs = 0;
 uint16_t krnl_ds = 0;
-//First and last kernel message pointers
-krnl_msg_t* first_msg;
-krnl_msg_t* last_msg;
+//The first kernel message that hasn't been shown in verbose mode yet
+uint64_t krnl_shown_msg = 0;
 //Stack Smashing Protection guard
 uint64_t __stack_chk_guard;
 //Is the kernel in verbose mode or not?
@@ -78,70 +80,68 @@ EFI_HANDLE krnl_efi_img_handle;
 uint64_t krnl_efi_map_key;
 
 /*
- * Prints a kernel message in verbose mode
+ * Prints the kernel messages that haven't been shown yet in verbose mode
+ * (messages are never printed when they're written, that would be too slow)
  */
-void krnl_print_msg(krnl_msg_t* m){
-    char buf[MAX_KRNL_MSG_SZ + 256];
-    memset(buf, 0, sizeof(buf));
-    sprintf(buf, "[%i ms] %s:%i: %s", 1000 * (m->tsc - first_msg->tsc) / timr_get_cpu_fq(), m->file, (uint64_t)m->line, m->msg);
-    gfx_verbose_println(buf);
+void krnl_flush_msgs(void){
+    if(!krnl_verbose)
+        return;
+    char buf[KLOG_LINE_SZ];
+    if(krnl_shown_msg < klog_tail())
+        krnl_shown_msg = klog_tail();
+    while(krnl_shown_msg < klog_head()){
+        sink_t sink = sink_to_buf(buf, sizeof(buf) - 1);
+        if(klog_format(krnl_shown_msg, &sink) >= 0){
+            buf[(sink.count < sizeof(buf) - 1) ? sink.count : (sizeof(buf) - 1)] = 0;
+            gfx_verbose_println(buf);
+        }
+        krnl_shown_msg++;
+    }
 }
 
 /*
  * Writes a message to the kernel message buffer
  */
 void krnl_write_msg(char* file, uint32_t line, char* msg){
-    //Print the message
-    //Allocate memory for the message
-    krnl_msg_t* m = (krnl_msg_t*)calloc(1, sizeof(krnl_msg_t));
-    //Copy filename and message
-    strcpy(m->msg, msg);
-    strcpy(m->file, file);
-    m->line = line;
-    //Read timestamp counter
-    m->tsc = rdtsc();
-    //Assign the pointer to the previous message
-    if(last_msg == NULL){
-        first_msg = m;
-        last_msg = m;
-    } else {
-        last_msg->next = m;
-        last_msg = m;
-    }
-
-    if(krnl_verbose)
-        krnl_print_msg(m);
+    klog_write(file, 0, line, msg, NULL);
 }
 
 /*
  * Writes a formatted message to the kernel message buffer
+ * The message is formatted only when it's read
  */
 void krnl_write_msgf(char* file, uint32_t line, char* msg, ...){
-    //Formatted print to a string
-    char buf[MAX_KRNL_MSG_SZ];
     va_list valist;
-    va_start(valist, _sprintf_argcnt(msg));
-    _sprintf(buf, msg, valist);
-    krnl_write_msg(file, line, buf);
+    va_start(valist, msg);
+    klog_write(file, 0, line, msg, &valist);
     va_end(valist);
 }
 
+/*
+ * Writes formatted output to the UEFI ConsoleOut protocol
+ */
+void krnl_con_write(sink_t* sink, const char* data, size_t len){
+    //Expand the characters, because UEFI uses 16-bit ones
+    CHAR16 buf[65];
+    while(len > 0){
+        size_t chunk = (len > 64) ? 64 : len;
+        for(size_t i = 0; i < chunk; i++)
+            buf[i] = (uint8_t)data[i];
+        buf[chunk] = 0;
+        krnl_efi_systable->ConOut->OutputString(krnl_efi_systable->ConOut, buf);
+        data += chunk;
+        len -= chunk;
+    }
+}
+
 /*
  * Prints a formatted message to the UEFI ConsoleOut protocol
  */
 void krnl_writec_f(char* msg, ...){
-    //Print the formatted message
-    char buf[1024];
+    sink_t sink = {.write = krnl_con_write};
     va_list valist;
-    va_start(valist, _sprintf_argcnt(msg));
-    _sprintf(buf, msg, valist);
-    //Expand the buffer, becuase UEFI uses retarded 16-bit characters
-    for(int i = 1023; i >= 1; i -= 2){
-        buf[i] = buf[i / 2];
-        buf[i / 2] = 0;
-    }
-    //Print the buffer
-    krnl_efi_systable->ConOut->OutputString(krnl_efi_systable->ConOut, (CHAR16*)(buf + 1));
+    va_start(valist, msg);
+    _sink_printf(&sink, msg, valist);
     va_end(valist);
 }
 
@@ -312,37 +312,61 @@ void krnl_dump(void){
 
     krnl_write_msg(__FILE__, __LINE__, "tasks:");
     //Scan through the task list
-    task_t* tasks = mtask_get_task_list();
-    for(uint32_t i = 0; i < MTASK_TASK_COUNT; i++){
+    for(uint32_t i = 0; i < mtask_task_count(); i++){
+        task_t* task = mtask_get_task(i);
         //If task at that index is valid
-        if(tasks[i].valid){
+        if(task->valid){
             //Print its details
             char temp[200];
             temp[0] = 0;
             char temp2[20];
-            strcat(temp, tasks[i].name);
+            strcat(temp, task->info->name);
             strcat(temp, ", PID ");
-            strcat(temp, sprintu(temp2, tasks[i].pid, 1));
-            if(tasks[i].pid == mtask_get_pid())
+            strcat(temp, sprintu(temp2, task->pid, 1));
+            if(task->pid == mtask_get_pid())
                 strcat(temp, " [running at dump]");
-            if(tasks[i].state_code != TASK_STATE_RUNNING){
+            if(task->state_code != TASK_STATE_RUNNING){
                 strcat(temp, " [blocked till cycle ");
-                strcat(temp, sprintub16(temp2, tasks[i].blocked_till, 1));
+                strcat(temp, sprintub16(temp2, task->blocked_till, 1));
                 strcat(temp, " / current ");
                 strcat(temp, sprintub16(temp2, rdtsc(), 1));
                 strcat(temp, "]");
             }
             krnl_write_msg(__FILE__, __LINE__, temp);
-            krnl_dump_task_state(&tasks[i]);
+            krnl_dump_task_state(task);
             krnl_write_msg(__FILE__, __LINE__, "");
         }
     }
+
+    krnl_write_msgf(__FILE__, __LINE__, "heap: %i KiB used, %i KiB free, largest free block %i KiB, %i%% fragmented",
+        stdlib_used_ram() / 1024, stdlib_free_ram() / 1024, stdlib_largest_free() / 1024, stdlib_heap_frag());
+    slab_dump();
+    krnl_flush_msgs();
+}
+
+/*
+ * Puts the descriptor of a task state segment into a GDT
+ */
+void krnl_gdt_set_tss(uint64_t* gdt, tss_t* tss){
+    uint64_t tss_addr = (uint64_t)tss;
+    uint64_t tss_size = sizeof(tss_t);
+    uint64_t tss_desc_hi =   tss_addr               >> 32;   //Limit and base
+    uint64_t tss_desc_lo =  (tss_size & 0xFFFF)            |
+                           ((tss_addr & 0xFFFF)     << 16) |
+                           ((tss_addr >> 16 & 0xFF) << 32) |
+                           ((tss_size >> 16 & 0xF ) << 48) |
+                           ((tss_addr >> 24 & 0xFF) << 56) |
+                           (0b0000000011101001ULL   << 40);  //Access and flags
+                            //G--A----PDD-TYPE
+    gdt[KRNL_TSS_SEL / 8]     = tss_desc_lo;
+    gdt[KRNL_TSS_SEL / 8 + 1] = tss_desc_hi;
 }
 
 /*
  * Exception ISR
  */
 void krnl_exc(void){
+    smp_lock_krnl();
     //Get the task that caused the exception
     task_t* task = mtask_get_cur_task();
     //If that task was running in userspace
@@ -351,7 +375,7 @@ void krnl_exc(void){
         char symbol[256];
         elf_get_sym(task, task->state.rip, symbol);
         krnl_write_msgf(__FILE__, __LINE__, "Task %s with PID %i caused %s at RIP=0x%x <%s>",
-            task->name, task->pid, krnl_exc_vect_to_str(task->state.exc_vector), task->state.rip, symbol);
+            task->info->name, task->pid, krnl_exc_vect_to_str(task->state.exc_vector), task->state.rip, symbol);
         krnl_write_msg(__FILE__, __LINE__, "Task state at exception:");
         krnl_dump_task_state(task);
         //Stop that task
@@ -369,9 +393,11 @@ void krnl_exc(void){
  * Display a boot progress bar
  */
 void krnl_boot_status(char* str, uint32_t progress){
-    //Only if we're not in verbose mode
-    if(krnl_verbose)
+    //Only if we're not in verbose mode, show the messages otherwise
+    if(krnl_verbose){
+        krnl_flush_msgs();
         return;
+    }
     //Draw the screen
     gfx_draw_filled_rect((p2d_t){.x = 0, .y = gfx_res_y() / 2},
                         (p2d_t){.x = gfx_res_x(), .y = 8}, COLOR32(255, 0, 0, 0));
@@ -453,12 +479,7 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable
     gfx_shift_buf();
 
     //Print all kernel messages that occured before graphics initialization
-    {
-        krnl_msg_t* msg = first_msg;
-        do
-            krnl_print_msg(msg);
-        while((msg = msg->next));
-    }
+    krnl_flush_msgs();
 
     krnl_write_msgf(__FILE__, __LINE__, "mapped default regions to upper half");
 
@@ -522,12 +543,26 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable
     __asm__ volatile("stmxcsr %0" : "=m"(sse_temp));
     sse_temp |= 0xFC0;
     __asm__ volatile("ldmxcsr %0" : : "m"(sse_temp));
-    //Set extended control register
-    uint64_t xcr0 = (1 << 0) | (1 << 1);
+    //Set extended control register: enable every component the CPU supports out of those
+    //  that only hold register state. AVX-512 needs AVX and all three of its components
+    //  to be enabled together, otherwise XSETBV faults
+    uint64_t xcr0 = CPUID_XCR0_X87 | CPUID_XCR0_SSE;
+    uint32_t cpuid_max, xcr0_lo = 0, xcr0_hi = 0;
+    cpuid_get_vendor(NULL, &cpuid_max);
+    if(cpuid_max >= 0xD)
+        cpuid_get_leaf(0xD, 0, &xcr0_lo, NULL, NULL, &xcr0_hi);
+    uint64_t xcr0_supp = ((uint64_t)xcr0_hi << 32) | xcr0_lo;
+    if(xcr0_supp & CPUID_XCR0_AVX){
+        xcr0 |= CPUID_XCR0_AVX;
+        if((xcr0_supp & CPUID_XCR0_AVX512) == CPUID_XCR0_AVX512)
+            xcr0 |= CPUID_XCR0_AVX512;
+    }
     __asm__ volatile("mov %0, %%ecx;"
                      "mov %1, %%edx;"
                      "mov %2, %%eax;"
                      "xsetbv" : : "r" ((uint32_t)0), "r" ((uint32_t)(xcr0 >> 32)), "r" ((uint32_t)xcr0) : "eax", "ecx", "edx");
+    //Choose the memory functions that suit the CPU
+    stdlib_init_mem();
 
     //Load INITRD
     krnl_boot_status("Reading INITRD", 10);
@@ -601,21 +636,10 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable
     new_gdt[user_cs / 8] |= 3ULL << 45; //set privilege level to 3
     new_gdt[user_ds / 8] |= 3ULL << 45;
     //Set up the task state segment and its descriptor
-    uint16_t tsss = 0x100;
+    uint16_t tsss = KRNL_TSS_SEL;
     tss_t* tss = calloc(1, sizeof(tss_t));
     tss->rsp0 = (uint64_t)malloc(16384) + 16384;
-    uint64_t tss_addr = (uint64_t)tss;
-    uint64_t tss_size = sizeof(tss_t);
-    uint64_t tss_desc_hi =   tss_addr               >> 32;   //Limit and base
-    uint64_t tss_desc_lo =  (tss_size & 0xFFFF)            |
-                           ((tss_addr & 0xFFFF)     << 16) |
-                           ((tss_addr >> 16 & 0xFF) << 32) |
-                           ((tss_size >> 16 & 0xF ) << 48) |
-                           ((tss_addr >> 24 & 0xF ) << 56) |
-                           (0b0000000011101001ULL   << 40);  //Access and flags
-                            //G--A----PDD-TYPE
-    new_gdt[tsss / 8]     = tss_desc_lo;
-    new_gdt[tsss / 8 + 1] = tss_desc_hi;
+    krnl_gdt_set_tss(new_gdt, tss);
     //Load the new GDT
     gdt_d.base = new_gdt;
     gdt_d.limit = 65535;
@@ -624,6 +648,8 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable
     //Load TR
     __asm__ volatile("ltr %0" : : "r"(tsss));
     krnl_write_msgf(__FILE__, __LINE__, "loaded TR");
+    //Point GS to the data of this processor
+    smp_init_bsp();
 
     //Set the system call stuff
     wrmsr(MSR_IA32_EFER, (rdmsr(MSR_IA32_EFER) & ~(0xFFFFFULL << 45)) | 1);
@@ -673,11 +699,15 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable
 
     krnl_write_msgf(__FILE__, __LINE__, "finished \"relocating\"");
 
-    //Run the initialization task
+    //Start the other processors
     syscall_init();
+    smp_init();
+    //Run the initialization task
     krnl_write_msgf(__FILE__, __LINE__, "running init");
     uint64_t status = elf_load("/initrd/init.elf", TASK_PRIVL_EVERYTHING, 2);
     if(status != ELF_STATUS_OK)
         krnl_write_msgf(__FILE__, __LINE__, "running init failed: error code %i", status);
-    while(1);
+    krnl_flush_msgs();
+    while(1)
+        __asm__ volatile("hlt");
 }
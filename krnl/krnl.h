@@ -12,8 +12,11 @@
 #define MSR_IA32_STAR                       0xC0000081
 #define MSR_IA32_LSTAR                      0xC0000082
 #define MSR_IA32_SFMASK                     0xC0000084
+#define MSR_IA32_GS_BASE                    0xC0000101
+#define MSR_IA32_KERNEL_GS_BASE             0xC0000102
 
-#define MAX_KRNL_MSG_SZ                     256
+//Task state segment selector, the GDT ends with its descriptor
+#define KRNL_TSS_SEL                        0x100
 
 //Kernel version
 #define KRNL_VERSION_STR "v0.6.1"
@@ -27,24 +30,17 @@ typedef struct {
     uint64_t size;
 } krnl_pos_t;
 
-//Kernel message struct
-typedef struct _krnl_msg_s {
-    uint64_t tsc;
-    char file[64];
-    uint32_t line;
-    char msg[MAX_KRNL_MSG_SZ];
-    struct _krnl_msg_s* next;
-} krnl_msg_t;
-
 //Function prototypes
 
 //Kernel message buffer
 void krnl_write_msg  (char* file, uint32_t line, char* msg);
 void krnl_write_msgf (char* file, uint32_t line, char* msg, ...);
+void krnl_flush_msgs (void);
 void krnl_writec_f   (char* msg, ...);
 //Low-level system information
 EFI_SYSTEM_TABLE* krnl_get_efi_systable(void);
 krnl_pos_t        krnl_get_pos(void);
+void              krnl_gdt_set_tss(uint64_t* gdt, tss_t* tss);
 //Entry point
 EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable);
 
@@ -4,21 +4,61 @@
 #include "./mtask.h"
 #include "../stdlib.h"
 #include "../drivers/timr.h"
+#include "../drivers/apic.h"
 #include "../drivers/gfx.h"
 #include "../vmem/vmem.h"
+#include "../vmem/pmem.h"
 #include "../krnl.h"
+#include "../cpuid.h"
+#include "../slab.h"
+#include "../smp.h"
+#include "../app_drv/elf/elf.h"
 
-task_t* mtask_task_list;
+//Table of all tasks (in no particular order) and a hash that maps PIDs to them
+task_t** mtask_table;
+uint32_t mtask_table_cnt, mtask_table_cap;
+task_t** mtask_hash;
+uint32_t mtask_hash_size;
+//Tasks that have stopped themselves, freed once no processor runs them anymore
+task_t* mtask_dead;
 uint64_t mtask_next_pid;
-uint32_t mtask_cur_task_no;
+//Caches task descriptors and their cold data come from
+slab_cache_t mtask_task_cache;
+slab_cache_t mtask_info_cache;
 uint8_t mtask_enabled;
-task_t* mtask_cur_task;
+//Run queues of the processors
+mtask_rq_t mtask_rqs[SMP_MAX_CPUS];
+//Length of a time slice in CPU cycles
+uint64_t mtask_quantum;
+//MWAIT hint the idle tasks use (or MTASK_IDLE_HLT if they halt instead)
+uint32_t mtask_idle_hint;
+//How the extended state is saved (used only by mtask_sw.s)
+uint8_t mtask_xsave_mode = MTASK_XSAVE;
+uint8_t mtask_xinuse_supported = 0;
+//Enabled extended state components and the cache their save areas come from
+uint64_t mtask_xfeat;
+slab_cache_t mtask_xstate_cache;
 
 /*
  * Returns the current task pointer
  */
 task_t* mtask_get_cur_task(void){
-    return mtask_cur_task;
+    return mtask_rqs[smp_cpu_id()].cur;
+}
+
+/*
+ * Returns the value that has to be loaded into CR3 to switch to a task
+ */
+uint64_t mtask_next_cr3(task_t* task){
+    uint32_t cpu = smp_cpu_id();
+    uint64_t cr3 = vmem_switch_cr3(task->state.cr3);
+    //Remember the PCID that might have been assigned
+    task->state.cr3 = cr3 & ~VMEM_CR3_NOFLUSH;
+    //Entries with that PCID are only known to be valid on the processor the task has last run on
+    if(task->last_cpu != cpu)
+        cr3 &= ~VMEM_CR3_NOFLUSH;
+    task->last_cpu = cpu;
+    return cr3;
 }
 
 /*
@@ -29,45 +69,191 @@ uint64_t mtask_is_enabled(void){
     return mtask_enabled;
 }
 
+/*
+ * Returns the extended state components (XCR0 bits) that tasks may use
+ */
+uint64_t mtask_get_xfeat(void){
+    return mtask_xfeat;
+}
+
+/*
+ * Waits for something to happen, for as long as there's nothing else to run
+ */
+static void mtask_idle(void* args){
+    mtask_rq_t* rq = &mtask_rqs[smp_cpu_id()];
+    while(1){
+        if(mtask_idle_hint == MTASK_IDLE_HLT){
+            __asm__ volatile("hlt");
+        } else {
+            //Wake up on interrupts or when a task is made ready
+            __asm__ volatile("monitor" : : "a" (&rq->ready_map), "c" (0), "d" (0));
+            if(rq->ready_map == 0)
+                __asm__ volatile("mwait" : : "a" (mtask_idle_hint), "c" (0));
+        }
+    }
+}
+
+/*
+ * Chooses how the idle tasks wait
+ */
+static void mtask_init_idle(void){
+    //Use MONITOR/MWAIT if the CPU has them, asking for the deepest
+    //  C-state up to MTASK_IDLE_CSTATE that it reports sub-states for
+    uint32_t feat_edx, feat_ecx, max_leaf;
+    cpuid_get_feat(&feat_edx, &feat_ecx);
+    cpuid_get_vendor(NULL, &max_leaf);
+    mtask_idle_hint = MTASK_IDLE_HLT;
+    if((feat_ecx & CPUID_FEAT_ECX_MONITOR) && max_leaf >= 5){
+        uint32_t mwait_ecx, mwait_edx;
+        cpuid_get_leaf(5, 0, NULL, NULL, &mwait_ecx, &mwait_edx);
+        mtask_idle_hint = 0; //C1
+        if(mwait_ecx & CPUID_MWAIT_ECX_EMX){
+            for(uint32_t cstate = MTASK_IDLE_CSTATE; cstate > 1; cstate--){
+                if((mwait_edx >> (4 * cstate)) & 0xF){
+                    mtask_idle_hint = (cstate - 1) << 4;
+                    break;
+                }
+            }
+        }
+    }
+    krnl_write_msgf(__FILE__, __LINE__, "idle task uses %s (hint 0x%x)",
+        (mtask_idle_hint == MTASK_IDLE_HLT) ? "HLT" : "MWAIT", mtask_idle_hint);
+}
+
+/*
+ * Sets up the run queue of the current processor along with its idle task
+ * The idle task runs in ring 0 and isn't in the task list
+ */
+static void mtask_init_rq(void){
+    uint32_t cpu = smp_cpu_id();
+    mtask_rq_t* rq = &mtask_rqs[cpu];
+    memset(rq, 0, sizeof(mtask_rq_t));
+    twheel_init(&rq->sleeping, rdtsc() >> MTASK_SLEEP_SHIFT);
+    //Create the idle task
+    uint16_t cs;
+    __asm__ volatile("movw %%cs, %0" : "=r" (cs));
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0" : "=m" (rflags));
+    void* stack = calloc(MTASK_IDLE_STACK, 1);
+    task_info_t* info = (task_info_t*)calloc(1, sizeof(task_info_t));
+    strcpy(info->name, "IDLE");
+    info->stack = stack;
+    rq->idle = (task_t){
+        .valid = 1,
+        .pid = 0,
+        .priority = 0,
+        .cpu = cpu,
+        .last_cpu = cpu,
+        .state_code = TASK_STATE_RUNNING,
+        .state.cr3 = vmem_get_cr3(),
+        .state.rip = (uint64_t)&mtask_idle,
+        .state.rsp = (uint64_t)stack + MTASK_IDLE_STACK,
+        .state.rflags = rflags | (1 << 9),
+        .state.cs = cs,
+        .state.exc_vector = 255,
+        .info = info
+    };
+    rq->cur = &rq->idle;
+    //The page fault handler saves the vector state here
+    smp_cur_cpu()->pf_xstate = (uint8_t*)slab_zalloc(&mtask_xstate_cache);
+}
+
 /*
  * Initializes the multitasking system
  */
 void mtask_init(void){
-    //Allocate a buffer for the task list
-    mtask_task_list = (task_t*)amalloc((MTASK_TASK_COUNT * sizeof(task_t)), 64);
-    //Clear it
-    memset(mtask_task_list, 0, MTASK_TASK_COUNT * sizeof(task_t));
+    //Set up the task table and the PID hash
+    slab_init_cache(&mtask_task_cache, "task", sizeof(task_t), 64, NULL);
+    slab_init_cache(&mtask_info_cache, "task_info", sizeof(task_info_t), 8, NULL);
+    mtask_table_cap = MTASK_TABLE_INIT;
+    mtask_table_cnt = 0;
+    mtask_table = (task_t**)calloc(mtask_table_cap, sizeof(task_t*));
+    mtask_hash_size = MTASK_HASH_INIT;
+    mtask_hash = (task_t**)calloc(mtask_hash_size, sizeof(task_t*));
+    mtask_dead = NULL;
     //Create a task with PID 0 for handling excceptions within the kernel while it's booting
-    mtask_task_list[0] = (task_t){
+    //  (it's not in the table)
+    task_t* boot = (task_t*)slab_zalloc(&mtask_task_cache);
+    *boot = (task_t){
         .valid = 1,
         .pid = 0,
-        .name = "KERNEL (booting)",
         .priority = 0,
         .state_code = TASK_STATE_RUNNING,
         .privl = TASK_PRIVL_EVERYTHING,
-        .state.exc_vector = 255
+        .last_cpu = SMP_NO_CPU,
+        .state.exc_vector = 255,
+        .info = (task_info_t*)slab_zalloc(&mtask_info_cache)
     };
+    strcpy(boot->info->name, "KERNEL (booting)");
     
-    mtask_cur_task = &mtask_task_list[0];
-    mtask_cur_task_no = 0;
     mtask_next_pid = 1;
+    mtask_quantum = timr_get_cpu_fq() / 1000000 * MTASK_QUANTUM;
     mtask_enabled = 0;
+    //Choose how the extended state is saved: XSAVEOPT skips the components that
+    //  are in their initial configuration or haven't changed since they were restored,
+    //  XSAVEC at least skips the former and doesn't leave holes in the area.
+    //  If the CPU can tell which components are in use, both saving and restoring
+    //  are skipped entirely for tasks that don't use them
+    uint32_t max_leaf, xsave_feat = 0, std_size = 0, cmp_size = 0;
+    cpuid_get_vendor(NULL, &max_leaf);
+    if(max_leaf >= 0xD){
+        cpuid_get_leaf(0xD, 0, NULL, &std_size, NULL, NULL);
+        cpuid_get_leaf(0xD, 1, &xsave_feat, &cmp_size, NULL, NULL);
+    }
+    if(xsave_feat & CPUID_XSAVE_EAX_XSAVEOPT)
+        mtask_xsave_mode = MTASK_XSAVEOPT;
+    else if(xsave_feat & CPUID_XSAVE_EAX_XSAVEC)
+        mtask_xsave_mode = MTASK_XSAVEC;
+    mtask_xinuse_supported = (xsave_feat & CPUID_XSAVE_EAX_XGETBV1) > 0;
+    //Size the save areas for the components that are enabled in XCR0. It's at least
+    //  the legacy area plus the XSAVE header, and XSAVE needs it to be 64-byte aligned
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__ volatile("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    mtask_xfeat = ((uint64_t)xcr0_hi << 32) | xcr0_lo;
+    uint64_t xstate_size = (std_size > cmp_size) ? std_size : cmp_size;
+    if(xstate_size < 576)
+        xstate_size = 576;
+    slab_init_cache(&mtask_xstate_cache, "xstate", xstate_size, 64, NULL);
+    boot->state.xstate = (uint8_t*)slab_zalloc(&mtask_xstate_cache);
+    krnl_write_msgf(__FILE__, __LINE__, "extended state: components 0x%x, %i B, mode %i, XINUSE %ssupported",
+        mtask_xfeat, xstate_size, mtask_xsave_mode, mtask_xinuse_supported ? "" : "not ");
+    mtask_init_idle();
+    mtask_init_rq();
+    mtask_rqs[0].cur = boot;
+    //Initialize the user address space manager
+    vma_init();
     //Initialize the scheduling timer
     timr_init();
 }
 
+/*
+ * Starts scheduling on an application processor, doesn't return
+ */
+void mtask_start_cpu(void){
+    mtask_init_rq();
+    __asm__ volatile("jmp mtask_restore_state");
+}
+
 /*
  * Gets a PID of the currently running task
  */
 uint64_t mtask_get_pid(void){
-    return mtask_cur_task->pid;
+    return mtask_get_cur_task()->pid;
+}
+
+/*
+ * Returns the number of tasks in the task table
+ */
+uint32_t mtask_task_count(void){
+    return mtask_table_cnt;
 }
 
 /*
- * Returns the task list
+ * Returns a task from the task table by its position
+ * Positions change when tasks are stopped
  */
-task_t* mtask_get_task_list(void){
-    return mtask_task_list;
+task_t* mtask_get_task(uint32_t idx){
+    return mtask_table[idx];
 }
 
 /*
@@ -77,6 +263,114 @@ void mtask_stop(void){
     mtask_enabled = 0;
 }
 
+/*
+ * Checks if a task is what some processor other than `skip` is running,
+ *   or if that processor still has its address space loaded
+ * The scheduler moves on to the next task before loading its address space,
+ *   so both have to be checked
+ */
+static uint8_t mtask_is_current(task_t* task, uint32_t skip){
+    for(uint32_t i = 0; i < smp_cpu_count(); i++){
+        cpu_t* cpu = smp_get_cpu(i);
+        if(i != skip && cpu->online && (mtask_rqs[i].cur == task || cpu->loaded == task))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the PID hash bucket a PID belongs to
+ * PIDs are handed out sequentially, so their lower bits are spread evenly
+ */
+static inline task_t** mtask_bucket(uint64_t pid){
+    return &mtask_hash[pid & (mtask_hash_size - 1)];
+}
+
+/*
+ * Doubles the number of PID hash buckets and redistributes the tasks
+ */
+static void mtask_grow_hash(void){
+    task_t** old = mtask_hash;
+    uint32_t old_size = mtask_hash_size;
+    mtask_hash_size *= 2;
+    mtask_hash = (task_t**)calloc(mtask_hash_size, sizeof(task_t*));
+    for(uint32_t i = 0; i < old_size; i++){
+        task_t* task = old[i];
+        while(task != NULL){
+            task_t* next = task->hash_next;
+            task_t** bucket = mtask_bucket(task->pid);
+            task->hash_next = *bucket;
+            *bucket = task;
+            task = next;
+        }
+    }
+    free(old);
+}
+
+/*
+ * Puts a task into the task table and the PID hash
+ */
+static void mtask_insert(task_t* task){
+    //Grow the table by doubling it
+    if(mtask_table_cnt == mtask_table_cap){
+        task_t** table = (task_t**)malloc(2 * mtask_table_cap * sizeof(task_t*));
+        memcpy(table, mtask_table, mtask_table_cnt * sizeof(task_t*));
+        free(mtask_table);
+        mtask_table = table;
+        mtask_table_cap *= 2;
+    }
+    task->table_idx = mtask_table_cnt;
+    mtask_table[mtask_table_cnt++] = task;
+    //Keep the chains short
+    if(mtask_table_cnt > mtask_hash_size)
+        mtask_grow_hash();
+    task_t** bucket = mtask_bucket(task->pid);
+    task->hash_next = *bucket;
+    *bucket = task;
+}
+
+/*
+ * Takes a task out of the task table and the PID hash
+ */
+static void mtask_remove(task_t* task){
+    //Move the last task into its place
+    task_t* last = mtask_table[--mtask_table_cnt];
+    mtask_table[task->table_idx] = last;
+    last->table_idx = task->table_idx;
+    task_t** link = mtask_bucket(task->pid);
+    while(*link != task)
+        link = &(*link)->hash_next;
+    *link = task->hash_next;
+}
+
+/*
+ * Frees what's left of a stopped task once no processor runs it
+ */
+static void mtask_free(task_t* task){
+    vmem_destroy_pml4(task->state.cr3);
+    if(task->info->stack != NULL)
+        free(task->info->stack);
+    slab_free(&mtask_xstate_cache, task->state.xstate);
+    slab_free(&mtask_info_cache, task->info);
+    slab_free(&mtask_task_cache, task);
+}
+
+/*
+ * Frees the tasks that have stopped themselves and aren't run by any processor anymore
+ */
+static void mtask_reap(void){
+    task_t** link = &mtask_dead;
+    while(*link != NULL){
+        task_t* task = *link;
+        if(mtask_is_current(task, SMP_NO_CPU)){
+            link = &task->q_next;
+            continue;
+        }
+        *link = task->q_next;
+        mtask_free(task);
+    }
+}
+
 /*
  * Creates a task
  * If it's the first task ever created, starts multitasking
@@ -86,16 +380,14 @@ uint64_t mtask_create_task(uint64_t stack_size, char* name, uint8_t priority, ui
         void* suggested_stack, uint8_t start, void(*func)(void*), void* args, uint64_t privl, uint8_t* symtab,
         uint8_t* strtab){
 
-    //Find the first empty task descriptor
-    task_t* task = NULL;
-    for(int i = 0; i < MTASK_TASK_COUNT; i++){
-        if(!mtask_task_list[i].valid){
-            task = &mtask_task_list[i];
-            break;
-        }
-    }
+    //Allocate the descriptor and its cold data
+    mtask_reap();
+    task_t* task = (task_t*)slab_zalloc(&mtask_task_cache);
+    task->info = (task_info_t*)slab_zalloc(&mtask_info_cache);
     //Clear the task registers (except for RCX, set it to the argument pointer)
     task->state = (task_state_t){0, 0, (uint64_t)args, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255};
+    //Allocate the extended state area, all components start in their initial configuration
+    task->state.xstate = (uint8_t*)slab_zalloc(&mtask_xstate_cache);
     //Use the current address space or assign the suggested CR3
     uint64_t cr3 = _cr3;
     if(cr3 == 0)
@@ -105,8 +397,9 @@ uint64_t mtask_create_task(uint64_t stack_size, char* name, uint8_t priority, ui
         vmem_map(cr3, 0, (phys_addr_t)(8ULL * 1024 * 1024 * 1024), 0);
     //Allocate memory for the task stack
     void* task_stack = suggested_stack;
+    task->info->stack = NULL;
     if(task_stack == NULL)
-        task_stack = calloc(stack_size, 1);
+        task_stack = task->info->stack = calloc(stack_size, 1);
     task->state.rsp = (uint64_t)((uint8_t*)task_stack + stack_size);
     //Assign the task RFLAGS
     uint64_t rflags;
@@ -116,34 +409,230 @@ uint64_t mtask_create_task(uint64_t stack_size, char* name, uint8_t priority, ui
     //Set/reset some vars
     task->valid = 1;
     task->pid = mtask_next_pid++;
-    memcpy(task->name, name, strlen(name) + 1);
-    memset(task->open_files, 0, sizeof(file_handle_t*) * MTASK_MAX_OPEN_FILES);
+    memcpy(task->info->name, name, strlen(name) + 1);
+    task->info->open_files = NULL;
+    task->info->files_cap = 0;
     task->state.rip = (uint64_t)func;
-    task->state_code = start ? TASK_STATE_RUNNING : TASK_STATE_WAITING_TO_RUN;
+    task->state_code = TASK_STATE_WAITING_TO_RUN;
     task->blocked_till = 0;
-    task->next_alloc = (virt_addr_t)((1ULL << 46) | (1ULL << 45));
+    task->queued = MTASK_QUEUE_NONE;
+    task->wq = NULL;
+    task->wait_till = 0;
+    task->wait_restart = 0;
+    task->info->vmas = (vma_tree_t){NULL, 0};
+    task->info->image = NULL;
+    task->info->page_faults = 0;
     task->state.cs = 0x93;
-    task->symtab = symtab;
-    task->strtab = strtab;
-    task->priority = priority;
-    task->prio_cnt = task->priority;
+    task->info->symtab = symtab;
+    task->info->strtab = strtab;
+    task->priority = (priority < MTASK_PRIO_LEVELS) ? priority : (MTASK_PRIO_LEVELS - 1);
+    task->slice_end = 0;
+    task->cpu = smp_cpu_id();
+    task->last_cpu = SMP_NO_CPU;
+    task->stop_pending = 0;
     task->privl = privl;
+    mtask_insert(task);
+
+    if(start)
+        mtask_start_task(task);
+
+    return task->pid;
+}
+
+/*
+ * Puts a task at the end of the ready queue of its priority level
+ */
+static void mtask_enqueue(mtask_rq_t* rq, task_t* task){
+    uint8_t prio = task->priority;
+    task->q_next = NULL;
+    task->q_prev = rq->ready_tail[prio];
+    if(task->q_prev != NULL)
+        task->q_prev->q_next = task;
+    else
+        rq->ready_head[prio] = task;
+    rq->ready_tail[prio] = task;
+    task->queued = MTASK_QUEUE_READY;
+    rq->ready_cnt++;
+    rq->ready_map |= 1 << prio;
+}
+
+/*
+ * Takes a task off the queue it's in
+ */
+static void mtask_dequeue(mtask_rq_t* rq, task_t* task){
+    if(task->queued == MTASK_QUEUE_SLEEPING){
+        twheel_remove(&rq->sleeping, &task->wakeup);
+    } else if(task->queued == MTASK_QUEUE_READY){
+        if(task->q_next != NULL)
+            task->q_next->q_prev = task->q_prev;
+        else
+            rq->ready_tail[task->priority] = task->q_prev;
+        if(task->q_prev != NULL)
+            task->q_prev->q_next = task->q_next;
+        else
+            rq->ready_head[task->priority] = task->q_next;
+        if(rq->ready_head[task->priority] == NULL)
+            rq->ready_map &= ~(1 << task->priority);
+        rq->ready_cnt--;
+    }
+    task->queued = MTASK_QUEUE_NONE;
+}
 
+/*
+ * Takes the lock of the run queue a task belongs to, returns that queue
+ */
+static mtask_rq_t* mtask_lock_rq(task_t* task){
+    while(1){
+        //The task may be moved to another queue while we're waiting for the lock
+        uint32_t cpu = task->cpu;
+        mtask_rq_t* rq = &mtask_rqs[cpu];
+        spinlock_acquire(&rq->lock);
+        if(task->cpu == cpu)
+            return rq;
+        spinlock_release(&rq->lock);
+    }
+}
+
+/*
+ * Takes a task off the wait queue it's in
+ */
+static void mtask_wq_remove(task_t* task){
+    mtask_wq_t* wq = task->wq;
+    if(wq == NULL)
+        return;
+    if(task->wq_next != NULL)
+        task->wq_next->wq_prev = task->wq_prev;
+    else
+        wq->tail = task->wq_prev;
+    if(task->wq_prev != NULL)
+        task->wq_prev->wq_next = task->wq_next;
+    else
+        wq->head = task->wq_next;
+    task->wq = NULL;
+}
+
+/*
+ * Makes a task whose wakeup timer has expired ready
+ */
+static void mtask_wake(twheel_entry_t* entry){
+    task_t* task = (task_t*)((uint8_t*)entry - __builtin_offsetof(task_t, wakeup));
+    task->queued = MTASK_QUEUE_NONE;
+    task->state_code = TASK_STATE_RUNNING;
+    task->blocked_till = 0;
+    //Sleeping tasks stay in the queue of the processor they've gone to sleep on
+    mtask_enqueue(&mtask_rqs[task->cpu], task);
+}
+
+/*
+ * Makes all sleeping tasks of a run queue whose time has come ready at once
+ */
+static void mtask_wake_sleeping(mtask_rq_t* rq){
+    twheel_advance(&rq->sleeping, rdtsc() >> MTASK_SLEEP_SHIFT, mtask_wake);
+}
+
+/*
+ * Checks if a task can keep running
+ */
+static inline uint8_t mtask_runnable(task_t* task){
+    return task->valid && task->state_code == TASK_STATE_RUNNING && task->pid != 0 && !task->stop_pending;
+}
+
+/*
+ * Arms the timer of the current processor for the next moment the scheduler has to run at:
+ *   right away if the current task can't keep running or a task of a higher priority is ready,
+ *   the end of its time slice if another task of the same priority is waiting, or the earliest wakeup
+ * If none of that applies, the current task isn't interrupted at all
+ * The lock of the run queue has to be held
+ */
+static void mtask_arm_timer(mtask_rq_t* rq){
+    task_t* cur = rq->cur;
+    uint64_t waiting = (uint64_t)rq->ready_map >> cur->priority;
+    //The idle task gives the CPU up as soon as anything else is ready
+    uint8_t preempt = (cur == &rq->idle) ? (waiting != 0) : (!mtask_runnable(cur) || waiting > 1);
+    if(preempt){
+        timr_arm(rdtsc());
+        return;
+    }
+    uint64_t next = (waiting == 1) ? cur->slice_end : 0;
+    uint64_t wakeup = twheel_next(&rq->sleeping);
+    if(wakeup != 0xFFFFFFFFFFFFFFFFULL){
+        wakeup <<= MTASK_SLEEP_SHIFT;
+        if(next == 0 || wakeup < next)
+            next = wakeup;
+    }
+    timr_arm(next);
+}
+
+/*
+ * Makes a processor run its scheduler
+ */
+static inline void mtask_kick(uint32_t cpu){
+    lapic_send_ipi(smp_get_cpu(cpu)->lapic_id, LAPIC_ICR_FIXED | 32);
+}
+
+/*
+ * Returns the number of tasks that compete for a processor
+ */
+static inline uint32_t mtask_load(uint32_t cpu){
+    mtask_rq_t* rq = &mtask_rqs[cpu];
+    return rq->ready_cnt + (rq->cur != &rq->idle);
+}
+
+/*
+ * Chooses the processor a new task is going to run on: the least loaded one,
+ *   preferring the current one
+ */
+static uint32_t mtask_place(void){
+    uint32_t best = smp_cpu_id();
+    uint32_t best_load = mtask_load(best);
+    for(uint32_t i = 0; i < smp_cpu_count() && best_load > 0; i++){
+        if(!smp_get_cpu(i)->online)
+            continue;
+        uint32_t load = mtask_load(i);
+        if(load < best_load){
+            best = i;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+/*
+ * Lets a task that has been created without starting it run
+ * If it's the first task ever created, starts multitasking
+ */
+void mtask_start_task(task_t* task){
+    task->state_code = TASK_STATE_RUNNING;
+    uint32_t self = smp_cpu_id();
     //Check if it's the first task ever created
-    if(task->pid == 1 && start){
-        //Enable physwin
-        vmem_enable_physwin();
+    if(task->pid == 1){
         //Assign the current task
-        mtask_cur_task = task;
-        mtask_cur_task_no = 0;
-        //Inavlidate the PID 0 task
-        mtask_task_list[0].valid = 0;
+        task_t* boot = mtask_rqs[self].cur;
+        task->cpu = self;
+        mtask_rqs[self].cur = task;
+        //Free the PID 0 task, nothing switches back to it
+        slab_free(&mtask_xstate_cache, boot->state.xstate);
+        slab_free(&mtask_info_cache, boot->info);
+        slab_free(&mtask_task_cache, boot);
+        //Make the kernel fault on writes to shared user pages too
+        vmem_write_protect(1);
         //Switch to the newly created task
         mtask_enabled = 1;
+        task->slice_end = rdtsc() + mtask_quantum;
+        mtask_arm_timer(&mtask_rqs[self]);
         __asm__ volatile("jmp mtask_restore_state");
     }
-
-    return task->pid;
+    uint32_t cpu = mtask_enabled ? mtask_place() : self;
+    mtask_rq_t* rq = &mtask_rqs[cpu];
+    spinlock_acquire(&rq->lock);
+    task->cpu = cpu;
+    mtask_enqueue(rq, task);
+    //It might have to take over or share the CPU
+    if(mtask_enabled && cpu == self)
+        mtask_arm_timer(rq);
+    spinlock_release(&rq->lock);
+    if(mtask_enabled && cpu != self)
+        mtask_kick(cpu);
 }
 
 /*
@@ -152,22 +641,93 @@ uint64_t mtask_create_task(uint64_t stack_size, char* name, uint8_t priority, ui
 task_t* mtask_get_by_pid(uint64_t pid){
     if(pid == 0)
         return NULL;
-    for(uint32_t i = 0; i < MTASK_TASK_COUNT; i++)
-        if(mtask_task_list[i].valid && mtask_task_list[i].pid == pid)
-            return &mtask_task_list[i];
-    return NULL;
+    task_t* task = *mtask_bucket(pid);
+    while(task != NULL && task->pid != pid)
+        task = task->hash_next;
+    return task;
+}
+
+/*
+ * Returns the frames backing a range of pages to the frame allocator and unmaps it
+ */
+static void mtask_pfree_range(task_t* task, virt_addr_t start, uint64_t num){
+    for(uint64_t p = 0; p < num; p++){
+        //Frames that are shared with other tasks aren't ours to free
+        uint64_t entry = vmem_page_entry(task->state.cr3, (virt_addr_t)((uint8_t*)start + (4096 * p)));
+        if((entry & VMEM_PTE_PRESENT) && !(entry & VMEM_PTE_SHARED))
+            pmem_free((phys_addr_t)(entry & VMEM_PTE_ADDR), 0);
+    }
+    vmem_unmap(task->state.cr3, start, (uint8_t*)start + (4096 * num));
 }
 
 /*
- * Stops the task with by the PID
+ * Stops the task with by the PID and frees everything it holds
  */
 void mtask_stop_task(uint64_t pid){
-    memset(mtask_get_by_pid(pid), 0, sizeof(task_t));
-    //Hang if we're terminating the current task
-    if(pid == mtask_get_pid()){
-        mtask_schedule();
+    task_t* task = mtask_get_by_pid(pid);
+    if(task == NULL)
+        return;
+    //Take it off the queue it's in so that no processor picks it up
+    uint32_t self = smp_cpu_id();
+    mtask_rq_t* rq = mtask_lock_rq(task);
+    mtask_dequeue(rq, task);
+    task->stop_pending = 1;
+    uint32_t cpu = task->cpu;
+    uint8_t elsewhere = mtask_is_current(task, self);
+    spinlock_release(&rq->lock);
+    //If another processor is running it, make it switch away and wait until its
+    //  address space isn't loaded anymore (without the kernel lock, that processor
+    //  might need it to get there)
+    if(elsewhere){
+        mtask_kick(cpu);
+        uint32_t depth = smp_drop_krnl();
+        while(mtask_is_current(task, self))
+            __asm__ volatile("pause");
+        smp_retake_krnl(depth);
+        //The task might have stopped itself in the meantime
+        if(mtask_get_by_pid(pid) != task)
+            return;
+    }
+    //Nobody can find it from now on
+    task->valid = 0;
+    mtask_remove(task);
+    mtask_wq_remove(task);
+    task_info_t* info = task->info;
+    //Close the files
+    for(uint32_t i = 0; i < info->files_cap; i++)
+        if(info->open_files[i] != NULL)
+            diskio_release(info->open_files[i]);
+    if(info->open_files != NULL)
+        free(info->open_files);
+    //Free the memory regions, then the address space itself
+    vma_t* vma = vma_first(&info->vmas);
+    while(vma != NULL){
+        mtask_pfree_range(task, (virt_addr_t)vma->start, (vma->end - vma->start) / 4096);
+        vma_remove(&info->vmas, vma);
+        vma = vma_first(&info->vmas);
+    }
+    //Release the image (along with the symbol table)
+    if(info->image != NULL)
+        elf_release(info->image);
+    info->image = NULL;
+    info->symtab = info->strtab = NULL;
+    //Free the rest, unless we're terminating the current task: its stack, address space,
+    //  extended state area and descriptor are still in use until the scheduler
+    //  switches away from it, so hang until then
+    mtask_reap();
+    rq = &mtask_rqs[self];
+    if(task != rq->cur){
+        mtask_free(task);
+    } else {
+        task->q_next = mtask_dead;
+        mtask_dead = task;
+        spinlock_acquire(&rq->lock);
+        mtask_arm_timer(rq);
+        spinlock_release(&rq->lock);
+        smp_drop_krnl();
         __asm__ volatile("sti");
-        while(1);
+        while(1)
+            __asm__ volatile("hlt");
     }
 }
 
@@ -175,74 +735,270 @@ void mtask_stop_task(uint64_t pid){
  * Checks if a task with the specified PID exists
  */
 uint8_t mtask_exists(uint64_t pid){
-    for(uint32_t i = 0; i < MTASK_TASK_COUNT; i++)
-        if(mtask_task_list[i].pid == pid)
-            return 1;
-    return 0;
+    return mtask_get_by_pid(pid) != NULL;
 }
 
 /*
- * Chooses the next task to be run
+ * Takes a ready task of the highest priority from the busiest other processor
+ * Returns NULL if there's none or its run queue is busy
+ */
+static task_t* mtask_steal(uint32_t self){
+    uint32_t victim = self, most = 0;
+    for(uint32_t i = 0; i < smp_cpu_count(); i++){
+        if(i != self && smp_get_cpu(i)->online && mtask_rqs[i].ready_cnt > most){
+            victim = i;
+            most = mtask_rqs[i].ready_cnt;
+        }
+    }
+    //Don't wait for the lock, the victim is likely scheduling
+    mtask_rq_t* rq = &mtask_rqs[victim];
+    if(victim == self || !spinlock_try(&rq->lock))
+        return NULL;
+    task_t* task = NULL;
+    if(rq->ready_map != 0){
+        task = rq->ready_head[31 - __builtin_clz(rq->ready_map)];
+        mtask_dequeue(rq, task);
+        task->cpu = self;
+    }
+    spinlock_release(&rq->lock);
+    return task;
+}
+
+/*
+ * Makes an idle processor steal work if tasks are waiting in a run queue
+ */
+static void mtask_balance(uint32_t self, mtask_rq_t* rq){
+    if(rq->ready_cnt == 0)
+        return;
+    for(uint32_t i = 0; i < smp_cpu_count(); i++){
+        mtask_rq_t* other = &mtask_rqs[i];
+        if(i != self && smp_get_cpu(i)->online && other->cur == &other->idle && other->ready_map == 0){
+            mtask_kick(i);
+            return;
+        }
+    }
+}
+
+/*
+ * Chooses the next task to be run on the current processor
  */
 void mtask_schedule(void){
-    //If the currently running task still has time available
-    if(mtask_cur_task->prio_cnt > 0) {
-        //Decrease its available time
-        mtask_cur_task->prio_cnt--;
+    uint32_t self = smp_cpu_id();
+    mtask_rq_t* rq = &mtask_rqs[self];
+    spinlock_acquire(&rq->lock);
+    task_t* cur = rq->cur;
+    uint8_t runnable = mtask_runnable(cur);
+    mtask_wake_sleeping(rq);
+    //Keep running the current task while it has time left or nobody else
+    //  of its priority is waiting, unless a task of a higher priority is ready
+    uint64_t waiting = (uint64_t)rq->ready_map >> cur->priority;
+    if(runnable && (waiting == 0 || (waiting == 1 && rdtsc() < cur->slice_end))){
+        mtask_arm_timer(rq);
+        spinlock_release(&rq->lock);
+        mtask_balance(self, rq);
         return;
+    }
+    //Put it back at the end of its queue
+    if(runnable)
+        mtask_enqueue(rq, cur);
+    //Take the first task of the highest priority level, try to get one
+    //  from another processor if no task is ready, idle if that fails too
+    task_t* next = NULL;
+    if(rq->ready_map != 0){
+        next = rq->ready_head[31 - __builtin_clz(rq->ready_map)];
+        mtask_dequeue(rq, next);
     } else {
-        //If not, restore its time
-        mtask_cur_task->prio_cnt = mtask_cur_task->priority;
-        //Go find a new task
-        while(1){
-            //We scan through the task list to find a next task that's valid and not blocked
-            if(mtask_cur_task_no++ >= MTASK_TASK_COUNT)
-                mtask_cur_task_no = 0;
-            //Remove blocks on tasks that need to be unblocked
-            if(mtask_task_list[mtask_cur_task_no].state_code == TASK_STATE_BLOCKED_CYCLES){
-                if(rdtsc() >= mtask_task_list[mtask_cur_task_no].blocked_till){
-                    mtask_task_list[mtask_cur_task_no].state_code = TASK_STATE_RUNNING;
-                    mtask_task_list[mtask_cur_task_no].blocked_till = 0;
-                }
-            }
+        next = mtask_steal(self);
+    }
+    if(next != NULL)
+        next->slice_end = rdtsc() + mtask_quantum;
+    else
+        next = &rq->idle;
+    rq->cur = next;
+    mtask_arm_timer(rq);
+    spinlock_release(&rq->lock);
+    mtask_balance(self, rq);
+}
 
-            if(mtask_task_list[mtask_cur_task_no].valid &&
-               mtask_task_list[mtask_cur_task_no].state_code == TASK_STATE_RUNNING &&
-               mtask_task_list[mtask_cur_task_no].pid != 0) //don't switch to the booting kernel
-                break;
-        }
-        mtask_cur_task = &mtask_task_list[mtask_cur_task_no];
+/*
+ * Gives the rest of the time slice of the currently running task to other tasks of its priority
+ */
+void mtask_yield(void){
+    mtask_rq_t* rq = &mtask_rqs[smp_cpu_id()];
+    spinlock_acquire(&rq->lock);
+    //The slice ends right away if anybody is waiting
+    rq->cur->slice_end = rdtsc();
+    mtask_arm_timer(rq);
+    spinlock_release(&rq->lock);
+}
+
+/*
+ * Blocks the currently running task until the TSC reaches a value
+ */
+void mtask_dly_until(uint64_t tsc){
+    if(tsc <= rdtsc())
+        return;
+    mtask_rq_t* rq = &mtask_rqs[smp_cpu_id()];
+    spinlock_acquire(&rq->lock);
+    task_t* cur = rq->cur;
+    //A task that is being stopped isn't put to sleep, it's not going to wake up anyway
+    if(!cur->stop_pending){
+        //Set the block
+        cur->blocked_till = tsc;
+        cur->state_code = TASK_STATE_BLOCKED_CYCLES;
+        cur->queued = MTASK_QUEUE_SLEEPING;
+        //Round the deadline up to the wheel precision so that the task never wakes up early
+        twheel_add(&rq->sleeping, &cur->wakeup,
+            (cur->blocked_till + (1ULL << MTASK_SLEEP_SHIFT) - 1) >> MTASK_SLEEP_SHIFT);
     }
+    //Switch away from it
+    mtask_arm_timer(rq);
+    spinlock_release(&rq->lock);
 }
 
 /*
  * Blocks the currently running task for a specific amount of CPU cycles
  */
 void mtask_dly_cycles(uint64_t cycles){
-    //Set the block
-    mtask_cur_task->blocked_till = rdtsc() + cycles;
-    mtask_cur_task->state_code = TASK_STATE_BLOCKED_CYCLES;
+    mtask_dly_until(rdtsc() + cycles);
 }
 
 /*
  * Blocks the currently running task for a specific time in microseconds
  */
 void mtask_dly_us(uint64_t us){
-    //Convert milliseconds to CPU cycles
-    uint64_t cycles = ((timr_get_cpu_fq() / 1000) * us) / 1000;
+    //Convert microseconds to CPU cycles
+    //  (dividing first, so that long delays don't overflow)
+    uint64_t cycles = (timr_get_cpu_fq() / 1000000) * us;
     //Block for that amount of cycles
     mtask_dly_cycles(cycles);
 }
 
+/*
+ * Takes a task off the wait queue it's in and makes it runnable again if it's still blocked
+ */
+static void mtask_wait_cancel(task_t* task){
+    mtask_wq_remove(task);
+    mtask_rq_t* rq = mtask_lock_rq(task);
+    if(task->state_code == TASK_STATE_BLOCKED_WAIT){
+        mtask_dequeue(rq, task);
+        task->state_code = TASK_STATE_RUNNING;
+        task->blocked_till = 0;
+    }
+    spinlock_release(&rq->lock);
+}
+
+/*
+ * Blocks the currently running task on a wait queue until it's woken up
+ *   or `timeout` microseconds pass (0 waits forever)
+ * The system call entry code switches away from the task instead of returning from the
+ *   call, which is started over once the task runs again, so it has to check for the event
+ *   itself before waiting. The timeout counts from the first time the call has waited
+ * Returns 1 if the task has been blocked, 0 if the time has run out
+ */
+uint8_t mtask_wait(mtask_wq_t* wq, uint64_t timeout){
+    task_t* task = mtask_get_cur_task();
+    //The call might have been started over before the task was switched away
+    mtask_wait_cancel(task);
+    uint64_t now = rdtsc();
+    if(timeout != 0 && task->wait_till == 0)
+        task->wait_till = now + ((timr_get_cpu_fq() / 1000) * timeout) / 1000;
+    if(task->wait_till != 0 && now >= task->wait_till)
+        return 0;
+    //Join the end of the queue
+    task->wq = wq;
+    task->wq_next = NULL;
+    task->wq_prev = wq->tail;
+    if(wq->tail != NULL)
+        wq->tail->wq_next = task;
+    else
+        wq->head = task;
+    wq->tail = task;
+    mtask_rq_t* rq = &mtask_rqs[smp_cpu_id()];
+    spinlock_acquire(&rq->lock);
+    //A task that is being stopped isn't blocked, it's not going to run again anyway
+    if(!task->stop_pending){
+        task->state_code = TASK_STATE_BLOCKED_WAIT;
+        task->blocked_till = task->wait_till;
+        //Set a timer that ends the wait if it's limited
+        if(task->wait_till != 0){
+            task->queued = MTASK_QUEUE_SLEEPING;
+            twheel_add(&rq->sleeping, &task->wakeup,
+                (task->wait_till + (1ULL << MTASK_SLEEP_SHIFT) - 1) >> MTASK_SLEEP_SHIFT);
+        }
+    }
+    //Switch away from it
+    mtask_arm_timer(rq);
+    spinlock_release(&rq->lock);
+    task->wait_restart = 1;
+    return 1;
+}
+
+/*
+ * Wakes up all tasks blocked on a wait queue
+ */
+void mtask_wake_all(mtask_wq_t* wq){
+    uint32_t self = smp_cpu_id();
+    while(wq->head != NULL){
+        task_t* task = wq->head;
+        mtask_wq_remove(task);
+        mtask_rq_t* rq = mtask_lock_rq(task);
+        uint32_t cpu = task->cpu;
+        uint8_t queued = 0;
+        //It might have timed out already
+        if(task->state_code == TASK_STATE_BLOCKED_WAIT){
+            mtask_dequeue(rq, task);
+            task->state_code = TASK_STATE_RUNNING;
+            task->blocked_till = 0;
+            //A task that hasn't been switched away from yet just keeps running
+            if(rq->cur != task){
+                mtask_enqueue(rq, task);
+                queued = 1;
+            }
+        }
+        //It might have to take over the CPU
+        if(queued && cpu == self)
+            mtask_arm_timer(rq);
+        spinlock_release(&rq->lock);
+        if(queued && cpu != self)
+            mtask_kick(cpu);
+    }
+}
+
+/*
+ * Finishes the system call the current task is in
+ * Returns 1 if the task has been blocked and the call has to be started over, otherwise
+ *   ends the wait it has done
+ */
+uint8_t mtask_wait_restart(void){
+    task_t* task = mtask_get_cur_task();
+    if(task->wait_restart){
+        task->wait_restart = 0;
+        return 1;
+    }
+    if(task->wq != NULL || task->state_code == TASK_STATE_BLOCKED_WAIT)
+        mtask_wait_cancel(task);
+    task->wait_till = 0;
+    return 0;
+}
+
+/*
+ * Checks if the currently running task can't keep running
+ */
+uint8_t mtask_cur_blocked(void){
+    return !mtask_runnable(mtask_get_cur_task());
+}
+
 /*
  * Adds privileges specified in mask to the currently running process
  */
 void mtask_escalate(uint64_t mask){
-    if(mtask_cur_task->privl & TASK_PRIVL_SUDO_MODE) {
-        mtask_cur_task->privl |= mask;
+    task_t* task = mtask_get_cur_task();
+    if(task->privl & TASK_PRIVL_SUDO_MODE) {
+        task->privl |= mask;
     } else {
         //TODO: some kind of user input to confirm the escalation
-        mtask_cur_task->privl |= mask | TASK_PRIVL_SUDO_MODE;
+        task->privl |= mask | TASK_PRIVL_SUDO_MODE;
     }
 }
 
@@ -251,16 +1007,26 @@ void mtask_escalate(uint64_t mask){
  */
 void mtask_add_open_file(file_handle_t* ptr){
     task_t* task = mtask_get_by_pid(ptr->pid);
-    //Go through the list
-    if(task != NULL){
-        for(int i = 0; i < MTASK_MAX_OPEN_FILES; i++){
-            //Find an unused entry
-            if(task->open_files[i] == NULL){
-                task->open_files[i] = ptr;
-                break;
-            }
+    if(task == NULL)
+        return;
+    task_info_t* info = task->info;
+    //Find an unused entry
+    uint32_t i = 0;
+    while(i < info->files_cap && info->open_files[i] != NULL)
+        i++;
+    //Grow the list if it's full
+    if(i == info->files_cap){
+        if(info->files_cap >= MTASK_MAX_OPEN_FILES)
+            return;
+        file_handle_t** files = (file_handle_t**)calloc(info->files_cap + MTASK_FILES_STEP, sizeof(file_handle_t*));
+        if(info->open_files != NULL){
+            memcpy(files, info->open_files, info->files_cap * sizeof(file_handle_t*));
+            free(info->open_files);
         }
+        info->open_files = files;
+        info->files_cap += MTASK_FILES_STEP;
     }
+    info->open_files[i] = ptr;
 }
 
 /*
@@ -270,10 +1036,10 @@ void mtask_remove_open_file(file_handle_t* ptr){
     task_t* task = mtask_get_by_pid(ptr->pid);
     //Go through the list
     if(task != NULL){
-        for(int i = 0; i < MTASK_MAX_OPEN_FILES; i++){
+        for(uint32_t i = 0; i < task->info->files_cap; i++){
             //Find the matching entry
-            if(task->open_files[i] == ptr){
-                task->open_files[i] = NULL;
+            if(task->info->open_files[i] == ptr){
+                task->info->open_files[i] = NULL;
                 break;
             }
         }
@@ -281,34 +1047,143 @@ void mtask_remove_open_file(file_handle_t* ptr){
 }
 
 /*
- * Allocates a number of memory pages and maps them for the specified process
+ * Returns an entry of the list of files opened by a task, NULL if it's out of range
+ */
+file_handle_t* mtask_get_open_file(task_t* task, uint64_t idx){
+    if(idx >= task->info->files_cap)
+        return NULL;
+    return task->info->open_files[idx];
+}
+
+/*
+ * Registers a region of the address space of a task that is backed by memory on demand
+ * The part of the region that is already covered by another one is skipped
+ *   (file-backed regions may share pages at their edges)
+ */
+vma_t* mtask_add_region(task_t* task, virt_addr_t at, uint64_t num, file_handle_t* file,
+                        uint64_t file_offs, uint64_t file_size){
+    uint64_t start = (uint64_t)at;
+    vma_t* prev = vma_find(&task->info->vmas, start);
+    if(prev != NULL)
+        start = prev->end;
+    //A region that lies entirely in the last page of the previous one can't be added
+    //  (its data wouldn't be read into that page)
+    if(start >= (uint64_t)at + (4096 * num))
+        return NULL;
+    vma_t* vma = vma_insert(&task->info->vmas, start, (uint64_t)at + (4096 * num));
+    if(vma == NULL)
+        return NULL;
+    vma->origin = (uint64_t)at;
+    vma->file = file;
+    vma->file_offs = file_offs;
+    vma->file_size = file_size;
+    vma->writable = 1;
+    return vma;
+}
+
+/*
+ * Allocates a number of memory pages for the specified process
+ * The pages are backed by memory when they're accessed for the first time
  */
 virt_addr_t mtask_palloc(uint64_t pid, uint64_t num){
     task_t* task = mtask_get_by_pid(pid);
-    //Allocate pages
-    virt_addr_t krnl_addr = amalloc(4096 * num, 4096);
-    if(krnl_addr == NULL)
+    //Find the lowest free range of addresses
+    uint64_t addr = vma_find_free(&task->info->vmas, MTASK_PALLOC_BASE, MTASK_PALLOC_LIMIT, 4096 * num);
+    if(addr == 0 || mtask_add_region(task, (virt_addr_t)addr, num, NULL, 0, 0) == NULL)
         return NULL;
-    phys_addr_t phys_addr = vmem_virt_to_phys(vmem_get_cr3(), krnl_addr);
-    //Find an unused allocation entry and stick the address in there
-    for(int i = 0; i < MTASK_MAX_ALLOCATIONS; i++){
-        if(!task->allocations[i].used){
-            task->allocations[i].used = 1;
-            task->allocations[i].num = num;
-            task->allocations[i].krnl_map = krnl_addr;
-            task->allocations[i].proc_map = task->next_alloc;
-            break;
+    return (virt_addr_t)addr;
+}
+
+/*
+ * Copies the file data of a region that falls into a page
+ */
+static void mtask_fill_from(vma_t* vma, uint8_t* data, uint64_t page){
+    uint64_t st = vma->origin;
+    uint64_t end = st + vma->file_size;
+    if(vma->file == NULL || end <= page || st >= page + 4096)
+        return;
+    uint64_t from = (st > page) ? st : page;
+    uint64_t to = (end < page + 4096) ? end : page + 4096;
+    vma->file->position = vma->file_offs + (from - st);
+    //The image handle isn't owned by the faulting task
+    diskio_read_krnl(vma->file, data + (from - page), to - from);
+}
+
+/*
+ * Fills a frame with the data a page of a region should have initially
+ */
+static void mtask_fill_page(task_t* task, vma_t* vma, phys_addr_t frame, uint64_t page){
+    uint8_t* data = (uint8_t*)vmem_phys_to_virt(frame);
+    memset(data, 0, 4096);
+    //The data of the next region may start in this page too if it was cut
+    mtask_fill_from(vma, data, page);
+    vma_t* next = vma_next(&task->info->vmas, vma);
+    if(next != NULL)
+        mtask_fill_from(next, data, page);
+}
+
+/*
+ * Backs a page of a task with memory if it belongs to one of the regions
+ * Returns 1 if the fault has been resolved
+ */
+static uint8_t mtask_resolve_pf(task_t* task, virt_addr_t addr, uint64_t err){
+    uint64_t page = (uint64_t)addr & ~4095ULL;
+    uint8_t write = (err & 2) > 0;
+    //Find the region the page belongs to
+    vma_t* region = vma_find(&task->info->vmas, page);
+    if(region == NULL || (write && !region->writable))
+        return 0;
+    //Faults on present pages can only be resolved if they're shared
+    uint64_t entry = vmem_page_entry(task->state.cr3, (virt_addr_t)page);
+    if((err & 1) && !(write && (entry & VMEM_PTE_SHARED)))
+        return 0;
+    //Get the shared frame
+    phys_addr_t shared = NULL;
+    if(region->frames != NULL){
+        phys_addr_t* slot = &region->frames[(page - region->origin) / 4096];
+        if(*slot == NULL){
+            phys_addr_t frame = pmem_alloc(0);
+            if(frame == NULL)
+                return 0;
+            mtask_fill_page(task, region, frame, page);
+            *slot = frame;
+        }
+        shared = *slot;
+        //Map it if it's only going to be read
+        if(!write){
+            vmem_map_user_shared(task->state.cr3, shared, (phys_addr_t)((uint8_t*)shared + 4096), (virt_addr_t)page);
+            task->info->page_faults++;
+            return 1;
         }
     }
-    //Clear pages
-    memset(krnl_addr, 0, 4096 * num);
-    //Map the actual range
-    vmem_map_user(task->state.cr3, phys_addr, (phys_addr_t)((uint8_t*)phys_addr + (4096 * num)), task->next_alloc);
-    //Advance the next allocation address
-    virt_addr_t mapped_addr = task->next_alloc;
-    task->next_alloc = (virt_addr_t)((uint8_t*)task->next_alloc + (4096 * num));
-    //Return the resulting mapped address
-    return mapped_addr;
+    //Allocate a private frame, copy the shared data into it or fill it
+    phys_addr_t frame = pmem_alloc(0);
+    if(frame == NULL)
+        return 0;
+    if(shared != NULL)
+        memcpy(vmem_phys_to_virt(frame), vmem_phys_to_virt(shared), 4096);
+    else
+        mtask_fill_page(task, region, frame, page);
+    //Map it
+    vmem_map_user(task->state.cr3, frame, (phys_addr_t)((uint8_t*)frame + 4096), (virt_addr_t)page);
+    task->info->page_faults++;
+    return 1;
+}
+
+/*
+ * Handles a page fault in the current task by backing the page with memory
+ *   if it belongs to one of the regions
+ * Pages of shared regions are mapped read-only to the frames all tasks share.
+ *   Writing to one of them gives the task its own copy if the region is writable
+ * Returns 1 if the fault was resolved and the faulting instruction can be restarted
+ */
+uint8_t mtask_handle_pf(virt_addr_t addr, uint64_t err){
+    if(!mtask_enabled)
+        return 0;
+    smp_lock_krnl();
+    uint8_t resolved = mtask_resolve_pf(mtask_get_cur_task(), addr, err);
+    smp_unlock_krnl();
+    return resolved;
 }
 
 /*
@@ -316,16 +1191,11 @@ virt_addr_t mtask_palloc(uint64_t pid, uint64_t num){
  */
 void mtask_pfree(uint64_t pid, virt_addr_t proc_map){
     task_t* task = mtask_get_by_pid(pid);
-    //Find an entry that corresponds to the mapped pages
-    for(int i = 0; i < MTASK_MAX_ALLOCATIONS; i++){
-        if(task->allocations[i].proc_map == proc_map){
-            //Free the pages
-            free(task->allocations[i].krnl_map);
-            //Unmap the pages
-            vmem_unmap(task->state.cr3, task->allocations[i].proc_map,
-                              (uint8_t*)task->allocations[i].proc_map + (4096 * task->allocations[i].num));
-            //Invalidate the entry
-            task->allocations[i].used = 0;
-        }
-    }
+    //Find the region that starts at that address
+    vma_t* vma = vma_find(&task->info->vmas, (uint64_t)proc_map);
+    if(vma == NULL || vma->start != (uint64_t)proc_map)
+        return;
+    //Free and unmap the pages
+    mtask_pfree_range(task, proc_map, (vma->end - vma->start) / 4096);
+    vma_remove(&task->info->vmas, vma);
 }
\ No newline at end of file
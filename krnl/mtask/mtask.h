@@ -4,21 +4,36 @@
 #include "../stdlib.h"
 #include "../drivers/disk/diskio.h"
 #include "../vmem/vmem.h"
+#include "../vmem/vma.h"
+#include "./twheel.h"
+#include "./waitq.h"
+#include "../smp.h"
 
 //Settings
 
-#define MTASK_TASK_COUNT                    128
+//Initial sizes of the task table and the PID hash, both grow as needed
+#define MTASK_TABLE_INIT                    64
+#define MTASK_HASH_INIT                     64
 #define MTASK_MAX_OPEN_FILES                256
-#define MTASK_MAX_ALLOCATIONS               1024
+//The open file table of a task grows by this many entries at a time
+#define MTASK_FILES_STEP                    16
+//Number of priority levels, higher ones always run first
+#define MTASK_PRIO_LEVELS                   32
+//Time in microseconds a task runs for before others of the same priority get their turn
+#define MTASK_QUANTUM                       4000
+//Sleeping tasks are woken up with the precision of 2^MTASK_SLEEP_SHIFT CPU cycles
+#define MTASK_SLEEP_SHIFT                   12
+//Deepest C-state the idle task asks for with MWAIT (1 = C1, the quickest to wake up from)
+#define MTASK_IDLE_CSTATE                   1
+//Stack size of the idle task, interrupts that come while it runs use it too
+#define MTASK_IDLE_STACK                    16384
+//Range of addresses mtask_palloc() hands out
+#define MTASK_PALLOC_BASE                   ((1ULL << 46) | (1ULL << 45))
+#define MTASK_PALLOC_LIMIT                  (1ULL << 47)
 
 //Structure definitions
 
-typedef struct {
-    uint8_t used;
-    virt_addr_t proc_map;
-    virt_addr_t krnl_map;
-    uint64_t num;
-} page_alloc_t;
+struct _elf_image_s;
 
 typedef struct {
     uint64_t rax, rbx, rcx, rdx, rsi, rdi, rbp, rsp;
@@ -26,40 +41,106 @@ typedef struct {
     uint64_t cr3, rip, rflags, switch_cnt;
     uint16_t cs;
     uint8_t exc_vector;
-    uint8_t padding[29];
-    uint8_t xstate[1024];
+    uint8_t padding[5];
+    uint8_t* xstate; //XSAVE area, its size depends on the enabled components
 } __attribute__((packed)) task_state_t;
 
+/*
+ * Task data that isn't needed for scheduling and switching
+ */
 typedef struct {
+    char name[64];
+
+    file_handle_t** open_files; //`files_cap` entries, grown on demand
+    uint32_t files_cap;
+
+    vma_tree_t vmas;
+    void* stack;
+    struct _elf_image_s* image;
+    uint64_t page_faults;
+
+    uint8_t* symtab;
+    uint8_t* strtab;
+} task_info_t;
+
+/*
+ * A task
+ * Only what the scheduler and the context switch use is kept here, the rest is in `info`
+ */
+typedef struct _task_s {
     task_state_t state;
 
     uint8_t valid;
     uint64_t pid;
-    char name[64];
 
     uint8_t priority;
-    uint8_t prio_cnt;
+    uint64_t slice_end; //TSC value the time slice ends at
+    uint32_t cpu;      //processor whose run queue the task belongs to
+    uint32_t last_cpu; //processor it has last run on
+    volatile uint8_t stop_pending;
     volatile uint8_t state_code;
     uint64_t blocked_till;
+    //Links of the ready queue the task is in, or its wakeup timer if it's sleeping
+    struct _task_s* q_next;
+    struct _task_s* q_prev;
+    twheel_entry_t wakeup;
+    uint8_t queued;
+    //Wait queue the task is blocked on, its links in it and the TSC value the wait times out at
+    mtask_wq_t* wq;
+    struct _task_s* wq_next;
+    struct _task_s* wq_prev;
+    uint64_t wait_till;
+    uint8_t wait_restart; //set if the system call the task is in has to be started over
 
     uint64_t privl;
 
-    file_handle_t* open_files[MTASK_MAX_OPEN_FILES];
+    struct _task_s* hash_next; //next task in the PID hash bucket
+    uint32_t table_idx;        //position in the task table
+    task_info_t* info;
+} task_t;
 
-    virt_addr_t next_alloc;
-    page_alloc_t allocations[MTASK_MAX_ALLOCATIONS];
+/*
+ * Run queue of a processor
+ * Everything in it, as well as the queue links of the tasks in it, is protected by its lock
+ */
+typedef struct {
+    spinlock_t lock;
+    task_t* cur;
+    //Ready queues, one per priority level, and the bitmap of the levels that have tasks in them
+    task_t* ready_head[MTASK_PRIO_LEVELS];
+    task_t* ready_tail[MTASK_PRIO_LEVELS];
+    volatile uint32_t ready_map;
+    volatile uint32_t ready_cnt;
+    //Tasks that are blocked for some amount of CPU cycles
+    twheel_t sleeping;
+    //Task that runs when no other one is ready
+    task_t idle;
+} mtask_rq_t;
 
-    uint8_t* symtab;
-    uint8_t* strtab;
-} task_t;
+//XSAVE instruction variants
+
+#define MTASK_XSAVE                         0
+#define MTASK_XSAVEOPT                      1
+#define MTASK_XSAVEC                        2
+
+//Idle task MWAIT hint that makes it use HLT instead
+
+#define MTASK_IDLE_HLT                      0xFFFFFFFF
 
 //Task state codes
 
 #define TASK_STATE_RUNNING                  0
 #define TASK_STATE_BLOCKED_CYCLES           1
+#define TASK_STATE_BLOCKED_WAIT             2
 #define TASK_STATE_WAITING_TO_RUN           3
 #define TASK_STATE_WAITING_FOR_PRIVL_ESC    4
 
+//Queues a task can be in
+
+#define MTASK_QUEUE_NONE                    0
+#define MTASK_QUEUE_READY                   1
+#define MTASK_QUEUE_SLEEPING                2
+
 //Task privileges
 
 #define TASK_PRIVL_EVERYTHING               (0xFFFFFFFFFFFFFFFFULL & ~TASK_PRIVL_INHERIT & ~TASK_PRIVL_SUDO_MODE)
@@ -72,31 +153,47 @@ typedef struct {
 //Function prototypes
 
 //Global control
-void mtask_init (void);
-void mtask_stop (void);
+void     mtask_init      (void);
+void     mtask_start_cpu (void);
+void     mtask_stop      (void);
+uint64_t mtask_get_xfeat (void);
 //Task creating/destruction/getting/setting/etc.
 uint64_t mtask_create_task(uint64_t stack_size, char* name, uint8_t priority, uint8_t identity_map, uint64_t _cr3,
                            void* suggested_stack, uint8_t start, void(*func)(void*), void* args, uint64_t privl, uint8_t* symtab,
                            uint8_t* strtab);
+void     mtask_start_task    (task_t* task);
 void     mtask_stop_task     (uint64_t pid);
 task_t*  mtask_get_by_pid    (uint64_t pid);
 uint64_t mtask_get_pid       (void);
 uint8_t  mtask_exists        (uint64_t pid);
-task_t*  mtask_get_task_list (void);
+uint32_t mtask_task_count    (void);
+task_t*  mtask_get_task      (uint32_t idx);
 task_t*  mtask_get_cur_task  (void);
 void     mtask_escalate      (uint64_t mask);
 //Save/restore/schedule
-void mtask_save_state    (void);
-void mtask_restore_state (void);
-void mtask_schedule      (void);
+void     mtask_save_state    (void);
+void     mtask_restore_state (void);
+void     mtask_schedule      (void);
+uint64_t mtask_next_cr3      (task_t* task);
 //Delays
+void mtask_yield      (void);
+void mtask_dly_until  (uint64_t tsc);
 void mtask_dly_cycles (uint64_t cycles);
 void mtask_dly_us     (uint64_t us);
+//Wait queues
+uint8_t mtask_wait         (mtask_wq_t* wq, uint64_t timeout);
+void    mtask_wake_all     (mtask_wq_t* wq);
+uint8_t mtask_wait_restart (void);
+uint8_t mtask_cur_blocked  (void);
 //Opened files control
-void mtask_add_open_file    (file_handle_t* ptr);
-void mtask_remove_open_file (file_handle_t* ptr);
+void           mtask_add_open_file    (file_handle_t* ptr);
+void           mtask_remove_open_file (file_handle_t* ptr);
+file_handle_t* mtask_get_open_file    (task_t* task, uint64_t idx);
 //Memory allocation control
-virt_addr_t mtask_palloc (uint64_t pid, uint64_t num);
-void        mtask_pfree  (uint64_t pid, virt_addr_t proc_map);
+virt_addr_t mtask_palloc     (uint64_t pid, uint64_t num);
+void        mtask_pfree      (uint64_t pid, virt_addr_t proc_map);
+vma_t*      mtask_add_region (task_t* task, virt_addr_t at, uint64_t num, file_handle_t* file,
+                              uint64_t file_offs, uint64_t file_size);
+uint8_t     mtask_handle_pf  (virt_addr_t addr, uint64_t err);
 
 #endif
\ No newline at end of file
@@ -39,11 +39,38 @@ mtask_save_state:
     mov [rax+ 56], r11
     mov [rax+162], r13b
     ;//Save MM, XMM-ZMM and ST registers
-    xchg rax, rbx
+    ;//  (a task that has just been stopped doesn't have an area anymore)
+    mov r8, rax
+    mov rbx, [rax+168] ;//XSAVE area
+    test rbx, rbx
+    jz save_xstate_done
+    ;//If all of that state is in its initial configuration,
+    ;//  just mark it as such in the XSAVE header
+    cmp byte ptr [rip+mtask_xinuse_supported], 0
+    je save_xstate
+    mov ecx, 1
+    xgetbv
+    or eax, edx
+    jnz save_xstate
+    mov qword ptr [rbx+512], 0 ;//XSTATE_BV
+    jmp save_xstate_done
+save_xstate:
     mov edx, 0xFFFFFFFF
     mov eax, 0xFFFFFFFF
-    xsaveq [rbx+192]
-    xchg rax, rbx
+    ;//Use the instruction that writes the least
+    cmp byte ptr [rip+mtask_xsave_mode], 1
+    je save_xstate_opt
+    cmp byte ptr [rip+mtask_xsave_mode], 2
+    je save_xstate_c
+    xsaveq [rbx]
+    jmp save_xstate_done
+save_xstate_opt:
+    xsaveoptq [rbx]
+    jmp save_xstate_done
+save_xstate_c:
+    xsavec64 [rbx]
+save_xstate_done:
+    mov rax, r8
     ;//Increment the switch counter
     inc qword ptr [rax+152]
     ret
@@ -51,28 +78,61 @@ mtask_save_state:
 mtask_restore_state:
     ;//Load the current task pointer into RAX
     call mtask_get_cur_task
+    ;//Get the CR3 value with the PCID and the no-flush bit set
+    ;//  (the stack is abandoned anyway, so it can be realigned freely)
+    and rsp, -16
+    push rax
+    sub rsp, 40
+    mov rcx, rax
+    call mtask_next_cr3
+    mov rbx, rax
+    add rsp, 40
+    pop rax
     ;//Load RSP
     mov rsp, [rax+ 56]
     ;//Load non-GPRs
-    mov rbx, [rax+128] ;//CR3
     mov cr3, rbx
-    ;//pushq    [rax+160] ;//SS
-    pushq    0x93
-    subq     [rsp], 8
+    ;//Let the other processors know the previous address space isn't used here anymore
+    mov qword ptr gs:[32], rax
+    ;//The data selector comes right before the user code selector
+    ;//  and right after the kernel one
+    movzx rbx, word ptr [rax+160] ;//CS
+    lea rcx, [rbx+8]
+    test bl, 3
+    jz restore_ss_krnl
+    lea rcx, [rbx-8]
+restore_ss_krnl:
+    pushq rcx          ;//SS
     pushq    [rax+ 56] ;//RSP
-    mov rbx, [rax+144] ;//RFLAGS
-    or  rbx, 1<<9      ;//Enable interrupts
-    pushq rbx 
-    ;//pushq    [rax+160] ;//CS
-    pushq    0x93
+    mov rcx, [rax+144] ;//RFLAGS
+    or  rcx, 1<<9      ;//Enable interrupts
+    pushq rcx
+    pushq rbx          ;//CS
     pushq    [rax+136] ;//RIP
     ;//Load MM, XMM-ZMM and ST registers
-    xchg rax, rbx
+    mov r8, rax
+    mov rbx, [rax+168] ;//XSAVE area
+    test rbx, rbx
+    jz restore_xstate_done
+    mov dword ptr [rbx+24], 0x00001F80 ;//mask SIMD interrupts
+    ;//Skip it if both the saved and the current state are in their initial configuration
+    cmp byte ptr [rip+mtask_xinuse_supported], 0
+    je restore_xstate
+    cmp qword ptr [rbx+512], 0 ;//XSTATE_BV
+    jne restore_xstate
+    mov ecx, 1
+    xgetbv
+    or eax, edx
+    jnz restore_xstate
+    ;//XINUSE doesn't cover MXCSR, so it has to be loaded anyway
+    ldmxcsr [rbx+216]
+    jmp restore_xstate_done
+restore_xstate:
     mov edx, 0xFFFFFFFF
     mov eax, 0xFFFFFFFF
-    mov dword ptr [rbx+216], 0x00001F80 ;//mask SIMD interrupts
-    xrstorq [rbx+192]
-    xchg rax, rbx
+    xrstorq [rbx]
+restore_xstate_done:
+    mov rax, r8
     ;//Load GPRs
     mov rbx, [rax+  8]
     mov rcx, [rax+ 16]
@@ -94,5 +154,10 @@ mtask_restore_state:
     mov r15, [rax+120]
     ;//Load RAX
     mov rax, [rax+  0]
+    ;//Switch to the userland GS if we're returning there
+    test byte ptr [rsp+8], 3
+    jz restore_iret
+    swapgs
+restore_iret:
     ;//Return
     iretq
@@ -0,0 +1,155 @@
+//Neutron Project
+//TWheel - Hierarchical timer wheel
+
+#include "./twheel.h"
+#include "../stdlib.h"
+
+//Level 0 has a slot for each of the next 64 ticks. A slot of level N covers
+//  64^N ticks, and when the wheel gets to the start of the range a slot covers,
+//  its timers are moved to the lower levels. Each level keeps a bitmap of its
+//  non-empty slots, so the wheel jumps straight to the next tick a slot has to
+//  be handled at instead of going through empty stretches of time tick by tick.
+//  Adding and removing a timer takes constant time, and the cost of advancing
+//  the wheel depends on the number of timers that expire (plus a few cascades),
+//  not on the number of timers there are.
+
+/*
+ * Initializes a timer wheel
+ */
+void twheel_init(twheel_t* wheel, uint64_t now){
+    memset(wheel, 0, sizeof(twheel_t));
+    wheel->now = now;
+}
+
+/*
+ * Puts a timer into the slot that corresponds to its deadline
+ * Timers that are due before the `earliest` tick are put into its slot
+ */
+static void twheel_link(twheel_t* wheel, twheel_entry_t* entry, uint64_t earliest){
+    uint64_t at = (entry->deadline < earliest) ? earliest : entry->deadline;
+    uint64_t delta = at - wheel->now;
+    //Find the level whose range covers the deadline
+    uint8_t level = 0;
+    while(level < TWHEEL_LEVELS - 1 && delta >= (1ULL << (TWHEEL_SLOT_BITS * (level + 1))))
+        level++;
+    //Timers that are too far away go to the farthest slot and are put back when it's reached
+    if(delta >= (1ULL << (TWHEEL_SLOT_BITS * TWHEEL_LEVELS)))
+        at = wheel->now + ((TWHEEL_SLOTS - 1ULL) << (TWHEEL_SLOT_BITS * level));
+    uint8_t slot = (at >> (TWHEEL_SLOT_BITS * level)) & (TWHEEL_SLOTS - 1);
+    //Link it
+    entry->level = level;
+    entry->slot = slot;
+    entry->prev = NULL;
+    entry->next = wheel->slots[level][slot];
+    if(entry->next != NULL)
+        entry->next->prev = entry;
+    wheel->slots[level][slot] = entry;
+    wheel->occupied[level] |= 1ULL << slot;
+    wheel->count++;
+}
+
+/*
+ * Adds a timer that expires at the `deadline` tick
+ * Timers that are already due expire on the next tick
+ */
+void twheel_add(twheel_t* wheel, twheel_entry_t* entry, uint64_t deadline){
+    entry->deadline = deadline;
+    entry->armed = 1;
+    twheel_link(wheel, entry, wheel->now + 1);
+}
+
+/*
+ * Removes a timer that hasn't expired yet
+ */
+void twheel_remove(twheel_t* wheel, twheel_entry_t* entry){
+    if(!entry->armed)
+        return;
+    if(entry->next != NULL)
+        entry->next->prev = entry->prev;
+    if(entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        wheel->slots[entry->level][entry->slot] = entry->next;
+    if(wheel->slots[entry->level][entry->slot] == NULL)
+        wheel->occupied[entry->level] &= ~(1ULL << entry->slot);
+    wheel->count--;
+    entry->armed = 0;
+}
+
+/*
+ * Takes all timers out of a slot, returns the list of them
+ */
+static twheel_entry_t* twheel_take(twheel_t* wheel, uint8_t level, uint8_t slot){
+    twheel_entry_t* list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+    for(twheel_entry_t* entry = list; entry != NULL; entry = entry->next)
+        wheel->count--;
+    return list;
+}
+
+/*
+ * Returns the next tick the wheel has something to do at: the earliest tick a non-empty slot
+ *   of some level starts at, or 0xFFFFFFFFFFFFFFFF if there are no timers
+ * No timer expires before that tick, but the ones of upper levels may expire later
+ */
+uint64_t twheel_next(twheel_t* wheel){
+    uint64_t next = 0xFFFFFFFFFFFFFFFFULL;
+    for(uint8_t level = 0; level < TWHEEL_LEVELS; level++){
+        uint64_t occupied = wheel->occupied[level];
+        if(occupied == 0)
+            continue;
+        //A slot at or before the current position of its level belongs to the next rotation
+        uint8_t shift = TWHEEL_SLOT_BITS * level;
+        uint64_t block = wheel->now >> shift;
+        uint8_t start = (block + 1) & (TWHEEL_SLOTS - 1);
+        if(start != 0)
+            occupied = (occupied >> start) | (occupied << (TWHEEL_SLOTS - start));
+        uint64_t tick = (block + __builtin_ctzll(occupied) + 1) << shift;
+        if(tick < next)
+            next = tick;
+    }
+    return next;
+}
+
+/*
+ * Advances the wheel to the `now` tick, calling `expire` for each timer that's due
+ * The callback may add timers
+ */
+void twheel_advance(twheel_t* wheel, uint64_t now, void(*expire)(twheel_entry_t*)){
+    while(wheel->now < now){
+        if(wheel->count == 0){
+            wheel->now = now;
+            break;
+        }
+        uint64_t next = twheel_next(wheel);
+        if(next > now){
+            wheel->now = now;
+            break;
+        }
+        wheel->now = next;
+        uint8_t slot = next & (TWHEEL_SLOTS - 1);
+        //Move the timers of the slots we've got to down
+        if(slot == 0){
+            for(uint8_t level = 1; level < TWHEEL_LEVELS; level++){
+                uint8_t idx = (next >> (TWHEEL_SLOT_BITS * level)) & (TWHEEL_SLOTS - 1);
+                twheel_entry_t* entry = twheel_take(wheel, level, idx);
+                while(entry != NULL){
+                    twheel_entry_t* following = entry->next;
+                    twheel_link(wheel, entry, next);
+                    entry = following;
+                }
+                if(idx != 0)
+                    break;
+            }
+        }
+        //Expire the timers of this tick
+        twheel_entry_t* entry = twheel_take(wheel, 0, slot);
+        while(entry != NULL){
+            twheel_entry_t* following = entry->next;
+            entry->armed = 0;
+            expire(entry);
+            entry = following;
+        }
+    }
+}
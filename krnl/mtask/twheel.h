@@ -0,0 +1,47 @@
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#include "../stdlib.h"
+
+//Settings
+
+//Number of levels, slots per level is fixed at 64
+#define TWHEEL_LEVELS                       4
+#define TWHEEL_SLOT_BITS                    6
+#define TWHEEL_SLOTS                        (1 << TWHEEL_SLOT_BITS)
+
+//Structure definitions
+
+/*
+ * A timer, meant to be embedded into the structure it belongs to
+ */
+typedef struct _twheel_entry_s {
+    uint64_t deadline; //in wheel ticks
+    struct _twheel_entry_s* next;
+    struct _twheel_entry_s* prev;
+    uint8_t armed;
+    uint8_t level;
+    uint8_t slot;
+} twheel_entry_t;
+
+/*
+ * A hierarchical timer wheel
+ * Level N slots cover 64^N ticks each, so a timer is moved down a level at most
+ *   TWHEEL_LEVELS - 1 times before it expires
+ */
+typedef struct {
+    uint64_t now;
+    uint64_t count;
+    uint64_t occupied[TWHEEL_LEVELS]; //bitmaps of non-empty slots
+    twheel_entry_t* slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+} twheel_t;
+
+//Function prototypes
+
+void     twheel_init    (twheel_t* wheel, uint64_t now);
+void     twheel_add     (twheel_t* wheel, twheel_entry_t* entry, uint64_t deadline);
+void     twheel_remove  (twheel_t* wheel, twheel_entry_t* entry);
+void     twheel_advance (twheel_t* wheel, uint64_t now, void(*expire)(twheel_entry_t*));
+uint64_t twheel_next    (twheel_t* wheel);
+
+#endif
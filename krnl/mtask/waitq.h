@@ -0,0 +1,18 @@
+#ifndef WAITQ_H
+#define WAITQ_H
+
+//Structure definitions
+
+struct _task_s;
+
+/*
+ * A queue of tasks waiting for an event, meant to be embedded into the structure
+ *   the event belongs to
+ * The tasks are linked through their descriptors, the queue is protected by the big kernel lock
+ */
+typedef struct _mtask_wq_s {
+    struct _task_s* head;
+    struct _task_s* tail;
+} mtask_wq_t;
+
+#endif
@@ -0,0 +1,183 @@
+//Neutron Project
+//Slab - Object caches for fixed-size kernel objects
+
+#include "./slab.h"
+#include "./stdlib.h"
+#include "./krnl.h"
+
+//The list of all initialized caches
+slab_cache_t* slab_caches = NULL;
+
+//Every slab is aligned by its size, so the header of the slab an object
+//  belongs to can be found by simply clearing the lower bits of its address.
+//Objects that are free are linked together through a pointer stored in the object
+//  itself. If the cache has a constructor, the pointer is stored right after the
+//  object data instead, so that free objects keep their constructed state.
+
+/*
+ * Initializes an object cache
+ */
+void slab_init_cache(slab_cache_t* cache, char* name, size_t obj_size, size_t align, void(*ctor)(void*)){
+    //The alignment has to be a power of two that is at least pointer-sized
+    if(align < sizeof(void*))
+        align = sizeof(void*);
+    while(align & (align - 1))
+        align += align & -align;
+    //Calculate the object layout
+    cache->name = name;
+    cache->obj_size = obj_size;
+    cache->ctor = ctor;
+    cache->link_offs = (ctor != NULL) ? obj_size : 0;
+    cache->stride = cache->link_offs + sizeof(void*);
+    if(cache->stride < obj_size)
+        cache->stride = obj_size;
+    cache->stride = (cache->stride + align - 1) & ~(align - 1);
+    //Calculate the slab layout
+    cache->first_offs = (sizeof(slab_t) + align - 1) & ~(align - 1);
+    cache->slab_size = SLAB_MIN_SIZE;
+    while(cache->first_offs + (SLAB_MIN_OBJS * cache->stride) > cache->slab_size)
+        cache->slab_size <<= 1;
+    cache->objs_per_slab = (cache->slab_size - cache->first_offs) / cache->stride;
+    //Clear the lists and statistics
+    cache->partial = cache->full = cache->empty = NULL;
+    cache->empty_cnt = 0;
+    cache->allocs = cache->frees = cache->in_use = 0;
+    cache->slab_cnt = cache->slab_allocs = cache->slab_frees = 0;
+    //Register the cache
+    cache->next = slab_caches;
+    slab_caches = cache;
+}
+
+/*
+ * Removes a slab from the list it's in
+ */
+static void slab_unlink(slab_t** list, slab_t* slab){
+    if(slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if(slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
+
+/*
+ * Adds a slab to the head of a list
+ */
+static void slab_link(slab_t** list, slab_t* slab){
+    slab->prev = NULL;
+    slab->next = *list;
+    if(*list != NULL)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+/*
+ * Allocates a new slab for the cache and puts it onto the empty list
+ */
+static slab_t* slab_grow(slab_cache_t* cache){
+    slab_t* slab = (slab_t*)amalloc(cache->slab_size, cache->slab_size);
+    if(slab == NULL)
+        return NULL;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_list = NULL;
+    //Construct the objects and build the free list back to front,
+    //  so that they're handed out in the address order
+    for(int64_t i = cache->objs_per_slab - 1; i >= 0; i--){
+        uint8_t* obj = (uint8_t*)slab + cache->first_offs + (i * cache->stride);
+        if(cache->ctor != NULL)
+            cache->ctor(obj);
+        *(void**)(obj + cache->link_offs) = slab->free_list;
+        slab->free_list = obj;
+    }
+    slab_link(&cache->empty, slab);
+    cache->empty_cnt++;
+    cache->slab_cnt++;
+    cache->slab_allocs++;
+    return slab;
+}
+
+/*
+ * Allocates an object from the cache
+ */
+void* slab_alloc(slab_cache_t* cache){
+    //Prefer partially used slabs, then empty ones
+    slab_t* slab = cache->partial;
+    if(slab == NULL){
+        slab = cache->empty;
+        if(slab == NULL)
+            slab = slab_grow(cache);
+        if(slab == NULL)
+            return NULL;
+        //Move it to the partial list
+        slab_unlink(&cache->empty, slab);
+        cache->empty_cnt--;
+        slab_link(&cache->partial, slab);
+    }
+    //Take an object off the free list
+    uint8_t* obj = (uint8_t*)slab->free_list;
+    slab->free_list = *(void**)(obj + cache->link_offs);
+    //Move the slab to the full list if it has no more free objects
+    if(++slab->in_use == cache->objs_per_slab){
+        slab_unlink(&cache->partial, slab);
+        slab_link(&cache->full, slab);
+    }
+    cache->allocs++;
+    cache->in_use++;
+    return obj;
+}
+
+/*
+ * Allocates an object from the cache and fills it with zeroes
+ */
+void* slab_zalloc(slab_cache_t* cache){
+    void* obj = slab_alloc(cache);
+    if(obj != NULL)
+        memset(obj, 0, cache->obj_size);
+    return obj;
+}
+
+/*
+ * Returns an object to the cache
+ */
+void slab_free(slab_cache_t* cache, void* obj){
+    if(obj == NULL)
+        return;
+    //Find the slab the object belongs to
+    slab_t* slab = (slab_t*)((uint64_t)obj & ~(cache->slab_size - 1));
+    //Put the object back onto the free list
+    *(void**)((uint8_t*)obj + cache->link_offs) = slab->free_list;
+    slab->free_list = obj;
+    //A full slab becomes partial
+    if(slab->in_use-- == cache->objs_per_slab){
+        slab_unlink(&cache->full, slab);
+        slab_link(&cache->partial, slab);
+    }
+    cache->frees++;
+    cache->in_use--;
+    //A partial slab may become empty
+    if(slab->in_use == 0){
+        slab_unlink(&cache->partial, slab);
+        //Release it to the heap if we have enough empty slabs already
+        if(cache->empty_cnt >= SLAB_MAX_EMPTY){
+            free(slab);
+            cache->slab_cnt--;
+            cache->slab_frees++;
+        } else {
+            slab_link(&cache->empty, slab);
+            cache->empty_cnt++;
+        }
+    }
+}
+
+/*
+ * Writes the statistics of all caches to the kernel message buffer
+ */
+void slab_dump(void){
+    krnl_write_msg(__FILE__, __LINE__, "slab caches:");
+    for(slab_cache_t* cache = slab_caches; cache != NULL; cache = cache->next){
+        krnl_write_msgf(__FILE__, __LINE__, "%s: obj %i B, %i in use, %i slabs (%i KiB each), %i allocs, %i frees",
+            cache->name, cache->obj_size, cache->in_use, cache->slab_cnt, cache->slab_size / 1024,
+            cache->allocs, cache->frees);
+    }
+}
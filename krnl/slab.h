@@ -0,0 +1,67 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "./stdlib.h"
+
+//Settings
+
+//Smallest slab size (has to be a power of two)
+#define SLAB_MIN_SIZE                       16384
+//Minimal number of objects a slab should hold
+#define SLAB_MIN_OBJS                       8
+//Maximal number of completely free slabs a cache keeps around
+#define SLAB_MAX_EMPTY                      1
+
+//Structure definitions
+
+struct _slab_cache_s;
+
+/*
+ * Slab header, located at the start of each slab
+ */
+typedef struct _slab_s {
+    struct _slab_cache_s* cache;
+    struct _slab_s*       prev;
+    struct _slab_s*       next;
+    void*                 free_list;
+    uint64_t              in_use;
+} slab_t;
+
+/*
+ * Object cache
+ */
+typedef struct _slab_cache_s {
+    char*    name;
+    size_t   obj_size;
+    size_t   stride;
+    size_t   link_offs;
+    size_t   first_offs;
+    size_t   slab_size;
+    uint64_t objs_per_slab;
+    void   (*ctor)(void*);
+
+    slab_t*  partial;
+    slab_t*  full;
+    slab_t*  empty;
+    uint64_t empty_cnt;
+
+    //Statistics
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t in_use;
+    uint64_t slab_cnt;
+    uint64_t slab_allocs;
+    uint64_t slab_frees;
+
+    struct _slab_cache_s* next;
+} slab_cache_t;
+
+//Function prototypes
+
+void  slab_init_cache (slab_cache_t* cache, char* name, size_t obj_size, size_t align, void(*ctor)(void*));
+void* slab_alloc      (slab_cache_t* cache);
+void* slab_zalloc     (slab_cache_t* cache);
+void  slab_free       (slab_cache_t* cache, void* obj);
+void  slab_dump       (void);
+
+#endif
@@ -0,0 +1,265 @@
+//Neutron Project
+//SMP - Multiprocessor support
+
+#include "./smp.h"
+#include "./stdlib.h"
+#include "./krnl.h"
+#include "./drivers/apic.h"
+#include "./drivers/timr.h"
+#include "./vmem/vmem.h"
+#include "./mtask/mtask.h"
+#include "./app_drv/syscall/syscall.h"
+
+//Application processors (APs) start in real mode at a page below 1 MiB. The code
+//  in smp_tramp.s is copied there, switches straight to long mode using the
+//  registers of the bootstrap processor (BSP) and calls smp_ap_main() in the upper
+//  half. APs are started one at a time, so nothing the bring-up shares needs locking.
+//Every processor has its own GDT, TSS, LAPIC timer and run queue. While it runs
+//  kernel code, GS points to its cpu_t, userland GS is kept in KERNEL_GS_BASE.
+//The rest of the kernel state is protected by one big lock. It's taken on system
+//  calls, on exceptions and on device interrupts. The scheduler doesn't take it,
+//  run queues have locks of their own.
+
+//AP startup code and its parameter block
+extern uint8_t smp_tramp_start, smp_tramp_long, smp_tramp_params, smp_tramp_end;
+
+cpu_t* smp_cpus = NULL;
+//Number of processor slots used, the ones that haven't come up aren't reused
+//  as they might still start later
+uint32_t smp_cpu_cnt = 1;
+//Values the APs take from the BSP
+uint64_t smp_krnl_cr3;
+uint64_t smp_cr4;
+uint64_t smp_msrs[4];
+const uint32_t smp_msr_nums[4] = {MSR_IA32_LSTAR, MSR_IA32_STAR, MSR_IA32_SFMASK, MSR_IA32_PAT};
+idt_desc_t smp_idt;
+//Big kernel lock
+spinlock_t smp_krnl_lock = 0;
+volatile uint32_t smp_krnl_owner = SMP_NO_CPU;
+uint32_t smp_krnl_depth = 0;
+
+/*
+ * Returns the index of the current processor
+ */
+uint32_t smp_cpu_id(void){
+    uint32_t id;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r" (id) : "i" (__builtin_offsetof(cpu_t, id)));
+    return id;
+}
+
+/*
+ * Returns the number of processor slots, the processors that are up have `online` set
+ */
+uint32_t smp_cpu_count(void){
+    return smp_cpu_cnt;
+}
+
+/*
+ * Returns the data of the current processor
+ */
+cpu_t* smp_cur_cpu(void){
+    return &smp_cpus[smp_cpu_id()];
+}
+
+/*
+ * Returns the data of a processor by its index
+ */
+cpu_t* smp_get_cpu(uint32_t id){
+    return &smp_cpus[id];
+}
+
+/*
+ * Points GS at the data of a processor
+ */
+static void smp_set_gs(cpu_t* cpu){
+    wrmsr(MSR_IA32_GS_BASE, (uint64_t)cpu);
+    wrmsr(MSR_IA32_KERNEL_GS_BASE, 0);
+}
+
+/*
+ * Sets up the data of the bootstrap processor
+ * Has to be called before anything that needs to know the current processor
+ */
+void smp_init_bsp(void){
+    smp_cpus = (cpu_t*)calloc(SMP_MAX_CPUS, sizeof(cpu_t));
+    smp_cpus[0].id = 0;
+    smp_cpus[0].lapic_id = 0;
+    smp_cpus[0].online = 1;
+    smp_set_gs(&smp_cpus[0]);
+}
+
+/*
+ * Takes the big kernel lock
+ * It's recursive: a processor that already holds it just goes one level deeper
+ */
+void smp_lock_krnl(void){
+    uint32_t id = smp_cpu_id();
+    if(smp_krnl_owner == id){
+        smp_krnl_depth++;
+        return;
+    }
+    spinlock_acquire(&smp_krnl_lock);
+    smp_krnl_owner = id;
+    smp_krnl_depth = 1;
+}
+
+/*
+ * Releases one level of the big kernel lock
+ */
+void smp_unlock_krnl(void){
+    if(--smp_krnl_depth > 0)
+        return;
+    smp_krnl_owner = SMP_NO_CPU;
+    spinlock_release(&smp_krnl_lock);
+}
+
+/*
+ * Releases the big kernel lock completely if the current processor holds it
+ * Returns the depth it has been held at
+ */
+uint32_t smp_drop_krnl(void){
+    if(smp_krnl_owner != smp_cpu_id())
+        return 0;
+    uint32_t depth = smp_krnl_depth;
+    smp_krnl_depth = 0;
+    smp_krnl_owner = SMP_NO_CPU;
+    spinlock_release(&smp_krnl_lock);
+    return depth;
+}
+
+/*
+ * Takes the big kernel lock again at the depth smp_drop_krnl() returned
+ */
+void smp_retake_krnl(uint32_t depth){
+    if(depth == 0)
+        return;
+    smp_lock_krnl();
+    smp_krnl_depth = depth;
+}
+
+/*
+ * Busy-waits for some amount of microseconds
+ */
+static void smp_wait_us(uint64_t us){
+    uint64_t end = rdtsc() + (timr_get_cpu_fq() / 1000000 * us);
+    while(rdtsc() < end)
+        __asm__ volatile("pause");
+}
+
+/*
+ * Entry point of an AP, called by the startup code
+ * The startup code has already loaded the code and data selectors
+ */
+static void smp_ap_main(cpu_t* cpu){
+    //Switch to the kernel address space, PCIDs can only be enabled now
+    __asm__ volatile("mov %0, %%cr3" : : "r" (smp_krnl_cr3));
+    __asm__ volatile("mov %0, %%cr4" : : "r" (smp_cr4));
+    smp_set_gs(cpu);
+    //Load our own GDT and TSS, and the shared IDT
+    gdt_desc_t gdt_d = {.limit = KRNL_TSS_SEL + 15, .base = cpu->gdt};
+    __asm__ volatile("lgdt %0" : : "m" (gdt_d));
+    __asm__ volatile("ltr %0" : : "r" ((uint16_t)KRNL_TSS_SEL));
+    __asm__ volatile("lidt %0" : : "m" (smp_idt));
+    //Copy the system call, PAT and extended state configuration
+    for(int i = 0; i < 4; i++)
+        wrmsr(smp_msr_nums[i], smp_msrs[i]);
+    uint64_t xcr0 = mtask_get_xfeat();
+    __asm__ volatile("xsetbv" : : "c" (0), "a" ((uint32_t)xcr0), "d" ((uint32_t)(xcr0 >> 32)));
+    vmem_write_protect(1);
+    //Initialize the local devices
+    lapic_init();
+    timr_init_cpu();
+    syscall_init();
+    //Report that we're up and start running tasks
+    cpu->online = 1;
+    mtask_start_cpu();
+}
+
+/*
+ * Starts an AP, returns 1 if it has come online
+ */
+static uint8_t smp_start_ap(cpu_t* cpu, uint8_t* low){
+    //Fill the parameters the startup code reads
+    smp_tramp_params_t* params = (smp_tramp_params_t*)(low + (&smp_tramp_params - &smp_tramp_start));
+    cpu->stack = malloc(SMP_AP_STACK);
+    params->stack = (uint64_t)cpu->stack + SMP_AP_STACK;
+    params->entry = (uint64_t)&smp_ap_main;
+    params->cpu = (uint64_t)cpu;
+    //Give it its own GDT, the descriptors are the same but the TSS is different
+    cpu->tss = (tss_t*)calloc(1, sizeof(tss_t));
+    cpu->tss->rsp0 = (uint64_t)malloc(16384) + 16384;
+    cpu->gdt = (uint64_t*)malloc(KRNL_TSS_SEL + 16);
+    gdt_desc_t gdt_d;
+    __asm__ volatile("sgdt %0" : : "m" (gdt_d));
+    memcpy(cpu->gdt, gdt_d.base, KRNL_TSS_SEL);
+    krnl_gdt_set_tss(cpu->gdt, cpu->tss);
+    //Send INIT, then STARTUP twice as the MP specification says
+    lapic_send_ipi(cpu->lapic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    smp_wait_us(10000);
+    for(int i = 0; i < 2 && !cpu->online; i++){
+        lapic_send_ipi(cpu->lapic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | ((uint64_t)low >> 12));
+        smp_wait_us(200);
+    }
+    //Wait for it to report
+    uint64_t end = rdtsc() + (timr_get_cpu_fq() / 1000 * SMP_AP_TIMEOUT);
+    while(!cpu->online && rdtsc() < end)
+        __asm__ volatile("pause");
+    return cpu->online;
+}
+
+/*
+ * Brings up all processors listed in the MADT
+ * Has to be called after the kernel has been moved to the upper half
+ */
+void smp_init(void){
+    uint8_t* low = (uint8_t*)dram_low_pages();
+    if(low == NULL || apic_cpu_count() < 2){
+        krnl_write_msgf(__FILE__, __LINE__, "running on one processor");
+        return;
+    }
+    //Remember what the APs have to copy
+    smp_krnl_cr3 = vmem_get_cr3() & VMEM_PTE_ADDR;
+    __asm__ volatile("mov %%cr4, %0" : "=r" (smp_cr4));
+    for(int i = 0; i < 4; i++)
+        smp_msrs[i] = rdmsr(smp_msr_nums[i]);
+    __asm__ volatile("sidt %0" : : "m" (smp_idt));
+    //Copy the startup code and the start of the GDT (the kernel selectors are there)
+    //  to the low pages, along with the page map, whose address has to fit into 32 bits
+    gdt_desc_t gdt_d;
+    __asm__ volatile("sgdt %0" : : "m" (gdt_d));
+    memcpy(low, &smp_tramp_start, &smp_tramp_end - &smp_tramp_start);
+    memcpy(low + 0x800, gdt_d.base, KRNL_TSS_SEL);
+    memcpy(low + 0x1000, vmem_phys_to_virt((phys_addr_t)smp_krnl_cr3), 4096);
+    //Fill the parameters every AP shares
+    uint16_t cs;
+    __asm__ volatile("movw %%cs, %0" : "=r" (cs));
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r" (cr0));
+    smp_tramp_params_t* params = (smp_tramp_params_t*)(low + (&smp_tramp_params - &smp_tramp_start));
+    params->gdt_limit = KRNL_TSS_SEL - 1;
+    params->gdt_base = (uint32_t)(uint64_t)low + 0x800;
+    params->long_entry = (uint32_t)(uint64_t)low + (uint32_t)(&smp_tramp_long - &smp_tramp_start);
+    params->code_sel = cs;
+    params->data_sel = cs + 8;
+    params->cr0 = (uint32_t)cr0;
+    params->cr3 = (uint32_t)(uint64_t)low + 0x1000;
+    params->cr4 = (uint32_t)smp_cr4 & ~(1 << 17); //no PCIDs until CR3 is 64-bit
+    params->efer = (uint32_t)rdmsr(MSR_IA32_EFER) & ~(1 << 10); //LMA is set by the CPU
+    //Start the APs
+    uint32_t bsp_lapic = lapic_get_id() >> 24;
+    smp_cpus[0].lapic_id = bsp_lapic;
+    uint32_t online = 1;
+    for(uint32_t i = 0; i < apic_cpu_count() && smp_cpu_cnt < SMP_MAX_CPUS; i++){
+        uint8_t lapic_id = apic_cpu_lapic_id(i);
+        if(lapic_id == bsp_lapic)
+            continue;
+        cpu_t* cpu = &smp_cpus[smp_cpu_cnt];
+        cpu->id = smp_cpu_cnt++;
+        cpu->lapic_id = lapic_id;
+        if(smp_start_ap(cpu, low))
+            online++;
+        else
+            krnl_write_msgf(__FILE__, __LINE__, "processor with LAPIC %i didn't come up", lapic_id);
+    }
+    krnl_write_msgf(__FILE__, __LINE__, "running on %i processors", online);
+}
@@ -0,0 +1,73 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "./stdlib.h"
+
+//Settings
+
+//Maximal number of processors the kernel runs on, the rest are left halted
+#define SMP_MAX_CPUS                        32
+//Stack size of the code that brings a processor up, it's used for interrupts
+//  that come while its idle task runs too
+#define SMP_AP_STACK                        16384
+//Time in milliseconds a processor is given to report that it's up
+#define SMP_AP_TIMEOUT                      100
+
+//Value of the big kernel lock owner field when nobody holds it
+#define SMP_NO_CPU                          0xFFFFFFFF
+
+//Structure definitions
+
+/*
+ * Per-processor data, GS points to it while the processor is in the kernel
+ * The first fields are accessed by assembly code at fixed offsets
+ */
+typedef struct {
+    uint64_t syscall_rsp; //+0: stack system calls are handled on
+    uint64_t user_rsp;    //+8: scratch space for the system call entry
+    uint32_t id;          //+16: index in smp_cpus
+    uint32_t lapic_id;    //+20
+    uint8_t* pf_xstate;   //+24: scratch XSAVE area of the page fault handler
+    void* volatile loaded; //+32: task whose address space is loaded, set after the switch
+    volatile uint8_t online;
+    tss_t* tss;
+    uint64_t* gdt;
+    void* stack;
+} cpu_t;
+
+/*
+ * Parameters the AP startup code reads, the layout is shared with smp_tramp.s
+ */
+typedef struct {
+    uint16_t gdt_limit;
+    uint32_t gdt_base;
+    uint32_t long_entry;
+    uint16_t code_sel;
+    uint16_t data_sel;
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t efer;
+    uint16_t padding;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t cpu;
+} __attribute__((packed)) smp_tramp_params_t;
+
+//Function prototypes
+
+//Bring-up
+void     smp_init_bsp  (void);
+void     smp_init      (void);
+//Processor information
+uint32_t smp_cpu_id    (void);
+uint32_t smp_cpu_count (void);
+cpu_t*   smp_cur_cpu   (void);
+cpu_t*   smp_get_cpu   (uint32_t id);
+//Big kernel lock
+void     smp_lock_krnl   (void);
+void     smp_unlock_krnl (void);
+uint32_t smp_drop_krnl   (void);
+void     smp_retake_krnl (uint32_t depth);
+
+#endif
@@ -0,0 +1,61 @@
+.intel_syntax noprefix
+.globl   smp_tramp_start, smp_tramp_long, smp_tramp_params, smp_tramp_end
+
+;//This code is copied to a page below 1 MiB and run by application processors
+;//  after they receive STARTUP. It must not refer to anything outside of itself
+;//The parameter block layout is described by smp_tramp_params_t in smp.h
+.align   16
+
+.code16
+smp_tramp_start:
+    cli
+    cld
+    ;//The page we're in is CS:0
+    mov ax, cs
+    mov ds, ax
+    ;//Load the GDT copy that has the kernel descriptors
+    lgdt [smp_tramp_params - smp_tramp_start]
+    ;//Enable PAE and whatever else the BSP has in CR4
+    mov eax, dword ptr [smp_tramp_params - smp_tramp_start + 22]
+    mov cr4, eax
+    ;//Load the page map copy that lies below 4 GiB
+    mov eax, dword ptr [smp_tramp_params - smp_tramp_start + 18]
+    mov cr3, eax
+    ;//Enable long mode
+    mov ecx, 0xC0000080
+    mov eax, dword ptr [smp_tramp_params - smp_tramp_start + 26]
+    xor edx, edx
+    wrmsr
+    ;//Enable protection and paging at once, which activates long mode
+    mov eax, dword ptr [smp_tramp_params - smp_tramp_start + 14]
+    mov cr0, eax
+    ;//Jump to the 64-bit code segment
+    jmp fword ptr [smp_tramp_params - smp_tramp_start + 6]
+
+.code64
+smp_tramp_long:
+    lea rbx, [rip+smp_tramp_params]
+    ;//Load the data selectors
+    mov ax, word ptr [rbx+12]
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor eax, eax
+    mov fs, ax
+    mov gs, ax
+    ;//Call the C entry point with the processor data pointer
+    mov rsp, [rbx+32]
+    mov rcx, [rbx+48]
+    mov rax, [rbx+40]
+    sub rsp, 32
+    call rax
+    ;//It never returns
+smp_tramp_halt:
+    cli
+    hlt
+    jmp smp_tramp_halt
+
+.align   8
+smp_tramp_params:
+    .space 56
+smp_tramp_end:
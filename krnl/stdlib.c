@@ -8,17 +8,26 @@
 #include "./drivers/gfx.h"
 #include "./mtask/mtask.h"
 #include "./vmem/vmem.h"
+#include "./vmem/pmem.h"
 #include "./krnl.h"
+#include "./cpuid.h"
 
-alloc_block_t* first_alloc_block = NULL;
-alloc_block_t* last_alloc_block  = NULL;
+//TLSF control structure: free lists and their bitmaps
+uint64_t      heap_fl_bitmap;
+uint32_t      heap_sl_bitmap[HEAP_FL_COUNT];
+heap_block_t* heap_free_lists[HEAP_FL_COUNT][HEAP_SL_COUNT];
 
 uint64_t bad_ram_bytes = 0;
 uint64_t total_ram_bytes = 0;
-uint64_t used_ram_bytes = 0;
+uint64_t free_ram_bytes = 0;
 
 uint32_t region_count;
 memory_region_t ram_regions[128];
+//Initial heap pool, carved out of the largest region
+phys_addr_t heap_arena_phys;
+uint64_t heap_arena_size;
+//Pages below 1 MiB that are kept out of the allocators
+phys_addr_t dram_low_phys = NULL;
 
 /*
  * Returns the amount of usable RAM
@@ -31,7 +40,14 @@ uint64_t stdlib_usable_ram(void){
  * Returns the amount of RAM currently being used by Neutron
  */
 uint64_t stdlib_used_ram(void){
-    return used_ram_bytes;
+    return total_ram_bytes - pmem_free_bytes() - free_ram_bytes;
+}
+
+/*
+ * Returns the amount of free heap memory
+ */
+uint64_t stdlib_free_ram(void){
+    return free_ram_bytes;
 }
 
 /*
@@ -89,92 +105,287 @@ uint64_t dram_init(void){
         if(desc->Type == EfiConventionalMemory && region_sz > 0){
             krnl_writec_f("Found 0x%x bytes of RAM at physical 0x%x\r\n", region_sz, desc->PhysicalStart);
             total_ram_bytes += region_sz;
+            uint64_t start = desc->PhysicalStart;
+            uint64_t avail = region_sz;
+            //Keep the first pages of conventional memory below 1 MiB (except for page 0)
+            //  for the code application processors start with
+            uint64_t low_size = DRAM_LOW_PAGES * EFI_PAGE_SIZE;
+            uint64_t low_start = (start < EFI_PAGE_SIZE) ? EFI_PAGE_SIZE : start;
+            if(dram_low_phys == NULL && low_start + low_size <= 0x100000 && start + avail >= low_start + low_size){
+                dram_low_phys = (phys_addr_t)low_start;
+                avail -= low_start + low_size - start;
+                start = low_start + low_size;
+            }
             //Add the region to the list of regions
-            ram_regions[region_count].phys_start      = (phys_addr_t)desc->PhysicalStart;
-            ram_regions[region_count].virt_start      = (virt_addr_t)desc->PhysicalStart;
-            ram_regions[region_count].virt_start_orig = (virt_addr_t)desc->PhysicalStart;
-            ram_regions[region_count].size            = region_sz;
-            region_count++;
-            //Add the region to the list of allocation blocks
-            alloc_block_t* fb_ptr = (alloc_block_t*)desc->PhysicalStart;
-            fb_ptr->size      = region_sz;
-            fb_ptr->prev      = last_alloc_block;
-            fb_ptr->next      = NULL;
-            fb_ptr->used      = 0;
-            fb_ptr->region    = region_count - 1;
-            if(first_alloc_block != NULL)
-                last_alloc_block->next = fb_ptr;
-            else
-                first_alloc_block = fb_ptr;
-            last_alloc_block = fb_ptr;
+            if(avail > 0){
+                ram_regions[region_count].phys_start      = (phys_addr_t)start;
+                ram_regions[region_count].virt_start      = (virt_addr_t)start;
+                ram_regions[region_count].virt_start_orig = (virt_addr_t)start;
+                ram_regions[region_count].size            = avail;
+                region_count++;
+            }
         }
         //Record bad RAM
         else if(desc->Type == EfiUnusableMemory)
             bad_ram_bytes += region_sz;
 
+        //Everything that is RAM (as opposed to MMIO) goes into the direct map
+        switch(desc->Type){
+            case EfiLoaderCode:
+            case EfiLoaderData:
+            case EfiBootServicesCode:
+            case EfiBootServicesData:
+            case EfiRuntimeServicesCode:
+            case EfiRuntimeServicesData:
+            case EfiConventionalMemory:
+            case EfiACPIReclaimMemory:
+            case EfiACPIMemoryNVS:
+                vmem_dmap_add((phys_addr_t)desc->PhysicalStart, region_sz);
+                break;
+            default:
+                break;
+        }
+
         desc = (EFI_MEMORY_DESCRIPTOR*)((uint64_t)desc + desc_size);
         i++;
     }
 
-    if(first_alloc_block == NULL){
+    if(region_count == 0){
         krnl_writec_f("No usable memory was found");
         while(1);
     } else {
         krnl_writec_f("%d KiB of RAM found\r\n", total_ram_bytes / 1024);
     }
 
+    //Reserve the initial heap pool at the start of the largest region
+    uint32_t largest = 0;
+    for(uint32_t r = 1; r < region_count; r++)
+        if(ram_regions[r].size > ram_regions[largest].size)
+            largest = r;
+    heap_arena_size = (ram_regions[largest].size / 2) & ~4095ULL;
+    if(heap_arena_size > HEAP_INITIAL_MAX)
+        heap_arena_size = HEAP_INITIAL_MAX;
+    heap_arena_phys = ram_regions[largest].phys_start;
+    krnl_writec_f("Reserved 0x%x bytes at physical 0x%x for the heap\r\n", heap_arena_size, heap_arena_phys);
+    //Give everything else to the frame allocator
+    for(uint32_t r = 0; r < region_count; r++){
+        if(r == largest)
+            pmem_add_range((uint8_t*)heap_arena_phys + heap_arena_size, ram_regions[r].size - heap_arena_size);
+        else
+            pmem_add_range(ram_regions[r].phys_start, ram_regions[r].size);
+    }
+    krnl_writec_f("%d KiB of RAM is managed by the frame allocator\r\n", pmem_free_bytes() / 1024);
+
     return map_key;
 }
 
 /*
- * Maps all dynamic memory regions for the specified memory space
+ * Returns the physical address of the DRAM_LOW_PAGES pages below 1 MiB
+ *   that aren't used by anything else, or NULL if there were none
  */
-void dram_map(uint64_t cr3){
-    for(int i = 0; i < region_count; i++){
-        vmem_map(cr3, ram_regions[i].phys_start,
-                      (uint8_t*)ram_regions[i].phys_start + ram_regions[i].size,
-                      ram_regions[i].virt_start);
-    }
+void* dram_low_pages(void){
+    return dram_low_phys;
 }
 
 /*
- * Shifts the dynamic memory region in the current address space to the higher quarter
+ * Moves the dynamic memory regions to the direct physical map in the higher quarter
  */
 void dram_shift(void){
+    //Map all physical RAM
+    krnl_writec_f("Building the direct physical map\r\n");
+    vmem_dmap_build(vmem_get_cr3());
     //Shift the ranges
-    krnl_writec_f("Shifting the dynamic RAM ranges\r\n");
-    uint64_t next_region = 0xFFFFC00000000000ULL;
-    for(int i = 0; i < region_count; i++){
-        ram_regions[i].virt_start = (virt_addr_t)next_region;
-        next_region += ram_regions[i].size;
-    }
-    //Map the ranges
-    krnl_writec_f("Mapping the dynamic RAM ranges\r\n");
-    dram_map(vmem_get_cr3());
+    for(int i = 0; i < region_count; i++)
+        ram_regions[i].virt_start = vmem_phys_to_virt(ram_regions[i].phys_start);
     //Enable address translation
     krnl_writec_f("Enabling software address translation\r\n");
     vmem_enable_trans();
-    //Shift the allocation blocks
-    krnl_writec_f("Shifting the allocation blocks\r\n");
-    alloc_block_t* ab = first_alloc_block;
-    while(1){
-        if(ab->next == NULL)
-            break;
-        if(ab->next->used > 2)
-            break;
-        alloc_block_t* prev_next = ab->next;
-        if(ab->next != NULL)
-            ab->next = UPPER_AB(ab->next);
-        if(ab->prev != NULL)
-            ab->prev = UPPER_AB(ab->prev);
-        ab = prev_next;
-    }
-    ab->next = NULL;
-    first_alloc_block = UPPER_AB(first_alloc_block);
-    last_alloc_block  = UPPER_AB(ab);
+    //Initialize the heap in the upper half
+    krnl_writec_f("Initializing the heap\r\n");
+    heap_add_pool(vmem_phys_to_virt(heap_arena_phys), heap_arena_size);
     krnl_writec_f("Done shifting\r\n");
 }
 
+//The heap is a TLSF (two-level segregated fit) allocator.
+//Free blocks are kept in lists segregated by size: the first level splits the sizes
+//  into power-of-two classes, the second level splits each class linearly into
+//  HEAP_SL_COUNT subclasses. A bit is set in the bitmaps for each non-empty list,
+//  so a suitable free block is found with a couple of bit scans.
+//Every block knows its size and the block physically preceding it,
+//  so neighbouring free blocks are merged immediately when a block is freed.
+//Each pool is terminated by a zero-sized used sentinel block.
+
+/*
+ * Returns the block physically following the one specified
+ */
+static inline heap_block_t* heap_next_phys(heap_block_t* block){
+    return (heap_block_t*)((uint8_t*)block + sizeof(heap_block_t) + (block->size & ~HEAP_BLOCK_FREE));
+}
+
+/*
+ * Returns the free list links of a block
+ */
+static inline heap_links_t* heap_links(heap_block_t* block){
+    return (heap_links_t*)((uint8_t*)block + sizeof(heap_block_t));
+}
+
+/*
+ * Calculates the free list indices for a block size
+ */
+static inline void heap_mapping(size_t size, uint32_t* fl, uint32_t* sl){
+    if(size < HEAP_SMALL_BLOCK){
+        *fl = 0;
+        *sl = size / (HEAP_SMALL_BLOCK / HEAP_SL_COUNT);
+    } else {
+        uint32_t msb = 63 - __builtin_clzll(size);
+        *sl = (size >> (msb - HEAP_SL_LOG2)) ^ (1 << HEAP_SL_LOG2);
+        *fl = msb - (HEAP_FL_SHIFT - 1);
+    }
+}
+
+/*
+ * Adds a free block to its free list
+ */
+static void heap_insert(heap_block_t* block){
+    uint32_t fl, sl;
+    heap_mapping(block->size & ~HEAP_BLOCK_FREE, &fl, &sl);
+    heap_links_t* links = heap_links(block);
+    links->prev = NULL;
+    links->next = heap_free_lists[fl][sl];
+    if(links->next != NULL)
+        heap_links(links->next)->prev = block;
+    heap_free_lists[fl][sl] = block;
+    heap_fl_bitmap |= 1ULL << fl;
+    heap_sl_bitmap[fl] |= 1U << sl;
+}
+
+/*
+ * Removes a free block from its free list
+ */
+static void heap_remove(heap_block_t* block){
+    uint32_t fl, sl;
+    heap_mapping(block->size & ~HEAP_BLOCK_FREE, &fl, &sl);
+    heap_links_t* links = heap_links(block);
+    if(links->next != NULL)
+        heap_links(links->next)->prev = links->prev;
+    if(links->prev != NULL)
+        heap_links(links->prev)->next = links->next;
+    else
+        heap_free_lists[fl][sl] = links->next;
+    //Clear the bitmap bits if the list became empty
+    if(heap_free_lists[fl][sl] == NULL){
+        heap_sl_bitmap[fl] &= ~(1U << sl);
+        if(heap_sl_bitmap[fl] == 0)
+            heap_fl_bitmap &= ~(1ULL << fl);
+    }
+}
+
+/*
+ * Finds a free block of at least the specified size and removes it from its list
+ */
+static heap_block_t* heap_locate(size_t size){
+    uint32_t fl, sl;
+    //Round the size up to the next list boundary, so that any block in the list fits
+    if(size >= HEAP_SMALL_BLOCK)
+        size += (1ULL << (63 - __builtin_clzll(size) - HEAP_SL_LOG2)) - 1;
+    heap_mapping(size, &fl, &sl);
+    if(fl >= HEAP_FL_COUNT)
+        return NULL;
+    //Search the second level list of this class first, then go to larger classes
+    uint32_t sl_map = heap_sl_bitmap[fl] & (~0U << sl);
+    if(sl_map == 0){
+        uint64_t fl_map = (fl + 1 >= HEAP_FL_COUNT) ? 0 : (heap_fl_bitmap & (~0ULL << (fl + 1)));
+        if(fl_map == 0)
+            return NULL;
+        fl = __builtin_ctzll(fl_map);
+        sl_map = heap_sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    heap_block_t* block = heap_free_lists[fl][sl];
+    heap_remove(block);
+    return block;
+}
+
+/*
+ * Splits the tail of a block off into a new free block if it's large enough
+ */
+static void heap_trim(heap_block_t* block, size_t size){
+    size_t block_size = block->size & ~HEAP_BLOCK_FREE;
+    if(block_size < size + sizeof(heap_block_t) + sizeof(heap_links_t))
+        return;
+    heap_block_t* rem = (heap_block_t*)((uint8_t*)block + sizeof(heap_block_t) + size);
+    rem->prev_phys = block;
+    rem->size = (block_size - size - sizeof(heap_block_t)) | HEAP_BLOCK_FREE;
+    heap_next_phys(rem)->prev_phys = rem;
+    block->size = size | (block->size & HEAP_BLOCK_FREE);
+    heap_insert(rem);
+}
+
+/*
+ * Adds a memory range to the heap
+ */
+void heap_add_pool(void* start, size_t size){
+    //Align the range (and don't let a block start at the null address)
+    uint64_t st = ((uint64_t)start + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    if(st == 0)
+        st = HEAP_ALIGN;
+    uint64_t end = ((uint64_t)start + size) & ~(HEAP_ALIGN - 1);
+    if(end <= st || end - st < 3 * sizeof(heap_block_t) + sizeof(heap_links_t))
+        return;
+    //Create one big free block and the sentinel
+    heap_block_t* block = (heap_block_t*)st;
+    block->prev_phys = NULL;
+    block->size = (end - st - (2 * sizeof(heap_block_t))) | HEAP_BLOCK_FREE;
+    heap_block_t* sentinel = heap_next_phys(block);
+    sentinel->prev_phys = block;
+    sentinel->size = 0;
+    heap_insert(block);
+    free_ram_bytes += (block->size & ~HEAP_BLOCK_FREE) + sizeof(heap_block_t);
+}
+
+/*
+ * Grows the heap by a block from the frame allocator large enough to hold the specified amount of bytes
+ */
+static uint8_t heap_grow(size_t size){
+    uint64_t frames = (size + (4 * sizeof(heap_block_t)) + 4095) / 4096;
+    uint8_t order = pmem_order(frames);
+    if((1ULL << order) < frames)
+        order++;
+    if(order > PMEM_MAX_ORDER)
+        return 0;
+    phys_addr_t block = pmem_alloc(order);
+    if(block == NULL)
+        return 0;
+    heap_add_pool(vmem_phys_to_virt(block), 4096ULL << order);
+    return 1;
+}
+
+/*
+ * Returns the size of the largest free heap block
+ */
+uint64_t stdlib_largest_free(void){
+    if(heap_fl_bitmap == 0)
+        return 0;
+    //The largest block is in the highest non-empty list
+    uint32_t fl = 63 - __builtin_clzll(heap_fl_bitmap);
+    uint32_t sl = 31 - __builtin_clz(heap_sl_bitmap[fl]);
+    uint64_t largest = 0;
+    for(heap_block_t* block = heap_free_lists[fl][sl]; block != NULL; block = heap_links(block)->next)
+        if((block->size & ~HEAP_BLOCK_FREE) > largest)
+            largest = block->size & ~HEAP_BLOCK_FREE;
+    return largest;
+}
+
+/*
+ * Returns the heap fragmentation in percent:
+ *   the share of free memory that is not in the largest free block
+ */
+uint64_t stdlib_heap_frag(void){
+    if(free_ram_bytes == 0)
+        return 0;
+    return 100 - (stdlib_largest_free() * 100 / free_ram_bytes);
+}
+
 /*
  * Allocate a block of memory
  */
@@ -188,46 +399,47 @@ void* malloc(size_t size){
 void* amalloc(size_t size, size_t gran){
     if(size == 0 || gran == 0)
         return NULL;
-    //Find a free allocation block that satisfies the size requirement
-    size_t total_size = size + sizeof(alloc_block_t);
-    alloc_block_t* block = first_alloc_block;
-    do {
-        if(block->size >= total_size && !block->used){
-            //Recalculate the size requirement based on the alignment of the block
-            size_t actual_size = total_size;
-            size_t scrapped = 0;
-            if(((uint64_t)block + sizeof(alloc_block_t)) % gran != 0){
-                scrapped = gran - (((uint64_t)block + sizeof(alloc_block_t)) % gran);
-                actual_size += scrapped;
-            }
-            if(block->size < actual_size)
-                continue;
-            //Decrease the size
-            block->size -= actual_size;
-            //Move it
-            alloc_block_t* new = block;
-            block->prev->next = (alloc_block_t*)((uint64_t)block + actual_size);
-            *block->prev->next = *block;
-            block = block->prev->next;
-            //Create a new block and mark it as used
-            new->used       = 1;
-            new->prev       = block->prev;
-            new->prev->next = new;
-            new->next       = block;
-            new->size       = actual_size;
-            new->region     = block->region;
-            //Add the to total bytes of memory
-            used_ram_bytes += actual_size;
-            //Return the address
-            return (void*)((uint64_t)new + scrapped + sizeof(alloc_block_t));
-        }
-    } while(block->used < 2 && (block = block->next));
-    //We have't found such block
-    #ifdef STDLIB_CRASH_ON_ALLOC_ERR
-        gfx_panic(0, KRNL_PANIC_NOMEM_CODE);
-    #else
-        return NULL;
-    #endif
+    //Round the size up
+    if(size < sizeof(heap_links_t))
+        size = sizeof(heap_links_t);
+    size = (size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    //Reserve space for a free block in front of the data if the alignment is large
+    size_t search_size = size;
+    if(gran > HEAP_ALIGN)
+        search_size += gran + sizeof(heap_block_t) + sizeof(heap_links_t);
+    heap_block_t* block = heap_locate(search_size);
+    //Ask the frame allocator for more memory if there's no suitable block
+    if(block == NULL && heap_grow(search_size))
+        block = heap_locate(search_size);
+    if(block == NULL){
+        //We have't found such block
+        #ifdef STDLIB_CRASH_ON_ALLOC_ERR
+            gfx_panic(0, KRNL_PANIC_NOMEM_CODE);
+        #else
+            return NULL;
+        #endif
+    }
+    //Split the leading part off if the block isn't aligned well enough
+    uint64_t data = (uint64_t)block + sizeof(heap_block_t);
+    if(data % gran != 0){
+        uint64_t gap = gran - (data % gran);
+        //The leading part should be able to hold a free block
+        if(gap < sizeof(heap_block_t) + sizeof(heap_links_t))
+            gap += gran;
+        heap_block_t* aligned = (heap_block_t*)((uint8_t*)block + gap);
+        aligned->prev_phys = block;
+        aligned->size = ((block->size & ~HEAP_BLOCK_FREE) - gap) | HEAP_BLOCK_FREE;
+        heap_next_phys(aligned)->prev_phys = aligned;
+        block->size = (gap - sizeof(heap_block_t)) | HEAP_BLOCK_FREE;
+        heap_insert(block);
+        block = aligned;
+    }
+    //Split the trailing part off and mark the block as used
+    heap_trim(block, size);
+    block->size &= ~HEAP_BLOCK_FREE;
+    free_ram_bytes -= block->size + sizeof(heap_block_t);
+    //Return the address
+    return (uint8_t*)block + sizeof(heap_block_t);
 }
 
 /*
@@ -236,28 +448,26 @@ void* amalloc(size_t size, size_t gran){
 void free(void* ptr){
     if(ptr == NULL)
         return;
-    //Move the pointer to the left, so that it points to the block control structure
-    ptr = (uint8_t*)ptr - sizeof(alloc_block_t);
-    //Find a used block that is pointed to by the pointer
-    alloc_block_t* block = first_alloc_block;
-    do {
-        if(block == ptr && block->used){
-            //Mark it as unused
-            block->used = 0;
-            //Merge it with the previous block if possible
-            if(block->prev != NULL && !block->prev->used){
-                block->prev->size += block->size;
-                block->prev->next = block->next;
-                block = block->prev;
-            }
-            //Merge it with the next block if possible
-            if(block->next != NULL && !block->next->used){
-                block->size += block->next->size;
-                block->next = block->next->next;
-            }
-            break;
-        }
-    } while(block->used < 2 && (block = block->next));
+    //Move the pointer to the left, so that it points to the block header
+    heap_block_t* block = (heap_block_t*)((uint8_t*)ptr - sizeof(heap_block_t));
+    free_ram_bytes += block->size + sizeof(heap_block_t);
+    block->size |= HEAP_BLOCK_FREE;
+    //Merge it with the previous block if possible
+    heap_block_t* prev = block->prev_phys;
+    if(prev != NULL && (prev->size & HEAP_BLOCK_FREE)){
+        heap_remove(prev);
+        prev->size += (block->size & ~HEAP_BLOCK_FREE) + sizeof(heap_block_t);
+        block = prev;
+        heap_next_phys(block)->prev_phys = block;
+    }
+    //Merge it with the next block if possible
+    heap_block_t* next = heap_next_phys(block);
+    if(next->size & HEAP_BLOCK_FREE){
+        heap_remove(next);
+        block->size += (next->size & ~HEAP_BLOCK_FREE) + sizeof(heap_block_t);
+        heap_next_phys(block)->prev_phys = block;
+    }
+    heap_insert(block);
 }
 
 /*
@@ -272,36 +482,313 @@ void* calloc(uint64_t num, size_t size){
         return NULL;
 }
 
+//Memory functions come in several flavors. stdlib_init_mem() picks the ones that suit
+//  the CPU best: long enough blocks are handled with `rep movsb`/`rep stosb` if the
+//  CPU has fast string operations (ERMS, or FSRM for short strings as well),
+//  everything else with AVX2 if the OS state allows it or with SSE2 otherwise.
+//Blocks shorter than a vector are handled with a couple of possibly overlapping
+//  scalar accesses, the first and the last vector of longer ones are handled with
+//  unaligned accesses, and the ones in between with stores aligned by the vector size.
+
+//Unaligned scalar and vector types
+typedef uint16_t mem_u16_t  __attribute__((aligned(1), may_alias));
+typedef uint32_t mem_u32_t  __attribute__((aligned(1), may_alias));
+typedef uint64_t mem_u64_t  __attribute__((aligned(1), may_alias));
+typedef char     mem_v16_t  __attribute__((vector_size(16), may_alias));
+typedef char     mem_v16u_t __attribute__((vector_size(16), aligned(1), may_alias));
+typedef char     mem_v32_t  __attribute__((vector_size(32), may_alias));
+typedef char     mem_v32u_t __attribute__((vector_size(32), aligned(1), may_alias));
+
+//Keeps GCC from turning the loops below into calls to the functions they implement
+#define MEM_NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+/*
+ * Copies less than 16 bytes
+ * All of the source is read before the destination is written to
+ */
+static inline void mem_copy_small(uint8_t* d, const uint8_t* s, size_t n){
+    if(n >= 8){
+        uint64_t a = *(mem_u64_t*)s, b = *(mem_u64_t*)(s + n - 8);
+        *(mem_u64_t*)d = a;
+        *(mem_u64_t*)(d + n - 8) = b;
+    } else if(n >= 4){
+        uint32_t a = *(mem_u32_t*)s, b = *(mem_u32_t*)(s + n - 4);
+        *(mem_u32_t*)d = a;
+        *(mem_u32_t*)(d + n - 4) = b;
+    } else if(n > 0){
+        uint8_t a = s[0], b = s[n / 2], c = s[n - 1];
+        d[0] = a;
+        d[n / 2] = b;
+        d[n - 1] = c;
+    }
+}
+
+/*
+ * Fills less than 16 bytes
+ */
+static inline void mem_set_small(uint8_t* d, uint8_t c, size_t n){
+    uint64_t v = c * 0x0101010101010101ULL;
+    if(n >= 8){
+        *(mem_u64_t*)d = v;
+        *(mem_u64_t*)(d + n - 8) = v;
+    } else if(n >= 4){
+        *(mem_u32_t*)d = (uint32_t)v;
+        *(mem_u32_t*)(d + n - 4) = (uint32_t)v;
+    } else if(n > 0){
+        d[0] = c;
+        d[n / 2] = c;
+        d[n - 1] = c;
+    }
+}
+
+/*
+ * Copies a block of memory using SSE2
+ * The destination may overlap the source if it's below it
+ */
+static MEM_NO_LIBCALL void* mem_copy_sse2(void* dst, const void* src, size_t n){
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    if(n < 16){
+        mem_copy_small(d, s, n);
+        return dst;
+    }
+    mem_v16_t head = *(mem_v16u_t*)s;
+    mem_v16_t tail = *(mem_v16u_t*)(s + n - 16);
+    //Copy the middle with aligned stores
+    size_t skip = 16 - ((uint64_t)d & 15);
+    uint8_t* dp = d + skip;
+    const uint8_t* sp = s + skip;
+    uint8_t* end = d + n - 16;
+    while(dp + 64 <= end){
+        mem_v16_t a = *(mem_v16u_t*)(sp +  0), b = *(mem_v16u_t*)(sp + 16);
+        mem_v16_t c = *(mem_v16u_t*)(sp + 32), e = *(mem_v16u_t*)(sp + 48);
+        *(mem_v16_t*)(dp +  0) = a;
+        *(mem_v16_t*)(dp + 16) = b;
+        *(mem_v16_t*)(dp + 32) = c;
+        *(mem_v16_t*)(dp + 48) = e;
+        dp += 64;
+        sp += 64;
+    }
+    while(dp < end){
+        *(mem_v16_t*)dp = *(mem_v16u_t*)sp;
+        dp += 16;
+        sp += 16;
+    }
+    //Copy the ends
+    *(mem_v16u_t*)d = head;
+    *(mem_v16u_t*)(d + n - 16) = tail;
+    return dst;
+}
+
+/*
+ * Copies a block of memory using AVX2
+ * The destination may overlap the source if it's below it
+ */
+static MEM_NO_LIBCALL __attribute__((target("avx2"))) void* mem_copy_avx2(void* dst, const void* src, size_t n){
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    if(n < 32)
+        return mem_copy_sse2(dst, src, n);
+    mem_v32_t head = *(mem_v32u_t*)s;
+    mem_v32_t tail = *(mem_v32u_t*)(s + n - 32);
+    //Copy the middle with aligned stores
+    size_t skip = 32 - ((uint64_t)d & 31);
+    uint8_t* dp = d + skip;
+    const uint8_t* sp = s + skip;
+    uint8_t* end = d + n - 32;
+    while(dp + 128 <= end){
+        mem_v32_t a = *(mem_v32u_t*)(sp +  0), b = *(mem_v32u_t*)(sp + 32);
+        mem_v32_t c = *(mem_v32u_t*)(sp + 64), e = *(mem_v32u_t*)(sp + 96);
+        *(mem_v32_t*)(dp +  0) = a;
+        *(mem_v32_t*)(dp + 32) = b;
+        *(mem_v32_t*)(dp + 64) = c;
+        *(mem_v32_t*)(dp + 96) = e;
+        dp += 128;
+        sp += 128;
+    }
+    while(dp < end){
+        *(mem_v32_t*)dp = *(mem_v32u_t*)sp;
+        dp += 32;
+        sp += 32;
+    }
+    //Copy the ends
+    *(mem_v32u_t*)d = head;
+    *(mem_v32u_t*)(d + n - 32) = tail;
+    return dst;
+}
+
+/*
+ * Fills a block of memory using SSE2
+ */
+static MEM_NO_LIBCALL void* mem_set_sse2(void* dst, int ch, size_t n){
+    uint8_t* d = (uint8_t*)dst;
+    if(n < 16){
+        mem_set_small(d, (uint8_t)ch, n);
+        return dst;
+    }
+    mem_v16_t v = (mem_v16_t){} + (char)ch;
+    *(mem_v16u_t*)d = v;
+    *(mem_v16u_t*)(d + n - 16) = v;
+    uint8_t* dp = (uint8_t*)(((uint64_t)d + 16) & ~15ULL);
+    uint8_t* end = d + n - 16;
+    while(dp + 64 <= end){
+        *(mem_v16_t*)(dp +  0) = v;
+        *(mem_v16_t*)(dp + 16) = v;
+        *(mem_v16_t*)(dp + 32) = v;
+        *(mem_v16_t*)(dp + 48) = v;
+        dp += 64;
+    }
+    while(dp < end){
+        *(mem_v16_t*)dp = v;
+        dp += 16;
+    }
+    return dst;
+}
+
+/*
+ * Fills a block of memory using AVX2
+ */
+static MEM_NO_LIBCALL __attribute__((target("avx2"))) void* mem_set_avx2(void* dst, int ch, size_t n){
+    uint8_t* d = (uint8_t*)dst;
+    if(n < 32)
+        return mem_set_sse2(dst, ch, n);
+    mem_v32_t v = (mem_v32_t){} + (char)ch;
+    *(mem_v32u_t*)d = v;
+    *(mem_v32u_t*)(d + n - 32) = v;
+    uint8_t* dp = (uint8_t*)(((uint64_t)d + 32) & ~31ULL);
+    uint8_t* end = d + n - 32;
+    while(dp + 128 <= end){
+        *(mem_v32_t*)(dp +  0) = v;
+        *(mem_v32_t*)(dp + 32) = v;
+        *(mem_v32_t*)(dp + 64) = v;
+        *(mem_v32_t*)(dp + 96) = v;
+        dp += 128;
+    }
+    while(dp < end){
+        *(mem_v32_t*)dp = v;
+        dp += 32;
+    }
+    return dst;
+}
+
+/*
+ * Compares the bytes at which two blocks start to differ
+ */
+static inline int mem_cmp_at(const uint8_t* l, const uint8_t* r, uint32_t mask){
+    uint32_t i = __builtin_ctz(~mask);
+    return (l[i] > r[i]) ? 1 : -1;
+}
+
+/*
+ * Compares two blocks of memory using SSE2
+ */
+static int mem_cmp_sse2(const void* lhs, const void* rhs, size_t n){
+    const uint8_t* l = (const uint8_t*)lhs;
+    const uint8_t* r = (const uint8_t*)rhs;
+    if(n < 16){
+        for(size_t i = 0; i < n; i++)
+            if(l[i] != r[i])
+                return (l[i] > r[i]) ? 1 : -1;
+        return 0;
+    }
+    //The last vector may overlap the one before it
+    for(size_t i = 0; ; i += 16){
+        if(i > n - 16)
+            i = n - 16;
+        mem_v16_t a = *(mem_v16u_t*)(l + i), b = *(mem_v16u_t*)(r + i);
+        uint32_t mask = __builtin_ia32_pmovmskb128(a == b) | 0xFFFF0000;
+        if(mask != 0xFFFFFFFF)
+            return mem_cmp_at(l + i, r + i, mask);
+        if(i == n - 16)
+            return 0;
+    }
+}
+
+/*
+ * Compares two blocks of memory using AVX2
+ */
+static __attribute__((target("avx2"))) int mem_cmp_avx2(const void* lhs, const void* rhs, size_t n){
+    const uint8_t* l = (const uint8_t*)lhs;
+    const uint8_t* r = (const uint8_t*)rhs;
+    if(n < 32)
+        return mem_cmp_sse2(lhs, rhs, n);
+    //The last vector may overlap the one before it
+    for(size_t i = 0; ; i += 32){
+        if(i > n - 32)
+            i = n - 32;
+        mem_v32_t a = *(mem_v32u_t*)(l + i), b = *(mem_v32u_t*)(r + i);
+        uint32_t mask = __builtin_ia32_pmovmskb256(a == b);
+        if(mask != 0xFFFFFFFF)
+            return mem_cmp_at(l + i, r + i, mask);
+        if(i == n - 32)
+            return 0;
+    }
+}
+
+//The selected implementations
+void* (*mem_copy_impl)(void*, const void*, size_t) = mem_copy_sse2;
+void* (*mem_set_impl)(void*, int, size_t) = mem_set_sse2;
+int   (*mem_cmp_impl)(const void*, const void*, size_t) = mem_cmp_sse2;
+//Blocks at least this long are handled with string instructions
+size_t mem_rep_min = (size_t)-1;
+
+/*
+ * Selects the memory function implementations according to the CPU features
+ * Has to be called after the OS has set up XCR0
+ */
+void stdlib_init_mem(void){
+    uint32_t max_leaf, ecx1, ebx7 = 0, edx7 = 0;
+    cpuid_get_vendor(NULL, &max_leaf);
+    cpuid_get_feat(NULL, &ecx1);
+    if(max_leaf >= 7)
+        cpuid_get_leaf(7, 0, NULL, &ebx7, NULL, &edx7);
+    //AVX2 can only be used if the OS has enabled the YMM state
+    uint8_t avx2 = 0;
+    if((ecx1 & CPUID_FEAT_ECX_OSXSAVE) && (ebx7 & CPUID_FEAT7_EBX_AVX2)){
+        uint32_t xcr0_lo, xcr0_hi;
+        __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        avx2 = (xcr0_lo & 6) == 6;
+    }
+    if(avx2){
+        mem_copy_impl = mem_copy_avx2;
+        mem_set_impl = mem_set_avx2;
+        mem_cmp_impl = mem_cmp_avx2;
+    }
+    //Fast string operations
+    if(edx7 & CPUID_FEAT7_EDX_FSRM)
+        mem_rep_min = 0;
+    else if(ebx7 & CPUID_FEAT7_EBX_ERMS)
+        mem_rep_min = MEM_ERMS_THRESHOLD;
+    if(mem_rep_min == (size_t)-1)
+        krnl_write_msgf(__FILE__, __LINE__, "memory functions: %s, string instructions disabled",
+            avx2 ? "AVX2" : "SSE2");
+    else
+        krnl_write_msgf(__FILE__, __LINE__, "memory functions: %s, string instructions from %i bytes",
+            avx2 ? "AVX2" : "SSE2", mem_rep_min);
+}
+
 /*
  * Fill a chunk of memory with given values
  */
 void* memset(void* dst, int ch, size_t size){
-    //Convert ch to 8 bits
-    uint8_t c = (uint8_t)ch;
-    //Fill the chunk with them
-    while(size--)
-        *(uint8_t*)((uint8_t*)dst + size) = c;
-    //Return dst
-    return dst;
+    if(size >= mem_rep_min){
+        void* d = dst;
+        __asm__ volatile("rep stosb" : "+D" (d), "+c" (size) : "a" (ch) : "memory");
+        return dst;
+    }
+    return mem_set_impl(dst, ch, size);
 }
 
 /*
  * Copy a block of memory
  */
 void* memcpy(void* destination, const void* source, size_t num){
-    //Q = 8 bytes at a time
-    //D = 4 bytes at a time
-    //W = 2 bytes at a time
-    //B = 1 byte  at a time
-    if(num % 8 == 0)
-        __asm__ volatile("rep movsq" : : "D" (destination), "S" (source), "c" (num / 8));
-    else if(num % 4 == 0)
-        __asm__ volatile("rep movsd" : : "D" (destination), "S" (source), "c" (num / 4));
-    else if(num % 2 == 0)
-        __asm__ volatile("rep movsw" : : "D" (destination), "S" (source), "c" (num / 2));
-    else
-        __asm__ volatile("rep movsb" : : "D" (destination), "S" (source), "c" (num));
-    return destination;
+    if(num >= mem_rep_min){
+        void* d = destination;
+        __asm__ volatile("rep movsb" : "+D" (d), "+S" (source), "+c" (num) : : "memory");
+        return destination;
+    }
+    return mem_copy_impl(destination, source, num);
 }
 
 /*
@@ -311,19 +798,40 @@ char* strcpy(char* dest, char* src){
     return memcpy(dest, src, strlen(src) + 1);
 }
 
+/*
+ * Copies a block of memory backwards using SSE2
+ */
+static MEM_NO_LIBCALL void* mem_copy_back_sse2(void* dst, const void* src, size_t n){
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    if(n < 16){
+        mem_copy_small(d, s, n);
+        return dst;
+    }
+    mem_v16_t head = *(mem_v16u_t*)s;
+    mem_v16_t tail = *(mem_v16u_t*)(s + n - 16);
+    //Copy the middle with aligned stores, from the end
+    uint8_t* dp = (uint8_t*)((uint64_t)(d + n) & ~15ULL);
+    const uint8_t* sp = s + (dp - d);
+    while(dp > d + 16){
+        dp -= 16;
+        sp -= 16;
+        *(mem_v16_t*)dp = *(mem_v16u_t*)sp;
+    }
+    //Copy the ends
+    *(mem_v16u_t*)(d + n - 16) = tail;
+    *(mem_v16u_t*)d = head;
+    return dst;
+}
+
 /*
  * Copy a block of memory to an overlapping block of memory
  */
 void* memmove(void* dest, const void* src, size_t count){
-    if(dest <= src){
-        //Use memcpy if the destination is below the source
-        return memcpy(dest, src, count);
-    } else {
-        //Use another, non-optimized algorithm
-        for(int i = count; i >= 0; i--)
-            *(uint8_t*)((uint8_t*)dest + i) = *(uint8_t*)((uint8_t*)src + i);
-        return dest;
-    }
+    //Copy forwards if the destination is below the source or they don't overlap
+    if((uint8_t*)dest <= (uint8_t*)src || (uint8_t*)dest >= (uint8_t*)src + count)
+        return mem_copy_impl(dest, src, count);
+    return mem_copy_back_sse2(dest, src, count);
 }
 
 /*
@@ -433,6 +941,32 @@ void wrmsr(uint32_t msr, uint64_t val){
     __asm__ volatile("wrmsr");
 }
 
+/*
+ * Waits until a spinlock is free and takes it
+ */
+void spinlock_acquire(spinlock_t* lock){
+    while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)){
+        //Only read it while it's taken so that the cache line isn't bounced around
+        while(__atomic_load_n(lock, __ATOMIC_RELAXED))
+            __asm__ volatile("pause");
+    }
+}
+
+/*
+ * Takes a spinlock if it's free
+ * Returns 1 if it has been taken
+ */
+uint8_t spinlock_try(spinlock_t* lock){
+    return !__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Releases a spinlock
+ */
+void spinlock_release(spinlock_t* lock){
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
 /*
  * Read the amount of cycles executed by the CPU
  */
@@ -525,70 +1059,246 @@ char* strcat(char* dest, char* src){
 }
 
 /*
- * Returns the number of arguments sprintf will require on a string fmt
+ * Sends a chunk of output to a sink
  */
-int _sprintf_argcnt(char* fmt){
-    uint64_t argcnt = 0;
-    for(uint64_t i = 0; i < strlen(fmt); i++)
-        if(fmt[i] == '%' && (i > 0 && fmt[i - 1] != '%'))
-            argcnt++;
-    return argcnt;
+static inline void sink_put(sink_t* sink, const char* data, size_t len){
+    sink->write(sink, data, len);
+    sink->count += len;
 }
 
 /*
- * Print formatted string
+ * Sends a character to a sink a number of times
  */
-int _sprintf(char* str, const char* format, va_list valist){
-    //Parse the format
-    uint64_t str_idx = 0;
-    for(uint64_t i = 0; i < strlen(format); i++){
-        //If it's a percentage sign, print something special
-        if(format[i] == '%'){
-            char fmt = format[++i];
-            switch(fmt){
-                case 's': { //string
-                    char* str2 = va_arg(valist, char*);
-                    for(uint64_t j = 0; j < strlen(str2); j++)
-                        str[str_idx++] = str2[j];
-                    break;
+static void sink_fill(sink_t* sink, char c, int64_t num){
+    char buf[16];
+    memset(buf, c, sizeof(buf));
+    while(num > 0){
+        size_t len = (num > 16) ? 16 : num;
+        sink_put(sink, buf, len);
+        num -= len;
+    }
+}
+
+/*
+ * Writes to a buffer, discarding everything that doesn't fit
+ */
+static void sink_buf_write(sink_t* sink, const char* data, size_t len){
+    if(sink->count >= sink->size)
+        return;
+    if(len > sink->size - sink->count)
+        len = sink->size - sink->count;
+    memcpy(sink->buf + sink->count, data, len);
+}
+
+/*
+ * Creates a sink that writes to a buffer of `size` bytes
+ * (it doesn't add the terminator)
+ */
+sink_t sink_to_buf(char* buf, size_t size){
+    return (sink_t){.write = sink_buf_write, .buf = buf, .size = size, .count = 0};
+}
+
+/*
+ * Writes a formatted string to a sink in a single pass over the format
+ * Supported are the "-0+ #" flags, the width and the precision (also as "*"), the hh, h, l, ll, z, j and t
+ *   length modifiers and the d, i, u, x, X, p, c, s, % and n (prints nothing) conversions
+ * Integers without a length modifier are 64-bit ones
+ * Returns the number of characters written or -1 if the format is invalid
+ */
+int _sink_printf(sink_t* sink, const char* format, va_list valist){
+    size_t start = sink->count;
+    const char* c = format;
+    while(*c != 0){
+        //Write everything up to the next conversion in one piece
+        const char* run = c;
+        while(*c != 0 && *c != '%')
+            c++;
+        if(c != run)
+            sink_put(sink, run, c - run);
+        if(*c == 0)
+            break;
+        c++;
+        //Parse the flags
+        uint8_t left = 0, zero = 0, plus = 0, space = 0, alt = 0;
+        for(;; c++){
+            if(*c == '-')      left = 1;
+            else if(*c == '0') zero = 1;
+            else if(*c == '+') plus = 1;
+            else if(*c == ' ') space = 1;
+            else if(*c == '#') alt = 1;
+            else break;
+        }
+        //Parse the width and the precision
+        int64_t width = 0, prec = -1;
+        if(*c == '*'){
+            width = va_arg(valist, int);
+            if(width < 0){
+                left = 1;
+                width = -width;
+            }
+            c++;
+        } else {
+            while(*c >= '0' && *c <= '9')
+                width = (width * 10) + (*c++ - '0');
+        }
+        if(*c == '.'){
+            c++;
+            prec = 0;
+            if(*c == '*'){
+                prec = va_arg(valist, int);
+                c++;
+            } else {
+                while(*c >= '0' && *c <= '9')
+                    prec = (prec * 10) + (*c++ - '0');
+            }
+        }
+        //Parse the length modifier
+        uint8_t bits = 64;
+        if(*c == 'h'){
+            bits = 16;
+            if(*++c == 'h'){
+                bits = 8;
+                c++;
+            }
+        } else {
+            while(*c == 'l' || *c == 'z' || *c == 'j' || *c == 't' || *c == 'L')
+                c++;
+        }
+        //Do the conversion
+        char conv = *c++;
+        switch(conv){
+            case 's': { //string
+                const char* str = va_arg(valist, const char*);
+                if(str == NULL)
+                    str = "(null)";
+                int64_t len = 0;
+                while((prec < 0 || len < prec) && str[len] != 0)
+                    len++;
+                if(!left)
+                    sink_fill(sink, ' ', width - len);
+                sink_put(sink, str, len);
+                if(left)
+                    sink_fill(sink, ' ', width - len);
+                break;
+            }
+            case 'c': { //character
+                char ch = (char)va_arg(valist, int);
+                if(!left)
+                    sink_fill(sink, ' ', width - 1);
+                sink_put(sink, &ch, 1);
+                if(left)
+                    sink_fill(sink, ' ', width - 1);
+                break;
+            }
+            case '%': //percentage sign
+                sink_put(sink, "%", 1);
+                break;
+            case 'n': //nothing
+                break;
+            case 'd': //integer
+            case 'i':
+            case 'u':
+            case 'p': //hex integer
+            case 'x':
+            case 'X': {
+                uint64_t val = va_arg(valist, uint64_t);
+                //Apply the length modifier and find out the sign
+                uint8_t neg = 0;
+                if(conv == 'd' || conv == 'i'){
+                    int64_t sval = (bits == 8) ? (int8_t)val : (bits == 16) ? (int16_t)val : (int64_t)val;
+                    neg = sval < 0;
+                    val = neg ? -(uint64_t)sval : (uint64_t)sval;
+                } else if(bits < 64){
+                    val &= (1ULL << bits) - 1;
                 }
-                case 'c': //character
-                    str[str_idx++] = va_arg(valist, int);
-                    break;
-                case '%': //percentage sign
-                    str[str_idx++] = '%';
-                    break;
-                case 'n': //nothing
-                    break;
-                case 'd': //integer
-                case 'u':
-                case 'i': {
-                    char buf[64];
-                    sprintu(buf, va_arg(valist, uint64_t), 1);
-                    for(uint64_t j = 0; j < strlen(buf); j++)
-                        str[str_idx++] = buf[j];
-                    break;
+                //Convert the digits, right to left
+                char digits[24];
+                int64_t len = 0;
+                if(conv == 'd' || conv == 'i' || conv == 'u'){
+                    for(uint64_t v = val; v > 0; v /= 10)
+                        digits[sizeof(digits) - ++len] = '0' + (v % 10);
+                } else {
+                    const char* set = (conv == 'X') ? "0123456789ABCDEF" : "0123456789abcdef";
+                    for(uint64_t v = val; v > 0; v >>= 4)
+                        digits[sizeof(digits) - ++len] = set[v & 15];
                 }
-                case 'p': //hex integer
-                case 'x':
-                case 'X': {
-                    char buf[64];
-                    sprintub16(buf, va_arg(valist, uint64_t), 1);
-                    for(uint64_t j = 0; j < strlen(buf); j++)
-                        str[str_idx++] = buf[j];
-                    break;
+                if(len == 0 && prec != 0)
+                    digits[sizeof(digits) - ++len] = '0';
+                //Put together the prefix
+                const char* prefix = "";
+                if(neg)
+                    prefix = "-";
+                else if((conv == 'd' || conv == 'i') && plus)
+                    prefix = "+";
+                else if((conv == 'd' || conv == 'i') && space)
+                    prefix = " ";
+                else if(conv == 'p' || (alt && val != 0 && conv == 'x'))
+                    prefix = "0x";
+                else if(alt && val != 0 && conv == 'X')
+                    prefix = "0X";
+                int64_t prefix_len = strlen(prefix);
+                //Calculate the padding
+                int64_t zeroes = (prec > len) ? (prec - len) : 0;
+                int64_t total = prefix_len + zeroes + len;
+                if(zero && !left && prec < 0 && width > total){
+                    zeroes += width - total;
+                    total = width;
                 }
-                default: //nothing else
-                    return -1;
+                if(!left)
+                    sink_fill(sink, ' ', width - total);
+                sink_put(sink, prefix, prefix_len);
+                sink_fill(sink, '0', zeroes);
+                sink_put(sink, digits + sizeof(digits) - len, len);
+                if(left)
+                    sink_fill(sink, ' ', width - total);
+                break;
             }
-        } else { //A normal character
-            str[str_idx++] = format[i];
+            default: //nothing else
+                return -1;
         }
     }
-    //Add zero termination
-    str[str_idx] = 0;
-    //Return the amount of characters printed
-    return str_idx;
+    return sink->count - start;
+}
+
+/*
+ * Writes a formatted string to a sink (wrapper)
+ */
+int sink_printf(sink_t* sink, const char* format, ...){
+    va_list valist;
+    va_start(valist, format);
+    int result = _sink_printf(sink, format, valist);
+    va_end(valist);
+    return result;
+}
+
+/*
+ * Print formatted string, writing at most `size` characters including the terminator
+ * Returns the length the whole string would have
+ */
+int _snprintf(char* str, size_t size, const char* format, va_list valist){
+    sink_t sink = sink_to_buf(str, (size > 0) ? (size - 1) : 0);
+    int result = _sink_printf(&sink, format, valist);
+    if(size > 0)
+        str[(sink.count < size - 1) ? sink.count : (size - 1)] = 0;
+    return result;
+}
+
+/*
+ * Print formatted string
+ */
+int _sprintf(char* str, const char* format, va_list valist){
+    return _snprintf(str, 0xFFFFFFFFFFFFFFFFULL, format, valist);
+}
+
+/*
+ * Print formatted string, bounded (wrapper)
+ */
+int snprintf(char* str, size_t size, const char* format, ...){
+    va_list valist;
+    va_start(valist, format);
+    int result = _snprintf(str, size, format, valist);
+    va_end(valist);
+    return result;
 }
 
 /*
@@ -596,7 +1306,7 @@ int _sprintf(char* str, const char* format, va_list valist){
  */
 int sprintf(char* str, const char* format, ...){
     va_list valist;
-    va_start(valist, _sprintf_argcnt((char*)format));
+    va_start(valist, format);
     int result = _sprintf(str, format, valist);
     va_end(valist);
     return result;
@@ -606,16 +1316,7 @@ int sprintf(char* str, const char* format, ...){
  * Compare two memory blocks
  */
 int memcmp(const void* lhs, const void* rhs, size_t cnt){
-    //Go through each byte
-    for(int i = 0; i < cnt; i++){
-        //Return if the blocks aren't equal
-        if(((const uint8_t*)lhs)[i] > ((const uint8_t*)rhs)[i])
-            return 1;
-        else if(((const uint8_t*)lhs)[i] < ((const uint8_t*)rhs)[i])
-            return -1;
-    }
-    //If we didn't return, the blocks are equal
-    return 0;
+    return mem_cmp_impl(lhs, rhs, cnt);
 }
 
 /*
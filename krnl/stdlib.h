@@ -7,9 +7,6 @@
 #define NULL ((void*)0)
 #endif
 
-//Converts an allocation block address to its upper-half variant
-#define UPPER_AB(B) (alloc_block_t*)(((uint64_t)B - (uint64_t)ram_regions[(B)->region].virt_start_orig) + (uint64_t)ram_regions[(B)->region].virt_start)
-
 //Don't forget to comment this on a release version :)
 #define STDLIB_CRASH_ON_ALLOC_ERR
 
@@ -25,16 +22,60 @@ typedef long long signed int   int64_t;
 typedef uint64_t               size_t;
 typedef int64_t                time_t;
 
+//Heap (TLSF) settings
+#define HEAP_ALIGN_LOG2                     4
+#define HEAP_ALIGN                          (1ULL << HEAP_ALIGN_LOG2)
+#define HEAP_SL_LOG2                        5
+#define HEAP_SL_COUNT                       (1 << HEAP_SL_LOG2)
+#define HEAP_FL_SHIFT                       (HEAP_SL_LOG2 + HEAP_ALIGN_LOG2)
+#define HEAP_FL_MAX                         40
+#define HEAP_FL_COUNT                       (HEAP_FL_MAX - HEAP_FL_SHIFT + 1)
+#define HEAP_SMALL_BLOCK                    (1ULL << HEAP_FL_SHIFT)
+#define HEAP_BLOCK_FREE                     1ULL
+//Maximal size of the initial heap pool
+#define HEAP_INITIAL_MAX                    (64ULL * 1024 * 1024)
+//Pages below 1 MiB kept for code that has to run in real mode
+#define DRAM_LOW_PAGES                      2
+
+//Memory function settings
+//Shortest block handled with string instructions if the CPU only has ERMS, not FSRM
+#define MEM_ERMS_THRESHOLD                  2048
+
+/*
+ * Formatted output destination
+ * `write` gets the output in chunks, `count` is the number of characters written so far.
+ *   `buf` and `size` are used by buffer sinks, `ctx` is free for other ones
+ */
+typedef struct _sink_s {
+    void (*write)(struct _sink_s* sink, const char* data, size_t len);
+    void*  ctx;
+    char*  buf;
+    size_t size;
+    size_t count;
+} sink_t;
+
+/*
+ * Spinlock
+ * Nothing is done about interrupts, the kernel runs with them disabled
+ */
+typedef volatile uint32_t spinlock_t;
+
+/*
+ * Heap block header
+ * Free blocks additionally store the free list links in the first bytes of their data
+ */
+typedef struct _heap_block_s {
+    struct _heap_block_s* prev_phys;
+    size_t                size;
+} heap_block_t;
+
 /*
- * Structure defining an allocable memory block
+ * Free list links of a free heap block
  */
-typedef struct _alloc_block_s {
-    uint8_t                used;
-    struct _alloc_block_s* prev;
-    struct _alloc_block_s* next;
-    size_t                 size;
-    uint64_t               region;
-} alloc_block_t;
+typedef struct {
+    heap_block_t* next;
+    heap_block_t* prev;
+} heap_links_t;
 
 /*
  * Structure defining a usable memory region
@@ -129,20 +170,30 @@ uint64_t rdmsr    (uint32_t msr);
 void     wrmsr    (uint32_t msr, uint64_t val);
 uint32_t rand     (void);
 uint64_t popcnt   (uint64_t n);
+//Spinlocks
+void    spinlock_acquire (spinlock_t* lock);
+uint8_t spinlock_try     (spinlock_t* lock);
+void    spinlock_release (spinlock_t* lock);
 //Dynamic memory functions
-uint64_t stdlib_usable_ram (void);
-uint64_t stdlib_used_ram   (void);
+uint64_t stdlib_usable_ram   (void);
+uint64_t stdlib_used_ram     (void);
+uint64_t stdlib_free_ram     (void);
+uint64_t stdlib_largest_free (void);
+uint64_t stdlib_heap_frag    (void);
 uint64_t dram_init         (void);
-void     dram_map          (uint64_t cr3);
 void     dram_shift        (void);
+void*    dram_low_pages    (void);
+void     heap_add_pool     (void* start, size_t size);
 void*    malloc            (size_t size);
 void*    amalloc           (size_t size, size_t gran);
 void     free              (void* ptr);
 void*    calloc            (uint64_t num, size_t size);
 //Memory operation functions
-void* memset (void* dst, int ch, size_t size);
-void* memcpy (void* destination, const void* source, size_t num);
-char* strcpy (char* dest, char* src);
+void  stdlib_init_mem (void);
+void* memset          (void* dst, int ch, size_t size);
+void* memcpy          (void* destination, const void* source, size_t num);
+void* memmove         (void* dest, const void* src, size_t count);
+char* strcpy          (char* dest, char* src);
 //I/O port operation functions
 void     outl     (uint16_t port, uint32_t value);
 uint32_t inl      (uint16_t port);
@@ -155,9 +206,13 @@ void     rep_insw (uint16_t port, uint32_t count, uint16_t* buf);
 size_t strlen          (const char* str);
 char*  sprintu         (char* str, uint64_t i, uint8_t min);
 char*  sprintub16      (char* str, uint64_t i, uint8_t min);
-int    _sprintf_argcnt (char* fmt);
 int    _sprintf        (char* str, const char* format, va_list valist);
 int    sprintf         (char* str, const char* format, ...);
+int    _snprintf       (char* str, size_t size, const char* format, va_list valist);
+int    snprintf        (char* str, size_t size, const char* format, ...);
+sink_t sink_to_buf     (char* buf, size_t size);
+int    _sink_printf    (sink_t* sink, const char* format, va_list valist);
+int    sink_printf     (sink_t* sink, const char* format, ...);
 char*  strcat          (char* dest, char* src);
 int    strcmp          (const char* str1, const char* str2);
 int    atoi            (const char* str);
@@ -0,0 +1,189 @@
+//Neutron Project
+//PMem - Physical page frame allocator
+
+#include "./pmem.h"
+#include "./vmem.h"
+#include "../stdlib.h"
+#include "../krnl.h"
+
+//This is a binary buddy allocator. Free blocks of 2^order frames are kept in
+//  one list per order. A block of order N always starts at a frame number that is
+//  a multiple of 2^N, so the block it can be merged with (its "buddy") is found
+//  by flipping bit N of its frame number.
+//Each region has a bitmap with one bit per frame that is set if a free block
+//  starts at that frame. The order of that block is stored in the block itself,
+//  along with the list links. The links are physical addresses, so the allocator
+//  doesn't care where the dynamic RAM is mapped at the moment.
+
+pmem_region_t pmem_regions[PMEM_MAX_REGIONS];
+uint32_t      pmem_region_cnt = 0;
+uint64_t      pmem_free_lists[PMEM_MAX_ORDER + 1] = {[0 ... PMEM_MAX_ORDER] = PMEM_NONE};
+uint64_t      pmem_free_frames = 0;
+
+/*
+ * Returns the amount of free physical memory
+ */
+uint64_t pmem_free_bytes(void){
+    return pmem_free_frames * 4096;
+}
+
+/*
+ * Returns the largest order of a block that isn't bigger than the specified number of frames
+ */
+uint8_t pmem_order(uint64_t frames){
+    if(frames == 0)
+        return 0;
+    uint8_t order = 63 - __builtin_clzll(frames);
+    return (order > PMEM_MAX_ORDER) ? PMEM_MAX_ORDER : order;
+}
+
+/*
+ * Returns the region a frame belongs to
+ */
+static pmem_region_t* pmem_region_of(uint64_t addr){
+    for(uint32_t i = 0; i < pmem_region_cnt; i++)
+        if(addr >= pmem_regions[i].start && addr < pmem_regions[i].end)
+            return &pmem_regions[i];
+    return NULL;
+}
+
+/*
+ * Returns the free block header located at a physical address
+ */
+static inline pmem_node_t* pmem_node(uint64_t addr){
+    return (pmem_node_t*)vmem_phys_to_virt((void*)addr);
+}
+
+/*
+ * Sets or clears the "free block starts here" bit of a frame
+ */
+static inline void pmem_mark(pmem_region_t* region, uint64_t addr, uint8_t set){
+    uint64_t frame = (addr - region->start) / 4096;
+    uint8_t* byte = (uint8_t*)vmem_phys_to_virt((void*)(region->bitmap + (frame / 8)));
+    if(set)
+        *byte |= 1 << (frame % 8);
+    else
+        *byte &= ~(1 << (frame % 8));
+}
+
+/*
+ * Checks the "free block starts here" bit of a frame
+ */
+static inline uint8_t pmem_marked(pmem_region_t* region, uint64_t addr){
+    uint64_t frame = (addr - region->start) / 4096;
+    return (*(uint8_t*)vmem_phys_to_virt((void*)(region->bitmap + (frame / 8))) >> (frame % 8)) & 1;
+}
+
+/*
+ * Puts a free block onto its list
+ */
+static void pmem_push(pmem_region_t* region, uint64_t addr, uint8_t order){
+    pmem_node_t* node = pmem_node(addr);
+    node->order = order;
+    node->prev = PMEM_NONE;
+    node->next = pmem_free_lists[order];
+    if(node->next != PMEM_NONE)
+        pmem_node(node->next)->prev = addr;
+    pmem_free_lists[order] = addr;
+    pmem_mark(region, addr, 1);
+    pmem_free_frames += 1ULL << order;
+}
+
+/*
+ * Takes a free block off its list
+ */
+static void pmem_unlink(pmem_region_t* region, uint64_t addr){
+    pmem_node_t* node = pmem_node(addr);
+    if(node->next != PMEM_NONE)
+        pmem_node(node->next)->prev = node->prev;
+    if(node->prev != PMEM_NONE)
+        pmem_node(node->prev)->next = node->next;
+    else
+        pmem_free_lists[node->order] = node->next;
+    pmem_mark(region, addr, 0);
+    pmem_free_frames -= 1ULL << node->order;
+}
+
+/*
+ * Gives a range of physical memory to the allocator
+ */
+void pmem_add_range(phys_addr_t start, uint64_t size){
+    if(pmem_region_cnt >= PMEM_MAX_REGIONS)
+        return;
+    //Align the range by frames, never hand out the frame at the null address
+    uint64_t st = ((uint64_t)start + 4095) & ~4095ULL;
+    uint64_t end = ((uint64_t)start + size) & ~4095ULL;
+    if(st == 0)
+        st = 4096;
+    if(end <= st)
+        return;
+    //The bitmap is located at the start of the range
+    uint64_t frames = (end - st) / 4096;
+    uint64_t bitmap_frames = ((frames + 7) / 8 + 4095) / 4096;
+    if(bitmap_frames >= frames)
+        return;
+    pmem_region_t* region = &pmem_regions[pmem_region_cnt++];
+    region->start = st;
+    region->end = end;
+    region->bitmap = st;
+    memset(vmem_phys_to_virt((void*)st), 0, bitmap_frames * 4096);
+    //Cut the rest of the range into the largest naturally aligned blocks possible
+    uint64_t addr = st + (bitmap_frames * 4096);
+    while(addr < end){
+        uint8_t order = PMEM_MAX_ORDER;
+        while(((addr / 4096) & ((1ULL << order) - 1)) || addr + (4096ULL << order) > end)
+            order--;
+        pmem_push(region, addr, order);
+        addr += 4096ULL << order;
+    }
+}
+
+/*
+ * Allocates a block of 2^order physically contiguous frames
+ * Returns its physical address or NULL if there's not enough memory
+ */
+phys_addr_t pmem_alloc(uint8_t order){
+    if(order > PMEM_MAX_ORDER)
+        return NULL;
+    //Find the smallest non-empty list that satisfies the request
+    uint8_t cur = order;
+    while(cur <= PMEM_MAX_ORDER && pmem_free_lists[cur] == PMEM_NONE)
+        cur++;
+    if(cur > PMEM_MAX_ORDER)
+        return NULL;
+    uint64_t addr = pmem_free_lists[cur];
+    pmem_region_t* region = pmem_region_of(addr);
+    pmem_unlink(region, addr);
+    //Split it until it has the requested size, returning the upper halves
+    while(cur > order){
+        cur--;
+        pmem_push(region, addr + (4096ULL << cur), cur);
+    }
+    return (phys_addr_t)addr;
+}
+
+/*
+ * Frees a block of 2^order frames
+ * Parts of a larger block may be freed separately, each part exactly once
+ */
+void pmem_free(phys_addr_t addr, uint8_t order){
+    if(addr == NULL)
+        return;
+    uint64_t block = (uint64_t)addr;
+    pmem_region_t* region = pmem_region_of(block);
+    if(region == NULL)
+        return;
+    //Merge the block with its buddy as long as the buddy is free as a whole
+    while(order < PMEM_MAX_ORDER){
+        uint64_t buddy = ((block / 4096) ^ (1ULL << order)) * 4096;
+        if(buddy < region->start || buddy + (4096ULL << order) > region->end)
+            break;
+        if(!pmem_marked(region, buddy) || pmem_node(buddy)->order != order)
+            break;
+        pmem_unlink(region, buddy);
+        if(buddy < block)
+            block = buddy;
+        order++;
+    }
+    pmem_push(region, block, order);
+}
@@ -0,0 +1,44 @@
+#ifndef PMEM_H
+#define PMEM_H
+
+#include "../stdlib.h"
+#include "./vmem.h"
+
+//Settings
+
+//Largest block order (blocks of 2^order frames)
+#define PMEM_MAX_ORDER                      10
+#define PMEM_MAX_REGIONS                    128
+
+//Marks the end of a free list
+#define PMEM_NONE                           0xFFFFFFFFFFFFFFFFULL
+
+//Structure definitions
+
+/*
+ * A free block header, stored in the first frame of the block itself
+ */
+typedef struct {
+    uint64_t next;
+    uint64_t prev;
+    uint64_t order;
+} pmem_node_t;
+
+/*
+ * A range of frames managed by the allocator
+ */
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t bitmap;
+} pmem_region_t;
+
+//Function prototypes
+
+void        pmem_add_range  (phys_addr_t start, uint64_t size);
+phys_addr_t pmem_alloc      (uint8_t order);
+void        pmem_free       (phys_addr_t addr, uint8_t order);
+uint8_t     pmem_order      (uint64_t frames);
+uint64_t    pmem_free_bytes (void);
+
+#endif
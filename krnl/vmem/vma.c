@@ -0,0 +1,272 @@
+//Neutron Project
+//VMA - Virtual memory areas of user address spaces
+
+#include "./vma.h"
+#include "../stdlib.h"
+#include "../slab.h"
+
+//Areas are kept in an AVL tree ordered by their start address. Each node also
+//  knows the span of its subtree and the largest gap between two neighbouring
+//  areas inside it, so the search for a free range can skip every subtree that
+//  has no gap large enough and finish in O(log n).
+
+slab_cache_t vma_cache;
+
+/*
+ * Initializes the area allocator
+ */
+void vma_init(void){
+    slab_init_cache(&vma_cache, "vma", sizeof(vma_t), 8, NULL);
+}
+
+/*
+ * Returns the larger of two values
+ */
+static inline uint64_t vma_max(uint64_t a, uint64_t b){
+    return (a > b) ? a : b;
+}
+
+/*
+ * Returns the height of a subtree
+ */
+static inline uint8_t vma_height(vma_t* node){
+    return (node == NULL) ? 0 : node->height;
+}
+
+/*
+ * Recalculates the height, span and largest gap of a node from its children
+ */
+static void vma_update(vma_t* node){
+    vma_t* l = node->left;
+    vma_t* r = node->right;
+    uint8_t lh = vma_height(l), rh = vma_height(r);
+    node->height = ((lh > rh) ? lh : rh) + 1;
+    node->sub_start = (l != NULL) ? l->sub_start : node->start;
+    node->sub_end = (r != NULL) ? r->sub_end : node->end;
+    uint64_t gap = 0;
+    if(l != NULL){
+        gap = vma_max(gap, l->max_gap);
+        gap = vma_max(gap, node->start - l->sub_end);
+    }
+    if(r != NULL){
+        gap = vma_max(gap, r->max_gap);
+        gap = vma_max(gap, r->sub_start - node->end);
+    }
+    node->max_gap = gap;
+}
+
+/*
+ * Rotates a subtree to the right, returns its new root
+ */
+static vma_t* vma_rotate_right(vma_t* node){
+    vma_t* root = node->left;
+    node->left = root->right;
+    root->right = node;
+    vma_update(node);
+    vma_update(root);
+    return root;
+}
+
+/*
+ * Rotates a subtree to the left, returns its new root
+ */
+static vma_t* vma_rotate_left(vma_t* node){
+    vma_t* root = node->right;
+    node->right = root->left;
+    root->left = node;
+    vma_update(node);
+    vma_update(root);
+    return root;
+}
+
+/*
+ * Updates a node and restores the balance of its subtree, returns its new root
+ */
+static vma_t* vma_balance(vma_t* node){
+    vma_update(node);
+    int32_t diff = (int32_t)vma_height(node->left) - (int32_t)vma_height(node->right);
+    if(diff > 1){
+        if(vma_height(node->left->left) < vma_height(node->left->right))
+            node->left = vma_rotate_left(node->left);
+        return vma_rotate_right(node);
+    }
+    if(diff < -1){
+        if(vma_height(node->right->right) < vma_height(node->right->left))
+            node->right = vma_rotate_right(node->right);
+        return vma_rotate_left(node);
+    }
+    return node;
+}
+
+/*
+ * Inserts a node into a subtree, returns its new root
+ */
+static vma_t* vma_insert_node(vma_t* root, vma_t* node){
+    if(root == NULL)
+        return node;
+    if(node->start < root->start)
+        root->left = vma_insert_node(root->left, node);
+    else
+        root->right = vma_insert_node(root->right, node);
+    return vma_balance(root);
+}
+
+/*
+ * Detaches the leftmost node of a subtree and stores it in `min`, returns the new root
+ */
+static vma_t* vma_remove_min(vma_t* root, vma_t** min){
+    if(root->left == NULL){
+        *min = root;
+        return root->right;
+    }
+    root->left = vma_remove_min(root->left, min);
+    return vma_balance(root);
+}
+
+/*
+ * Removes a node from a subtree, returns its new root
+ */
+static vma_t* vma_remove_node(vma_t* root, vma_t* node){
+    if(root == NULL)
+        return NULL;
+    if(node->start < root->start){
+        root->left = vma_remove_node(root->left, node);
+    } else if(node->start > root->start){
+        root->right = vma_remove_node(root->right, node);
+    } else {
+        //Replace the node with the leftmost node of its right subtree
+        if(root->right == NULL)
+            return root->left;
+        vma_t* min;
+        vma_t* right = vma_remove_min(root->right, &min);
+        min->left = root->left;
+        min->right = right;
+        root = min;
+    }
+    return vma_balance(root);
+}
+
+/*
+ * Returns the area that contains an address, NULL if there's none
+ */
+vma_t* vma_find(vma_tree_t* tree, uint64_t addr){
+    vma_t* node = tree->root;
+    while(node != NULL){
+        if(addr < node->start)
+            node = node->left;
+        else if(addr >= node->end)
+            node = node->right;
+        else
+            return node;
+    }
+    return NULL;
+}
+
+/*
+ * Returns the area with the lowest address, NULL if there's none
+ */
+vma_t* vma_first(vma_tree_t* tree){
+    vma_t* node = tree->root;
+    if(node == NULL)
+        return NULL;
+    while(node->left != NULL)
+        node = node->left;
+    return node;
+}
+
+/*
+ * Returns the area that follows another one, NULL if it's the last one
+ */
+vma_t* vma_next(vma_tree_t* tree, vma_t* vma){
+    vma_t* next = NULL;
+    vma_t* node = tree->root;
+    while(node != NULL){
+        if(node->start > vma->start){
+            next = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return next;
+}
+
+/*
+ * Creates an area covering a range of addresses
+ * Returns NULL if the range overlaps another area or there's not enough memory
+ */
+vma_t* vma_insert(vma_tree_t* tree, uint64_t start, uint64_t end){
+    if(end <= start)
+        return NULL;
+    //Check that the range is free: no area may start inside it
+    //  or contain its first byte
+    if(vma_find(tree, start) != NULL)
+        return NULL;
+    vma_t* next = tree->root;
+    while(next != NULL && !(next->start > start && next->start < end))
+        next = (start < next->start) ? next->left : next->right;
+    if(next != NULL)
+        return NULL;
+    //Create the node
+    vma_t* vma = (vma_t*)slab_zalloc(&vma_cache);
+    if(vma == NULL)
+        return NULL;
+    vma->start = start;
+    vma->end = end;
+    vma->height = 1;
+    vma->sub_start = start;
+    vma->sub_end = end;
+    tree->root = vma_insert_node(tree->root, vma);
+    tree->count++;
+    return vma;
+}
+
+/*
+ * Removes an area and frees it
+ */
+void vma_remove(vma_tree_t* tree, vma_t* vma){
+    tree->root = vma_remove_node(tree->root, vma);
+    tree->count--;
+    slab_free(&vma_cache, vma);
+}
+
+/*
+ * Returns the lowest address not below `lo` at which `size` bytes fit into a gap inside a subtree,
+ *   0 if there's none
+ */
+static uint64_t vma_find_gap(vma_t* node, uint64_t lo, uint64_t size){
+    //Skip subtrees that don't have a large enough gap or whose gaps all lie below the bound
+    if(node == NULL || node->max_gap < size || node->sub_end <= lo)
+        return 0;
+    //Look at the gaps in the address order
+    uint64_t addr = vma_find_gap(node->left, lo, size);
+    if(addr != 0)
+        return addr;
+    if(node->left != NULL){
+        addr = vma_max(node->left->sub_end, lo);
+        if(addr + size <= node->start)
+            return addr;
+    }
+    if(node->right != NULL){
+        addr = vma_max(node->end, lo);
+        if(addr + size <= node->right->sub_start)
+            return addr;
+    }
+    return vma_find_gap(node->right, lo, size);
+}
+
+/*
+ * Finds the lowest range of `size` bytes between `lo` and `hi` that doesn't overlap any area
+ * Returns its start or 0 if there's no such range
+ */
+uint64_t vma_find_free(vma_tree_t* tree, uint64_t lo, uint64_t hi, uint64_t size){
+    vma_t* root = tree->root;
+    uint64_t addr = lo;
+    if(root != NULL && addr + size > root->sub_start){
+        //Look at the gaps between the areas, then past the last one
+        addr = vma_find_gap(root, lo, size);
+        if(addr == 0)
+            addr = vma_max(root->sub_end, lo);
+    }
+    return (addr + size <= hi) ? addr : 0;
+}
@@ -0,0 +1,56 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include "../stdlib.h"
+#include "../drivers/disk/diskio.h"
+#include "./vmem.h"
+
+//Structure definitions
+
+/*
+ * A virtual memory area: a range of pages of a user address space that is backed by memory on demand
+ * Pages in it are mapped on first access. They're filled with data from `file`
+ *   (`file_size` bytes starting at `file_offs` go to `origin`) and with zeroes past that
+ * If `frames` is set, the pages are shared with other tasks, one frame per page starting at `origin`.
+ *   Writable shared pages are copied on the first write
+ */
+typedef struct _vma_s {
+    uint64_t start;
+    uint64_t end;
+
+    uint64_t origin;
+    file_handle_t* file;
+    uint64_t file_offs;
+    uint64_t file_size;
+    uint8_t writable;
+    phys_addr_t* frames;
+
+    //AVL tree links, ordered by the start address
+    struct _vma_s* left;
+    struct _vma_s* right;
+    uint8_t height;
+    //Span of the subtree and the largest unmapped gap inside it
+    uint64_t sub_start;
+    uint64_t sub_end;
+    uint64_t max_gap;
+} vma_t;
+
+/*
+ * The set of areas of an address space
+ */
+typedef struct {
+    vma_t* root;
+    uint64_t count;
+} vma_tree_t;
+
+//Function prototypes
+
+void     vma_init      (void);
+vma_t*   vma_insert    (vma_tree_t* tree, uint64_t start, uint64_t end);
+void     vma_remove    (vma_tree_t* tree, vma_t* vma);
+vma_t*   vma_find      (vma_tree_t* tree, uint64_t addr);
+vma_t*   vma_first     (vma_tree_t* tree);
+vma_t*   vma_next      (vma_tree_t* tree, vma_t* vma);
+uint64_t vma_find_free (vma_tree_t* tree, uint64_t lo, uint64_t hi, uint64_t size);
+
+#endif
@@ -6,38 +6,45 @@
 #include <efilib.h>
 #include "./vmem.h"
 #include "../stdlib.h"
+#include "./pmem.h"
 #include "../cpuid.h"
 #include "../drivers/gfx.h"
 #include "../krnl.h"
 
 //A flag that indicates whether PCIDs are supported or not
 uint8_t pcid_supported = 0;
-//The next available PCID
-uint16_t pcid_next = 0;
+//A flag that indicates whether 1 GiB pages are supported or not
+uint8_t huge_supported = 0;
+//A flag that indicates whether INVPCID is supported or not
+uint8_t invpcid_supported = 0;
+//PCID allocator state
+uint16_t pcid_next = 1;
+uint64_t pcid_generation = 1;
+uint64_t pcid_owner[4096];
+uint64_t pcid_owner_gen[4096];
+uint8_t  pcid_stale[4096];
+vmem_pcid_stats_t pcid_stats;
+//Protects the PCID allocator state, CPUs switch address spaces concurrently
+spinlock_t pcid_lock = 0;
 //Is the virtual memory space identity mapped?
 uint8_t trans_disbl = 1;
-//Let physwindow requests directly through?
-uint8_t physwin_disbl = 1;
-
-uint64_t vmem_ident_cr3;
-
-//Let's talk about "physwindows" a little bit.
-//So, suppose you want to write to a physical memory location for some reason
-//  (for example, to set up page tables and what not)
-//But oh no - your current virtual space isn't identity mapped! What are you gonna do?
-//The solution I came up with is to make two pages at the end of the virtual space
-//  special. The first page is the 4kB "window" that is mapped to a specific physical
-//  address range. The second page is mapped to the page table that contains an entry
-//  for the page discussed above. So, if you want to access a physical memory location,
-//  the steps are:
-//1. Modify the PT entry through the second page so that it points to the page to which your
-//   desired address belongs to
-//2. Calculate the offset into the page
-//3. Perform the access through the first page
-//4. Forget about this madness forever
-//Addresses for these special pages are:
-//1 - 0xFFFFFFFFFFFFB000
-//2 - 0xFFFFFFFFFFFFD000
+//Is the direct physical map set up?
+uint8_t dmap_enabled = 0;
+
+//The address space the kernel was booted in
+uint64_t vmem_boot_cr3;
+//Counters of the last mapping operation
+vmem_stats_t vmem_stats;
+//Physical ranges covered by the direct map
+vmem_dmap_range_t dmap_ranges[VMEM_DMAP_MAX_RANGES];
+uint32_t dmap_range_cnt = 0;
+
+//All of physical RAM is mapped at VMEM_DMAP_BASE + (physical address) in every
+//  address space using large pages, so any physical location (like a paging
+//  structure of a different address space) can be accessed with a simple
+//  pointer instead of remapping something and flushing the TLB.
+//Before the direct map is built the boot address space is identity mapped,
+//  so the physical address itself is used.
 
 /*
  * Enables the virtual-to-physical address tanslation
@@ -46,13 +53,6 @@ void vmem_enable_trans(void){
     trans_disbl = 0;
 }
 
-/*
- * Enables the physwindow
- */
-void vmem_enable_physwin(void){
-    physwin_disbl = 0;
-}
-
 /*
  * Are process context identifiers supported?
  */
@@ -75,92 +75,107 @@ void vmem_flush_tlb(void){
 }
 
 /*
- * Initializes the physwin so address `addr` can be read through it
- * Returns the remaining offset into the window
- * If you have no idea what physwin means, read that giant comment at the top of the file
- */
-uint64_t vmem_physwin_set(phys_addr_t addr){
-    uint64_t pt_idx = 0x1FB;
-    virt_addr_t pte_addr = (virt_addr_t)(0xFFFFFFFFFFFFD000 + (pt_idx * 8));
-    //Calculate physwin start and offset into physwin
-    phys_addr_t win_start = (phys_addr_t)((uint64_t)addr - ((uint64_t)addr % 4096));
-    uint64_t offs = (uint64_t)addr - (uint64_t)win_start;
-    //Generate the PT entry
-    uint64_t pte = 0;
-    pte |= (1 << 0); //it's present
-    pte |= (1 << 1); //writes are allowed
-    pte &= ~((1 << 3) | (1 << 4)); //enable caching on access to this page
-    pte |= (uint64_t)win_start; //set the address
-    //Write it
-    *(uint64_t*)pte_addr = pte;
-    vmem_flush_tlb();
-    //Do the same for the next page
-    win_start = (phys_addr_t)((uint64_t)win_start + 4096);
-    pte = 0;
-    pte |= (1 << 0);
-    pte |= (1 << 1);
-    pte &= ~((1 << 3) | (1 << 4));
-    pte |= (uint64_t)win_start;
-    pte_addr = (virt_addr_t)((uint64_t)pte_addr + 8);
-    *(uint64_t*)pte_addr = pte;
-    vmem_flush_tlb();
-    return offs;
-}
-
-/*
- * Writes a 32-bit value to a physical address using physwin
- */
-void vmem_physwin_write32(phys_addr_t addr, uint32_t val){
-    //Assume the virtual space is identity mapped if this function is disabled
-    if(physwin_disbl){
-        *(uint32_t*)addr = val;
-        return;
-    }
-    //Set the window
-    uint64_t offs = vmem_physwin_set(addr);
-    //Write the value
-    *(uint32_t*)(0xFFFFFFFFFFFFB000 + offs) = val;
+ * Returns the address a physical location can be accessed at
+ */
+void* vmem_phys_to_virt(phys_addr_t addr){
+    if(!dmap_enabled)
+        return addr;
+    return (void*)(VMEM_DMAP_BASE + (uint64_t)addr);
+}
+
+/*
+ * Writes a 64-bit value to a physical address
+ */
+void vmem_phys_write64(phys_addr_t addr, uint64_t val){
+    *(uint64_t*)vmem_phys_to_virt(addr) = val;
 }
 
 /*
- * Reads a 32-bit value from a physical address using physwin
+ * Reads a 64-bit value from a physical address
  */
-uint32_t vmem_physwin_read32(phys_addr_t addr){
-    //Assume the virtual space is identity mapped if this function is disabled
-    if(physwin_disbl)
-        return *(uint32_t*)addr;
-    //Set the window
-    uint64_t offs = vmem_physwin_set(addr);
-    //Read the value
-    return *(uint32_t*)(0xFFFFFFFFFFFFB000 + offs);
+uint64_t vmem_phys_read64(phys_addr_t addr){
+    return *(uint64_t*)vmem_phys_to_virt(addr);
 }
 
 /*
- * Writes a 64-bit value to a physical address using physwin
+ * Adds a range of physical RAM to the direct map
+ * Has to be called before the direct map is built
  */
-void vmem_physwin_write64(phys_addr_t addr, uint64_t val){
-    //Assume the virtual space is identity mapped if this function is disabled
-    if(physwin_disbl){
-        *(uint64_t*)addr = val;
+void vmem_dmap_add(phys_addr_t start, uint64_t size){
+    //Round the range to large pages
+    uint64_t st = (uint64_t)start & ~(VMEM_LARGE_PAGE - 1);
+    uint64_t end = ((uint64_t)start + size + VMEM_LARGE_PAGE - 1) & ~(VMEM_LARGE_PAGE - 1);
+    //Merge it with an existing range if they touch
+    for(uint32_t i = 0; i < dmap_range_cnt; i++){
+        if(st <= dmap_ranges[i].end && end >= dmap_ranges[i].start){
+            if(st < dmap_ranges[i].start)
+                dmap_ranges[i].start = st;
+            if(end > dmap_ranges[i].end)
+                dmap_ranges[i].end = end;
+            return;
+        }
+    }
+    if(dmap_range_cnt >= VMEM_DMAP_MAX_RANGES){
+        krnl_writec_f("Too many direct map ranges, ignoring 0x%x-0x%x\r\n", st, end);
         return;
     }
-    //Set the window
-    uint64_t offs = vmem_physwin_set(addr);
-    //Write the value
-    *(uint64_t*)(0xFFFFFFFFFFFFB000 + offs) = val;
+    dmap_ranges[dmap_range_cnt].start = st;
+    dmap_ranges[dmap_range_cnt].end = end;
+    dmap_range_cnt++;
+}
+
+/*
+ * Adds the paging structures of an identity mapped address space to the direct map
+ * The firmware may have put them in memory that isn't reported as RAM
+ */
+static void vmem_dmap_add_tables(uint64_t cr3){
+    uint64_t* pml4 = (uint64_t*)(cr3 & 0x7FFFFFFFFFFFF000);
+    vmem_dmap_add((phys_addr_t)pml4, 4096);
+    for(int i = 0; i < 512; i++){
+        if(!(pml4[i] & 1))
+            continue;
+        uint64_t* pdpt = (uint64_t*)(pml4[i] & 0x7FFFFFFFFFFFF000);
+        vmem_dmap_add((phys_addr_t)pdpt, 4096);
+        for(int j = 0; j < 512; j++){
+            //Skip 1 GiB pages
+            if(!(pdpt[j] & 1) || (pdpt[j] & (1 << 7)))
+                continue;
+            uint64_t* pd = (uint64_t*)(pdpt[j] & 0x7FFFFFFFFFFFF000);
+            vmem_dmap_add((phys_addr_t)pd, 4096);
+            for(int k = 0; k < 512; k++){
+                //Skip 2 MiB pages
+                if(!(pd[k] & 1) || (pd[k] & (1 << 7)))
+                    continue;
+                vmem_dmap_add((phys_addr_t)(pd[k] & 0x7FFFFFFFFFFFF000), 4096);
+            }
+        }
+    }
+}
+
+/*
+ * Builds the direct physical map in the specified address space
+ */
+void vmem_dmap_build(uint64_t cr3){
+    vmem_dmap_add_tables(cr3);
+    uint64_t total = 0;
+    for(uint32_t i = 0; i < dmap_range_cnt; i++){
+        vmem_map(cr3, (phys_addr_t)dmap_ranges[i].start, (phys_addr_t)dmap_ranges[i].end,
+                      (virt_addr_t)(VMEM_DMAP_BASE + dmap_ranges[i].start));
+        total += dmap_ranges[i].end - dmap_ranges[i].start;
+    }
+    dmap_enabled = 1;
+    krnl_writec_f("Direct map covers 0x%x bytes in %d ranges\r\n", total, dmap_range_cnt);
 }
 
 /*
- * Reads a 64-bit value from a physical address using physwin
+ * Allocates a cleared page-aligned paging structure, returns its physical address
  */
-uint64_t vmem_physwin_read64(phys_addr_t addr){
-    //Assume the virtual space is identity mapped if this function is disabled
-    if(physwin_disbl)
-        return *(uint64_t*)addr;
-    //Set the window
-    uint64_t offs = vmem_physwin_set(addr);
-    //Read the value
-    return *(uint64_t*)(0xFFFFFFFFFFFFB000 + offs);
+phys_addr_t vmem_alloc_table(void){
+    phys_addr_t table = pmem_alloc(0);
+    if(table == NULL)
+        gfx_panic(0, KRNL_PANIC_NOMEM_CODE);
+    memset(vmem_phys_to_virt(table), 0, 4096);
+    return table;
 }
 
 /*
@@ -186,227 +201,249 @@ void vmem_init(void){
     if(pcid_supported)
         cr4 |= (1 << 17); //Then enable it
     krnl_writec_f("PCIDs are %ssupported\r\n", pcid_supported ? "" : "not ");
+    //Detect if INVPCID is supported
+    uint32_t max_leaf, ebx7;
+    cpuid_get_vendor((char[13]){0}, &max_leaf);
+    if(max_leaf >= 7){
+        cpuid_get_leaf(7, 0, NULL, &ebx7, NULL, NULL);
+        invpcid_supported = pcid_supported && (ebx7 & CPUID_FEAT7_EBX_INVPCID);
+    }
+    krnl_writec_f("INVPCID is %ssupported\r\n", invpcid_supported ? "" : "not ");
+    //Detect if 1 GiB pages are supported
+    uint32_t ext_max, ext_edx;
+    cpuid_get_leaf(0x80000000, 0, &ext_max, NULL, NULL, NULL);
+    if(ext_max >= 0x80000001){
+        cpuid_get_leaf(0x80000001, 0, NULL, NULL, NULL, &ext_edx);
+        huge_supported = (ext_edx & CPUID_EXT_FEAT_EDX_PAGE1GB) > 0;
+    }
+    krnl_writec_f("1 GiB pages are %ssupported\r\n", huge_supported ? "" : "not ");
     cr4 &= ~((1ULL << 21) | (1ULL << 22)); //Disable SMAP and PKE
     __asm__ volatile("mov %0, %%cr4" : : "r" (cr4));
 
     //Disable write protection for supervisor access
-    uint64_t cr0;
-    __asm__ volatile("mov %%cr0, %0" : "=r" (cr0));
-    cr0 &= ~(1 << 16);
-    __asm__ volatile("mov %0, %%cr0" : : "r" (cr0));
+    //  (firmware may have mapped some of the memory we're writing to as read-only)
+    vmem_write_protect(0);
     krnl_writec_f("Disabled write protection for ring 0\r\n");
 
-    vmem_ident_cr3 = vmem_get_cr3();
-    krnl_writec_f("Boot CR3=0x%x\r\n", vmem_ident_cr3);
+    vmem_boot_cr3 = vmem_get_cr3();
+    krnl_writec_f("Boot CR3=0x%x\r\n", vmem_boot_cr3);
 }
 
 /*
- * Creates a PML4 structure, returns a value that can be entered into CR3
+ * Enables or disables write protection for supervisor access
+ * It has to be enabled for the kernel to fault on writes to shared user pages
  */
-uint64_t vmem_create_pml4(uint16_t pcid){
-    uint64_t cr3 = 0;
-    phys_addr_t pml4 = vmem_virt_to_phys(vmem_get_cr3(), calloc(8192, 1)); //allocate 8 kB even though we only need 4
-    pml4 = (uint8_t*)pml4 + 4096 - ((uint64_t)pml4 % 4096); //align by 4 kB
-    //Set the PML4 pointer
-    cr3 = (uint64_t)pml4;
-    //Set the PCID
-    if(pcid_supported)
-        cr3 |= pcid & 0x0FFF; //only let the lower 12 bits through
-    return cr3;
+void vmem_write_protect(uint8_t enable){
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r" (cr0));
+    if(enable)
+        cr0 |= 1 << 16;
+    else
+        cr0 &= ~(1 << 16);
+    __asm__ volatile("mov %0, %%cr0" : : "r" (cr0));
 }
 
 /*
- * Creates a PDPT (page directory pointer table) structure that
- *   can be accessed using the specific "at" mask and CR3 value
- */
-void vmem_create_pdpt(uint64_t cr3, virt_addr_t at){
-    //Extract PML4 address from CR3
-    phys_addr_t pml4_addr = (phys_addr_t)(cr3 & 0xFFFFFFFFFFFFF000);
-    //Extract entry index from "at"
-    uint64_t pml4e_idx = ((uint64_t)at >> 39) & 0x1FF;
-    //Calculate the address of the entry
-    phys_addr_t pml4e_addr = (uint8_t*)pml4_addr + (pml4e_idx * 8);
-    //Allocate space for the PDPT
-    phys_addr_t pdpt = vmem_virt_to_phys(vmem_get_cr3(), calloc(8192, 1)); //allocate 8 kB even though we only need 4
-    pdpt = (uint8_t*)pdpt + 4096 - ((uint64_t)pdpt % 4096); //align by 4 kB
-    //Generate the entry
-    uint64_t pml4e = 0;
-    pml4e |= (1 << 0); //it's present
-    pml4e |= (1 << 1); //writes are allowed
-    pml4e |= (1 << 2); //user access is allowed
-    pml4e &= ~((1 << 3) | (1 << 4)); //enable caching on access to this PDPT
-    pml4e &= ~(1 << 5); //clear the "accessed" bit
-    pml4e |= (uint64_t)pdpt & 0xFFFFFFFFFFFFF000; //set the address
-    pml4e &= ~(1ULL << 63); //allow instruction fetching
-    //Set the entry
-    vmem_physwin_write64(pml4e_addr, pml4e);
+ * Creates a PML4 structure, returns a value that can be entered into CR3
+ * A PCID is assigned to it when it's switched to for the first time
+ */
+uint64_t vmem_create_pml4(void){
+    return (uint64_t)vmem_alloc_table();
+}
+
+//PCIDs are handed out to address spaces on demand, when they're switched to.
+//  PCID 0 always belongs to the boot address space. When all the others are used up,
+//  a new generation starts: every PCID handed out during the previous one is considered
+//  free again and the address spaces that had them get new ones when they're switched
+//  to next time. A PCID is flushed the first time it's loaded after being handed out,
+//  so that nothing from its previous owner survives. All other loads don't flush.
+
+/*
+ * Returns the PCID an address space currently has, or -1 if it has none
+ */
+static int32_t vmem_pcid_of(uint64_t cr3){
+    uint64_t pml4 = cr3 & VMEM_PTE_ADDR;
+    uint16_t pcid = cr3 & 0xFFF;
+    if(pcid == 0)
+        return (pml4 == (vmem_boot_cr3 & VMEM_PTE_ADDR)) ? 0 : -1;
+    if(pcid_owner[pcid] == pml4 && pcid_owner_gen[pcid] == pcid_generation)
+        return pcid;
+    return -1;
+}
+
+/*
+ * Returns the value that has to be loaded into CR3 to switch to an address space:
+ *   the PML4 address, the PCID and the no-flush bit if the TLB entries tagged with
+ *   that PCID are still valid
+ * The new PCID (if one had to be assigned) has to be saved by the caller
+ */
+uint64_t vmem_switch_cr3(uint64_t cr3){
+    if(!pcid_supported)
+        return cr3 & VMEM_PTE_ADDR;
+    uint64_t pml4 = cr3 & VMEM_PTE_ADDR;
+    spinlock_acquire(&pcid_lock);
+    int32_t pcid = vmem_pcid_of(cr3);
+    if(pcid < 0){
+        //Start a new generation if we've run out of PCIDs
+        if(pcid_next > 0xFFF){
+            pcid_generation++;
+            pcid_next = 1;
+            pcid_stats.generations++;
+        }
+        pcid = pcid_next++;
+        pcid_owner[pcid] = pml4;
+        pcid_owner_gen[pcid] = pcid_generation;
+        pcid_stale[pcid] = 1;
+        pcid_stats.assigned++;
+    }
+    //Flush the entries tagged with this PCID if they may be stale
+    uint64_t flush = pcid_stale[pcid];
+    if(flush){
+        pcid_stale[pcid] = 0;
+        pcid_stats.flushing_loads++;
+    } else {
+        pcid_stats.noflush_loads++;
+    }
+    spinlock_release(&pcid_lock);
+    return pml4 | pcid | (flush ? 0 : VMEM_CR3_NOFLUSH);
 }
 
 /*
- * Checks if PDPT is present
+ * Invalidates TLB entries using the INVPCID instruction
  */
-uint8_t vmem_present_pdpt(uint64_t cr3, virt_addr_t at){
-    //Extract PML4 address from CR3
-    phys_addr_t pml4_addr = (phys_addr_t)(cr3 & 0xFFFFFFFFFFFFF000);
-    //Extract PML4 entry index from "at"
-    uint64_t pml4e_idx = ((uint64_t)at >> 39) & 0x1FF;
-    //Check its "present" bit
-    return vmem_physwin_read64((uint8_t*)pml4_addr + (pml4e_idx * 8)) & 1;
+static inline void vmem_invpcid(uint64_t type, uint16_t pcid, uint64_t addr){
+    struct { uint64_t pcid; uint64_t addr; } __attribute__((packed)) desc = {pcid, addr};
+    __asm__ volatile("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
 }
 
 /*
- * Returns the physical address of the PDPT that maps a specific address
+ * Returns the PCID statistics
  */
-phys_addr_t vmem_addr_pdpt(uint64_t cr3, virt_addr_t at){
-    //Extract PML4 address from CR3
-    phys_addr_t pml4_addr = (phys_addr_t)(cr3 & 0xFFFFFFFFFFFFF000);
-    //Extract PML4 entry index from "at"
-    uint64_t pml4e_idx = ((uint64_t)at >> 39) & 0x1FF;
-
-    //Extract PDPT entry address
-    return (phys_addr_t)(vmem_physwin_read64((uint8_t*)pml4_addr + (pml4e_idx * 8)) & 0x7FFFFFFFFFFFF000);
+vmem_pcid_stats_t vmem_get_pcid_stats(void){
+    return pcid_stats;
 }
 
 
-
+//Paging structures are walked from the PML4 (level 3) down to the PT (level 0).
+//An entry at level 2 (PDPT) or 1 (PD) may map a 1 GiB or a 2 MiB page directly
+//  instead of pointing to a lower-level table. Ranges are mapped with the largest
+//  pages their alignment allows. When a part of a large page has to be remapped or
+//  unmapped, the large page is split into 512 smaller ones first.
+//Ranges are mapped and unmapped in a single pass over the hierarchy: each table
+//  is visited once and the entries in it are filled in a loop. The pages that
+//  used to be mapped are invalidated in one go after the pass.
 
 /*
- * Creates a PD (page directory) structure that
- *   can be accessed using the specific "at" mask and CR3 value
+ * Returns the index of the entry at a specific level that maps an address
  */
-void vmem_create_pd(uint64_t cr3, virt_addr_t at){
-    //Check if that entry is present
-    if(!vmem_present_pdpt(cr3, at))
-        vmem_create_pdpt(cr3, at); //Create it if not
-    
-    //Allocate space for the PD
-    phys_addr_t pd = vmem_virt_to_phys(vmem_get_cr3(), calloc(8192, 1)); //allocate 8 kB even though we only need 4
-    pd = (uint8_t*)pd + 4096 - ((uint64_t)pd % 4096); //align by 4 kB
-    //Extract entry index from "at"
-    uint64_t pdpte_idx = ((uint64_t)at >> 30) & 0x1FF;
-    //Calculate the address of the entry
-    phys_addr_t pdpte_addr = (uint8_t*)vmem_addr_pdpt(cr3, at) + (pdpte_idx * 8);
-    //Generate the entry
-    uint64_t pdpte = 0;
-    pdpte |= (1 << 0); //it's present
-    pdpte |= (1 << 1); //writes are allowed
-    pdpte |= (1 << 2); //user access is allowed
-    pdpte &= ~((1 << 3) | (1 << 4)); //enable caching on access to this PD
-    pdpte &= ~(1 << 5); //clear the "accessed" bit
-    pdpte |= (uint64_t)pd & 0xFFFFFFFFFFFFF000; //set the address
-    pdpte &= ~(1ULL << 63); //allow instruction fetching
-    //Set the entry
-    vmem_physwin_write64(pdpte_addr, pdpte);
+static inline uint64_t vmem_idx(virt_addr_t at, uint8_t level){
+    return ((uint64_t)at >> (12 + (9 * level))) & 0x1FF;
 }
 
 /*
- * Checks if PD is present
+ * Returns the size of a page mapped by an entry at a specific level
  */
-uint8_t vmem_present_pd(uint64_t cr3, virt_addr_t at){
-    //Extract PDPT address
-    phys_addr_t pdpt = vmem_addr_pdpt(cr3, at);
-    //Calculate the entry index
-    uint64_t pdpte_idx = ((uint64_t)at >> 30) & 0x1FF;
-    //Check its "present" bit
-    return vmem_physwin_read64((uint8_t*)pdpt + (pdpte_idx * 8)) & 1;
+static inline uint64_t vmem_page_size(uint8_t level){
+    return 4096ULL << (9 * level);
 }
 
 /*
- * Returns the physical address of the PD that maps a specific address
+ * Returns a pointer to the table an entry points to
  */
-phys_addr_t vmem_addr_pd(uint64_t cr3, virt_addr_t at){
-    //Extract PDPT address
-    phys_addr_t pdpt = vmem_addr_pdpt(cr3, at);
-    //Calculate the entry index
-    uint64_t pdpte_idx = ((uint64_t)at >> 30) & 0x1FF;
-    //Extract its address
-    return (phys_addr_t)(vmem_physwin_read64((uint8_t*)pdpt + (pdpte_idx * 8)) & 0x7FFFFFFFFFFFF000);
+static inline uint64_t* vmem_table(uint64_t entry){
+    return (uint64_t*)vmem_phys_to_virt((phys_addr_t)(entry & VMEM_PTE_ADDR));
 }
 
-
-
-
 /*
- * Creates a PT (page table) structure that
- *   can be accessed using the specific "at" mask and CR3 value
+ * Splits a large page into a table of 512 smaller pages with the same attributes
  */
-void vmem_create_pt(uint64_t cr3, virt_addr_t at){
-    //Check if that entry is present
-    if(!vmem_present_pd(cr3, at))
-        vmem_create_pd(cr3, at); //Create it if not
-    
-    //Allocate space for the PT
-    phys_addr_t pt = vmem_virt_to_phys(vmem_get_cr3(), calloc(8192, 1)); //allocate 8 kB even though we only need 4
-    pt = (uint8_t*)pt + 4096 - ((uint64_t)pt % 4096); //align by 4 kB
-    //Extract entry index from "at"
-    uint64_t pde_idx = ((uint64_t)at >> 21) & 0x1FF;
-    //Calculate the address of the entry
-    phys_addr_t pde_addr = (uint8_t*)vmem_addr_pd(cr3, at) + (pde_idx * 8);
-    //Generate the entry
-    uint64_t pde = 0;
-    pde |= (1 << 0); //it's present
-    pde |= (1 << 1); //writes are allowed
-    pde |= (1 << 2); //user access is allowed
-    pde &= ~((1 << 3) | (1 << 4)); //enable caching on access to this PT
-    pde &= ~(1 << 5); //clear the "accessed" bit
-    pde |= (uint64_t)pt & 0xFFFFFFFFFFFFF000; //set the address
-    pde &= ~(1ULL << 63); //allow instruction fetching
-    //Set the entry
-    vmem_physwin_write64(pde_addr, pde);
+static void vmem_split(uint64_t* entry, uint8_t level){
+    phys_addr_t table = vmem_alloc_table();
+    uint64_t* sub = (uint64_t*)vmem_phys_to_virt(table);
+    //Carry the attributes over
+    uint64_t base = *entry & VMEM_PTE_ADDR & ~(vmem_page_size(level) - 1);
+    uint64_t attr = *entry & ~VMEM_PTE_ADDR;
+    //The PAT bit is bit 12 in large pages, but bit 7 in regular ones
+    if(level == 1){
+        attr &= ~VMEM_PTE_LARGE;
+        if(*entry & VMEM_PTE_LARGE_PAT)
+            attr |= VMEM_PTE_PAT;
+    } else {
+        attr |= *entry & VMEM_PTE_LARGE_PAT;
+    }
+    for(uint64_t i = 0; i < 512; i++)
+        sub[i] = (base + (i * vmem_page_size(level - 1))) | attr;
+    //Point the entry to the new table
+    *entry = (uint64_t)table | VMEM_PTE_PRESENT | VMEM_PTE_WRITE | VMEM_PTE_USER;
+    vmem_stats.splits++;
 }
 
 /*
- * Checks if PT is present
+ * Frees the table (at a specific level) an entry points to and all tables below it
  */
-uint8_t vmem_present_pt(uint64_t cr3, virt_addr_t at){
-    //Extract PD address
-    phys_addr_t pd = vmem_addr_pd(cr3, at);
-    //Calculate the entry index
-    uint64_t pde_idx = ((uint64_t)at >> 21) & 0x1FF;
-    //Check its "present" bit
-    return vmem_physwin_read64((uint8_t*)pd + (pde_idx * 8)) & 1;
+static void vmem_free_table(uint64_t entry, uint8_t level){
+    uint64_t* table = vmem_table(entry);
+    if(level > 0){
+        for(int i = 0; i < 512; i++)
+            if((table[i] & VMEM_PTE_PRESENT) && !(table[i] & VMEM_PTE_LARGE))
+                vmem_free_table(table[i], level - 1);
+    }
+    pmem_free((phys_addr_t)(entry & VMEM_PTE_ADDR), 0);
 }
 
 /*
- * Returns the physical address of the PT that maps a specific address
+ * Returns a pointer to the entry at a specific level that maps an address,
+ *   creating the tables and splitting the large pages above it
  */
-phys_addr_t vmem_addr_pt(uint64_t cr3, virt_addr_t at){
-    //Extract PD address
-    phys_addr_t pd = vmem_addr_pd(cr3, at);
-    //Calculate the entry index
-    uint64_t pde_idx = ((uint64_t)at >> 21) & 0x1FF;
-    //Extract its address
-    return (phys_addr_t)(vmem_physwin_read64((uint8_t*)pd + (pde_idx * 8)) & 0x7FFFFFFFFFFFF000);
+static uint64_t* vmem_walk(uint64_t cr3, virt_addr_t at, uint8_t level){
+    uint64_t* table = vmem_table(cr3);
+    for(uint8_t l = 3; l > level; l--){
+        uint64_t* entry = &table[vmem_idx(at, l)];
+        if(!(*entry & VMEM_PTE_PRESENT))
+            *entry = (uint64_t)vmem_alloc_table() | VMEM_PTE_PRESENT | VMEM_PTE_WRITE | VMEM_PTE_USER;
+        else if(*entry & VMEM_PTE_LARGE)
+            vmem_split(entry, l);
+        table = vmem_table(*entry);
+    }
+    return &table[vmem_idx(at, level)];
 }
 
+/*
+ * Returns a pointer to the entry that maps an address, be it a page of any size
+ *   or a non-present entry
+ * The level of the entry is stored in `level`
+ */
+static uint64_t* vmem_lookup(uint64_t cr3, virt_addr_t at, uint8_t* level){
+    uint64_t* table = vmem_table(cr3);
+    for(uint8_t l = 3; ; l--){
+        uint64_t* entry = &table[vmem_idx(at, l)];
+        if(l == 0 || !(*entry & VMEM_PTE_PRESENT) || (l < 3 && (*entry & VMEM_PTE_LARGE))){
+            *level = l;
+            return entry;
+        }
+        table = vmem_table(*entry);
+    }
+}
 
-
+/*
+ * Sets an entry at a specific level to map a page of the corresponding size
+ */
+static void vmem_set_page(uint64_t cr3, virt_addr_t at, phys_addr_t from, uint8_t level, uint64_t attr){
+    uint64_t* entry = vmem_walk(cr3, at, level);
+    //Free the table this entry is replacing
+    if(level > 0 && (*entry & VMEM_PTE_PRESENT) && !(*entry & VMEM_PTE_LARGE))
+        vmem_free_table(*entry, level - 1);
+    if(level > 0)
+        attr |= VMEM_PTE_LARGE;
+    *entry = ((uint64_t)from & VMEM_PTE_ADDR) | attr;
+}
 
 /*
  * Creates a page mapped to a specific physical address that
  *   can be accessed using the specific "at" mask and CR3 value
  */
 void vmem_create_page(uint64_t cr3, virt_addr_t at, phys_addr_t from){
-    //Check if that entry is present
-    if(!vmem_present_pt(cr3, at))
-        vmem_create_pt(cr3, at); //Create it if not
-    
-    //Extract entry index from "at"
-    uint64_t pte_idx = ((uint64_t)at >> 12) & 0x1FF;
-    //Calculate the address of the entry
-    phys_addr_t pte_addr = (uint8_t*)vmem_addr_pt(cr3, at) + (pte_idx * 8);
-    //Generate the entry
-    uint64_t pte = 0;
-    pte |= (1 << 0); //it's present
-    pte |= (1 << 1); //writes are allowed
-    pte &= ~(1 << 2); //user access is notallowed
-    pte &= ~((1 << 3) | (1 << 4)); //enable caching on access to this page
-    pte &= ~(1 << 5); //clear the "accessed" bit
-    pte |= (uint64_t)from & 0xFFFFFFFFFFFFF000; //set the address
-    pte &= ~(1ULL << 63); //allow instruction fetching
-
-    //Set the entry
-    vmem_physwin_write64(pte_addr, pte);
+    vmem_set_page(cr3, at, from, 0, VMEM_PTE_PRESENT | VMEM_PTE_WRITE);
 }
 
 /*
@@ -414,128 +451,237 @@ void vmem_create_page(uint64_t cr3, virt_addr_t at, phys_addr_t from){
  *   can be accessed from userland using the specific "at" mask and CR3 value
  */
 void vmem_create_page_user(uint64_t cr3, virt_addr_t at, phys_addr_t from){
-    //Check if that entry is present
-    if(!vmem_present_pt(cr3, at))
-        vmem_create_pt(cr3, at); //Create it if not
-    
-    //Extract entry index from "at"
-    uint64_t pte_idx = ((uint64_t)at >> 12) & 0x1FF;
-    //Calculate the address of the entry
-    phys_addr_t pte_addr = (uint8_t*)vmem_addr_pt(cr3, at) + (pte_idx * 8);
-    //Generate the entry
-    uint64_t pte = 0;
-    pte |= (1 << 0); //it's present
-    pte |= (1 << 1); //writes are allowed
-    pte |= (1 << 2); //user access is allowed
-    pte &= ~((1 << 3) | (1 << 4)); //enable caching on access to this page
-    pte &= ~(1 << 5); //clear the "accessed" bit
-    pte |= (uint64_t)from & 0xFFFFFFFFFFFFF000; //set the address
-    pte &= ~(1ULL << 63); //allow instruction fetching
-
-    //Set the entry
-    vmem_physwin_write64(pte_addr, pte);
+    vmem_set_page(cr3, at, from, 0, VMEM_PTE_PRESENT | VMEM_PTE_WRITE | VMEM_PTE_USER);
 }
 
 /*
  * Checks if page is present
  */
 uint8_t vmem_present_page(uint64_t cr3, virt_addr_t at){
-    //Extract PT address
-    phys_addr_t pt = vmem_addr_pt(cr3, at);
-    //Calculate the entry index
-    uint64_t pte_idx = ((uint64_t)at >> 12) & 0x1FF;
-    //Check its "present" bit
-    return vmem_physwin_read64((uint8_t*)pt + (pte_idx * 8)) & 1;
+    uint8_t level;
+    return *vmem_lookup(cr3, at, &level) & VMEM_PTE_PRESENT;
+}
+
+/*
+ * Returns the entry that maps an address, be it a page of any size or a non-present entry
+ */
+uint64_t vmem_page_entry(uint64_t cr3, virt_addr_t at){
+    uint8_t level;
+    return *vmem_lookup(cr3, at, &level);
 }
 
 /*
  * Translates a virtual address into a physical one
+ * Returns NULL if the address isn't mapped
  */
 phys_addr_t vmem_virt_to_phys(uint64_t cr3, virt_addr_t at){
     if(trans_disbl)
         return (phys_addr_t)at;
-        
-    uint64_t p_cr3 = vmem_get_cr3();
-    vmem_set_cr3(vmem_ident_cr3);
-    uint8_t p_disbl = physwin_disbl;
-    physwin_disbl = 1;
-    
-    //Extract PT address
-    phys_addr_t pt = vmem_addr_pt(cr3, at);
-    //Calculate the entry index
-    uint64_t pte_idx = ((uint64_t)at >> 12) & 0x1FF;
-    //Extract its base address and add the offset
-    phys_addr_t res = (phys_addr_t*)((uint64_t)(vmem_physwin_read64((uint64_t*)pt + pte_idx) & 0x7FFFFFFFFFFFF000)
-                                   + (uint64_t)((uint64_t)at & 0xFFF));
-    
-    physwin_disbl = p_disbl;
-    vmem_set_cr3(p_cr3);
 
-    return res;
+    uint8_t level;
+    uint64_t entry = *vmem_lookup(cr3, at, &level);
+    if(!(entry & VMEM_PTE_PRESENT))
+        return NULL;
+    uint64_t offs_mask = vmem_page_size(level) - 1;
+    return (phys_addr_t)((entry & VMEM_PTE_ADDR & ~offs_mask) | ((uint64_t)at & offs_mask));
 }
 
 
 
 
 /*
- * Maps a virtual address range to a physical address range
+ * Queues the TLB invalidation of a page that has just been changed
  */
-void vmem_map(uint64_t cr3, phys_addr_t p_st, phys_addr_t p_end, virt_addr_t v_st){
-    uint64_t p_cr3 = vmem_get_cr3();
-    vmem_set_cr3(vmem_ident_cr3);
-    uint8_t p_disbl = physwin_disbl;
-    physwin_disbl = 1;
-
-    //Loop through the range
-    for(uint64_t offs = 0; offs < p_end - p_st; offs += 4096){
-        //Map one page
-        vmem_create_page(cr3, (uint8_t*)v_st + offs, (uint8_t*)p_st + offs);
+static inline void vmem_queue_inval(uint64_t virt, uint64_t size){
+    if(vmem_stats.inval_st == vmem_stats.inval_end)
+        vmem_stats.inval_st = virt;
+    vmem_stats.inval_end = virt + size;
+    vmem_stats.inval_pages++;
+}
+
+/*
+ * Invalidates the queued pages
+ * Single pages are invalidated if there are few of them, otherwise the whole
+ *   address space is flushed
+ */
+static void vmem_flush_queued(uint64_t cr3){
+    if(vmem_stats.inval_pages == 0)
+        return;
+    uint64_t span = (vmem_stats.inval_end - vmem_stats.inval_st) / 4096;
+    //The upper half is shared by all address spaces
+    if(vmem_stats.inval_end > VMEM_KRNL_HALF || vmem_stats.inval_end == 0){
+        if(invpcid_supported){
+            vmem_invpcid(2, 0, 0);
+        } else {
+            spinlock_acquire(&pcid_lock);
+            for(int i = 0; i < 4096; i++)
+                pcid_stale[i] = 1;
+            spinlock_release(&pcid_lock);
+            vmem_flush_tlb();
+        }
+        vmem_stats.flushes++;
+        return;
+    }
+    //The current address space can use INVLPG
+    if((cr3 & VMEM_PTE_ADDR) == (vmem_get_cr3() & VMEM_PTE_ADDR)){
+        if(span <= VMEM_INVLPG_MAX){
+            for(uint64_t addr = vmem_stats.inval_st; addr < vmem_stats.inval_end; addr += 4096)
+                vmem_invlpg((virt_addr_t)addr);
+            vmem_stats.invlpgs += span;
+        } else {
+            vmem_flush_tlb();
+            vmem_stats.flushes++;
+        }
+        return;
+    }
+    //Other address spaces may only have entries cached if they have a PCID
+    if(!pcid_supported)
+        return;
+    int32_t pcid = vmem_pcid_of(cr3);
+    if(pcid < 0)
+        return;
+    if(invpcid_supported && span <= VMEM_INVLPG_MAX){
+        for(uint64_t addr = vmem_stats.inval_st; addr < vmem_stats.inval_end; addr += 4096)
+            vmem_invpcid(0, pcid, addr);
+        vmem_stats.invlpgs += span;
+    } else if(invpcid_supported){
+        vmem_invpcid(1, pcid, 0);
+        vmem_stats.flushes++;
+    } else {
+        //Flush it the next time it's switched to
+        spinlock_acquire(&pcid_lock);
+        pcid_stale[pcid] = 1;
+        spinlock_release(&pcid_lock);
+        vmem_stats.flushes++;
     }
+}
 
-    physwin_disbl = p_disbl;
-    vmem_set_cr3(p_cr3);
+/*
+ * Maps a part of a virtual address range that falls into one table at a specific level
+ */
+static void vmem_map_level(uint64_t* table, uint8_t level, uint64_t virt, uint64_t phys, uint64_t size, uint64_t attr){
+    uint64_t page_size = vmem_page_size(level);
+    uint64_t end = virt + size;
+    //Fill runs of PTEs directly
+    if(level == 0){
+        for(uint64_t i = vmem_idx((virt_addr_t)virt, 0); virt < end; i++, virt += 4096, phys += 4096){
+            if(table[i] & VMEM_PTE_PRESENT)
+                vmem_queue_inval(virt, 4096);
+            table[i] = phys | attr;
+            vmem_stats.pages[0]++;
+        }
+        return;
+    }
+    while(virt < end){
+        uint64_t* entry = &table[vmem_idx((virt_addr_t)virt, level)];
+        uint64_t chunk = ((virt | (page_size - 1)) + 1) - virt;
+        if(chunk > end - virt)
+            chunk = end - virt;
+        //Map a large page if the alignment allows it
+        if(level <= (huge_supported ? 2 : 1) && chunk == page_size && !(phys & (page_size - 1))){
+            if(*entry & VMEM_PTE_PRESENT){
+                if(!(*entry & VMEM_PTE_LARGE))
+                    vmem_free_table(*entry, level - 1);
+                vmem_queue_inval(virt, page_size);
+            }
+            *entry = phys | attr | VMEM_PTE_LARGE;
+            vmem_stats.pages[level]++;
+        } else {
+            //Go one level down otherwise
+            if(!(*entry & VMEM_PTE_PRESENT)){
+                *entry = (uint64_t)vmem_alloc_table() | VMEM_PTE_PRESENT | VMEM_PTE_WRITE | VMEM_PTE_USER;
+                vmem_stats.tables++;
+            } else if(*entry & VMEM_PTE_LARGE){
+                vmem_split(entry, level);
+                vmem_queue_inval(virt, page_size);
+            }
+            vmem_stats.walks++;
+            vmem_map_level(vmem_table(*entry), level - 1, virt, phys, chunk, attr);
+        }
+        virt += chunk;
+        phys += chunk;
+    }
+}
+
+/*
+ * Unmaps a part of a virtual address range that falls into one table at a specific level
+ */
+static void vmem_unmap_level(uint64_t* table, uint8_t level, uint64_t virt, uint64_t size){
+    uint64_t page_size = vmem_page_size(level);
+    uint64_t end = virt + size;
+    while(virt < end){
+        uint64_t* entry = &table[vmem_idx((virt_addr_t)virt, level)];
+        uint64_t chunk = ((virt | (page_size - 1)) + 1) - virt;
+        if(chunk > end - virt)
+            chunk = end - virt;
+        if(*entry & VMEM_PTE_PRESENT){
+            if(level == 0 || (*entry & VMEM_PTE_LARGE && chunk == page_size)){
+                //Clear the whole page
+                *entry = 0;
+                vmem_queue_inval(virt, page_size);
+                vmem_stats.pages[level]++;
+            } else {
+                //Split the large page it's only partially unmapped and go one level down
+                if(*entry & VMEM_PTE_LARGE)
+                    vmem_split(entry, level);
+                vmem_stats.walks++;
+                vmem_unmap_level(vmem_table(*entry), level - 1, virt, chunk);
+            }
+        }
+        virt += chunk;
+    }
+}
+
+/*
+ * Maps a virtual address range to a physical address range with the specified attributes,
+ *   using the largest pages possible
+ */
+static void vmem_map_range(uint64_t cr3, phys_addr_t p_st, phys_addr_t p_end, virt_addr_t v_st, uint64_t attr){
+    memset(&vmem_stats, 0, sizeof(vmem_stats_t));
+    uint64_t size = (((uint64_t)p_end - (uint64_t)p_st) + 4095) & ~4095ULL;
+    vmem_map_level(vmem_table(cr3), 3, (uint64_t)v_st & ~4095ULL, (uint64_t)p_st & VMEM_PTE_ADDR, size, attr);
+    vmem_flush_queued(cr3);
+}
+
+/*
+ * Maps a virtual address range to a physical address range
+ */
+void vmem_map(uint64_t cr3, phys_addr_t p_st, phys_addr_t p_end, virt_addr_t v_st){
+    vmem_map_range(cr3, p_st, p_end, v_st, VMEM_PTE_PRESENT | VMEM_PTE_WRITE);
 }
 
 /*
  * Maps a virtual address range to a physical address range, while setting access mode to userland
  */
 void vmem_map_user(uint64_t cr3, phys_addr_t p_st, phys_addr_t p_end, virt_addr_t v_st){
-    uint64_t p_cr3 = vmem_get_cr3();
-    vmem_set_cr3(vmem_ident_cr3);
-    uint8_t p_disbl = physwin_disbl;
-    physwin_disbl = 1;
-
-    //Loop through the range
-    for(uint64_t offs = 0; offs < p_end - p_st; offs += 4096){
-        //Map one page
-        vmem_create_page_user(cr3, (uint8_t*)v_st + offs, (uint8_t*)p_st + offs);
-    }
+    vmem_map_range(cr3, p_st, p_end, v_st, VMEM_PTE_PRESENT | VMEM_PTE_WRITE | VMEM_PTE_USER);
+}
 
-    physwin_disbl = p_disbl;
-    vmem_set_cr3(p_cr3);
+/*
+ * Maps a virtual address range to a physical address range that is shared with other
+ *   address spaces, making it read-only for userland
+ * The entries are marked so that a write fault can tell the page has to be copied first
+ */
+void vmem_map_user_shared(uint64_t cr3, phys_addr_t p_st, phys_addr_t p_end, virt_addr_t v_st){
+    vmem_map_range(cr3, p_st, p_end, v_st, VMEM_PTE_PRESENT | VMEM_PTE_USER | VMEM_PTE_SHARED);
 }
 
 /*
  * Unmaps a virtual address range
  */
 void vmem_unmap(uint64_t cr3, virt_addr_t v_st, virt_addr_t v_end){
-    uint64_t p_cr3 = vmem_get_cr3();
-    vmem_set_cr3(vmem_ident_cr3);
-    uint8_t p_disbl = physwin_disbl;
-    physwin_disbl = 1;
-
-    //Loop through the range
-    for(uint64_t offs = 0; offs < v_end - v_st; offs += 4096){
-        //Get the PT address for that page and calculate the PTE address
-        phys_addr_t pt_addr = vmem_addr_pt(cr3, (virt_addr_t)((uint8_t*)v_st + offs));
-        uint64_t pte_idx = (((uint64_t)v_st + offs) >> 12) & 0x1FF;
-        uint64_t* pte_addr = (uint64_t*)((uint8_t*)pt_addr + (pte_idx * 8));
-        //Invalidate that PTE entry
-        *pte_addr = 0;
-    }
+    memset(&vmem_stats, 0, sizeof(vmem_stats_t));
+    uint64_t st = (uint64_t)v_st & ~4095ULL;
+    uint64_t end = ((uint64_t)v_end + 4095) & ~4095ULL;
+    vmem_unmap_level(vmem_table(cr3), 3, st, end - st);
+    vmem_flush_queued(cr3);
+}
 
-    physwin_disbl = p_disbl;
-    vmem_set_cr3(p_cr3);
+/*
+ * Returns the counters collected during the last vmem_map, vmem_map_user or vmem_unmap call
+ */
+vmem_stats_t vmem_get_stats(void){
+    return vmem_stats;
 }
 
 
@@ -625,10 +771,8 @@ void vmem_pat_set_range(uint64_t cr3, virt_addr_t st, virt_addr_t end, uint8_t m
         vmem_pat_set(pat_idx, mem_type);
     //Go through addresses
     for(uint64_t offs = 0; offs <= end - st; offs += 4 * 1024){
-        //From CR3, get the PT entry describing a page
-        uint64_t* pt = vmem_addr_pt(cr3, st);
-        //Calculate the entry offset
-        uint64_t* pte = pt + (((uint64_t)((uint64_t)st + offs) >> 12) & 0x1FF);
+        //From CR3, get the PT entry describing a page (splitting the large page it's in)
+        uint64_t* pte = vmem_walk(cr3, (virt_addr_t)((uint8_t*)st + offs), 0);
         //Clear PWT, PCD and PAT bits of the entry
         *pte &= ~((1 << 3) | (1 << 4) | (1 << 7));
         //Set bits according to the PAT index
@@ -655,22 +799,62 @@ void vmem_set_cr3(uint64_t cr3){
 }
 
 /*
- * Creates a new PCID
+ * Makes the upper half of the boot address space (the kernel half) visible in another one
  */
-uint16_t vmem_create_pcid(void){
-    return pcid_next++;
+void vmem_share_upper(uint64_t cr3){
+    uint64_t* src = vmem_table(vmem_boot_cr3);
+    uint64_t* dst = vmem_table(cr3);
+    if(src == dst)
+        return;
+    memcpy(dst + 256, src + 256, 256 * sizeof(uint64_t));
+}
+
+/*
+ * Frees a PML4 structure created by vmem_create_pml4() along with the tables of the lower half
+ * The upper half is shared by all address spaces and is left alone.
+ *   Switches to the boot address space first if it's the current one
+ */
+void vmem_destroy_pml4(uint64_t cr3){
+    uint64_t pml4 = cr3 & VMEM_PTE_ADDR;
+    if(pml4 == (vmem_boot_cr3 & VMEM_PTE_ADDR))
+        return;
+    if((vmem_get_cr3() & VMEM_PTE_ADDR) == pml4)
+        vmem_set_cr3(vmem_switch_cr3(vmem_boot_cr3));
+    //Make sure the PCID isn't matched to a new PML4 at the same address
+    spinlock_acquire(&pcid_lock);
+    int32_t pcid = vmem_pcid_of(cr3);
+    if(pcid > 0){
+        pcid_owner[pcid] = 0;
+        pcid_stale[pcid] = 1;
+    }
+    spinlock_release(&pcid_lock);
+    uint64_t* table = vmem_table(pml4);
+    for(int i = 0; i < 256; i++)
+        if(table[i] & VMEM_PTE_PRESENT)
+            vmem_free_table(table[i], 2);
+    pmem_free((phys_addr_t)pml4, 0);
 }
 
 /*
  * Maps all default ranges for the specified address space
  */
 void vmem_map_defaults(uint64_t cr3){
+    //The default ranges are only mapped once, in the boot address space.
+    //  All PDPTs of its upper half exist from then on, so copying the PML4 entries
+    //  makes every mapping in the kernel half (including later ones) shared
+    if((cr3 & VMEM_PTE_ADDR) != (vmem_boot_cr3 & VMEM_PTE_ADDR)){
+        vmem_share_upper(cr3);
+        return;
+    }
+    //Create the PDPTs
+    uint64_t* pml4 = vmem_table(cr3);
+    for(int i = 256; i < 512; i++)
+        if(!(pml4[i] & VMEM_PTE_PRESENT))
+            pml4[i] = (uint64_t)vmem_alloc_table() | VMEM_PTE_PRESENT | VMEM_PTE_WRITE | VMEM_PTE_USER;
     //Map kernel code and static variables at the third quarter
     vmem_map(cr3, (phys_addr_t)krnl_get_pos().offset,
                   (phys_addr_t)(krnl_get_pos().offset + krnl_get_pos().size),
                   (virt_addr_t)(0xFFFF800000000000ULL));
-    //Map the dynamic RAM range
-    dram_map(cr3);
     //Map the APIC window at the very end of the address space
     vmem_map(cr3, (phys_addr_t)0xFEE00000,
                   (phys_addr_t)0xFEE01000,
@@ -679,12 +863,4 @@ void vmem_map_defaults(uint64_t cr3){
     vmem_map(cr3, gfx_physbase(),
                   (phys_addr_t)((uint64_t)gfx_physbase() + (gfx_res_x() * gfx_res_y() * 4)),
                   (virt_addr_t)0xFFFF880000000000ULL);
-
-    //Set up physwin
-    //Initially map at 0x0
-    vmem_create_page(cr3, (virt_addr_t)0xFFFFFFFFFFFFB000ULL, (phys_addr_t)0);
-    vmem_create_page(cr3, (virt_addr_t)0xFFFFFFFFFFFFC000ULL, (phys_addr_t)0);
-    //Get corresponding PT address and map it at 0xFFFFFFFFFFFFD000
-    phys_addr_t pt_addr = vmem_addr_pt(cr3, (virt_addr_t)0xFFFFFFFFFFFFB000ULL);
-    vmem_create_page(cr3, (virt_addr_t)0xFFFFFFFFFFFFD000ULL, pt_addr);
-}
\ No newline at end of file
+}
@@ -1,53 +1,117 @@
+#ifndef VMEM_H
+#define VMEM_H
+
 #include "../stdlib.h"
 
 //Page Attribute Table MSR
 #define MSR_IA32_PAT                0x277
 
+//Base of the direct physical map
+#define VMEM_DMAP_BASE              0xFFFFC00000000000ULL
+#define VMEM_DMAP_MAX_RANGES        64
+//Large page size
+#define VMEM_LARGE_PAGE             (2ULL * 1024 * 1024)
+
+//Start of the kernel half of the address space
+#define VMEM_KRNL_HALF              0xFFFF800000000000ULL
+//CR3 bit that preserves the TLB entries of the PCID being loaded
+#define VMEM_CR3_NOFLUSH            (1ULL << 63)
+
+//Number of pages up to which they are invalidated one by one instead of flushing the TLB
+#define VMEM_INVLPG_MAX             32
+
+//Paging structure entry bits
+#define VMEM_PTE_PRESENT            (1ULL << 0)
+#define VMEM_PTE_WRITE              (1ULL << 1)
+#define VMEM_PTE_USER               (1ULL << 2)
+#define VMEM_PTE_PWT                (1ULL << 3)
+#define VMEM_PTE_PCD                (1ULL << 4)
+#define VMEM_PTE_ACCESSED           (1ULL << 5)
+#define VMEM_PTE_DIRTY              (1ULL << 6)
+#define VMEM_PTE_PAT                (1ULL << 7)
+#define VMEM_PTE_LARGE              (1ULL << 7)
+#define VMEM_PTE_GLOBAL             (1ULL << 8)
+//Available to software: the frame is shared with other address spaces and must not be written to
+#define VMEM_PTE_SHARED             (1ULL << 9)
+#define VMEM_PTE_LARGE_PAT          (1ULL << 12)
+#define VMEM_PTE_NX                 (1ULL << 63)
+#define VMEM_PTE_ADDR               0x000FFFFFFFFFF000ULL
+
 typedef void* virt_addr_t;
 typedef void* phys_addr_t;
 
+//Structure definitions
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} vmem_dmap_range_t;
+
+/*
+ * Counters collected during a mapping operation
+ */
+typedef struct {
+    uint64_t walks;
+    uint64_t tables;
+    uint64_t splits;
+    uint64_t pages[3];
+    uint64_t inval_pages;
+    uint64_t invlpgs;
+    uint64_t flushes;
+    uint64_t inval_st;
+    uint64_t inval_end;
+} vmem_stats_t;
+
+/*
+ * PCID allocator statistics
+ */
+typedef struct {
+    uint64_t assigned;
+    uint64_t generations;
+    uint64_t flushing_loads;
+    uint64_t noflush_loads;
+} vmem_pcid_stats_t;
+
 //Function prototypes
 
-//Physwin stuff
-void     vmem_enable_physwin  (void);
-uint64_t vmem_physwin_set     (phys_addr_t addr);
-void     vmem_physwin_write32 (phys_addr_t addr, uint32_t val);
-uint32_t vmem_physwin_read32  (phys_addr_t addr);
-void     vmem_physwin_write64 (phys_addr_t addr, uint64_t val);
-uint64_t vmem_physwin_read64  (phys_addr_t addr);
+//Direct physical map
+void*    vmem_phys_to_virt  (phys_addr_t addr);
+void     vmem_phys_write64  (phys_addr_t addr, uint64_t val);
+uint64_t vmem_phys_read64   (phys_addr_t addr);
+void     vmem_dmap_add      (phys_addr_t start, uint64_t size);
+void     vmem_dmap_build    (uint64_t cr3);
 //CR3/PCID management
-uint64_t vmem_get_cr3        (void);
-void     vmem_set_cr3        (uint64_t cr3);
-uint8_t  vmem_pcid_supported (void);
-uint16_t vmem_create_pcid    (void);
-uint64_t vmem_create_pml4    (uint16_t pcid);
+uint64_t          vmem_get_cr3        (void);
+void              vmem_set_cr3        (uint64_t cr3);
+uint8_t           vmem_pcid_supported (void);
+uint64_t          vmem_create_pml4    (void);
+void              vmem_destroy_pml4   (uint64_t cr3);
+uint64_t          vmem_switch_cr3     (uint64_t cr3);
+vmem_pcid_stats_t vmem_get_pcid_stats (void);
 //Core functions
-void vmem_init(void);
-void vmem_enable_trans(void);
-//PDPT management
-void        vmem_create_pdpt  (uint64_t cr3, virt_addr_t at);
-uint8_t     vmem_present_pdpt (uint64_t cr3, virt_addr_t at);
-phys_addr_t vmem_addr_pdpt    (uint64_t cr3, virt_addr_t at);
-//PD management
-void        vmem_create_pd  (uint64_t cr3, virt_addr_t at);
-uint8_t     vmem_present_pd (uint64_t cr3, virt_addr_t at);
-phys_addr_t vmem_addr_pd    (uint64_t cr3, virt_addr_t at);
-//PT management
-void        vmem_create_pt  (uint64_t cr3, virt_addr_t at);
-uint8_t     vmem_present_pt (uint64_t cr3, virt_addr_t at);
-phys_addr_t vmem_addr_pt    (uint64_t cr3, virt_addr_t at);
+void        vmem_init         (void);
+void        vmem_enable_trans (void);
+phys_addr_t vmem_alloc_table  (void);
 //Page management
 void        vmem_create_page      (uint64_t cr3, virt_addr_t at, phys_addr_t from);
 void        vmem_create_page_user (uint64_t cr3, virt_addr_t at, phys_addr_t from);
 uint8_t     vmem_present_page     (uint64_t cr3, virt_addr_t at);
+uint64_t    vmem_page_entry       (uint64_t cr3, virt_addr_t at);
 phys_addr_t vmem_virt_to_phys     (uint64_t cr3, virt_addr_t at);
 //Mapping/unmapping functions
-void vmem_map          (uint64_t cr3, phys_addr_t p_st, phys_addr_t p_end, virt_addr_t v_st);
-void vmem_map_user     (uint64_t cr3, phys_addr_t p_st, phys_addr_t p_end, virt_addr_t v_st);
-void vmem_unmap        (uint64_t cr3, virt_addr_t v_st, virt_addr_t v_end);
-void vmem_map_defaults (uint64_t cr3);
+void vmem_map             (uint64_t cr3, phys_addr_t p_st, phys_addr_t p_end, virt_addr_t v_st);
+void vmem_map_user        (uint64_t cr3, phys_addr_t p_st, phys_addr_t p_end, virt_addr_t v_st);
+void vmem_map_user_shared (uint64_t cr3, phys_addr_t p_st, phys_addr_t p_end, virt_addr_t v_st);
+void vmem_unmap           (uint64_t cr3, virt_addr_t v_st, virt_addr_t v_end);
+void vmem_map_defaults    (uint64_t cr3);
+void vmem_share_upper     (uint64_t cr3);
+void vmem_write_protect   (uint8_t enable);
+//Statistics
+vmem_stats_t vmem_get_stats (void);
 //TLB and PAT control
 void vmem_invlpg        (phys_addr_t addr);
 void vmem_pat_print     (void);
 void vmem_pat_set       (uint8_t idx, uint8_t mem_type);
-void vmem_pat_set_range (uint64_t cr3, virt_addr_t st, virt_addr_t end, uint8_t mem_type);
\ No newline at end of file
+void vmem_pat_set_range (uint64_t cr3, virt_addr_t st, virt_addr_t end, uint8_t mem_type);
+
+#endif